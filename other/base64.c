@@ -44,16 +44,50 @@
 
 #include <sys/types.h>
 
-#include <ctype.h>
 #include <stdio.h>
 
 #include <stdlib.h>
 #include <string.h>
 
+#include <reopbase64.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define B64_X86
+#include <immintrin.h>
+#endif
+
 static const char Base64[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const char Pad64 = '=';
 
+/*
+ * decoding table: the value of each base64 character, or one of the
+ * following for whitespace (as isspace in the C locale), pad, and
+ * everything else.
+ */
+#define SP 0x80
+#define PD 0x81
+#define XX 0xff
+
+static const u_char B64Dec[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, SP, SP, SP, SP, SP, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	SP, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, PD, XX, XX,
+	XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+	XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
 /* (From RFC1521 and draft-ietf-dnssec-secext-03.txt)
    The following encoding technique is taken from RFC 1521 by Borenstein
    and Freed.  It is reproduced here in a slightly edited form for
@@ -117,6 +151,122 @@ static const char Pad64 = '=';
 	   characters followed by one "=" padding character.
    */
 
+/*
+ * bulk encoding of whole quanta, for the common case. these never read
+ * past srclength, and return the number of bytes consumed, a multiple of
+ * three. exactly four characters are stored at the target for every three
+ * bytes consumed.
+ */
+static size_t
+b64_encrun_scalar(u_char const *src, size_t srclength, char *target)
+{
+	size_t i;
+
+	for (i = 0; 2 < srclength - i; i += 3) {
+		*target++ = Base64[src[i] >> 2];
+		*target++ = Base64[((src[i] & 0x03) << 4) + (src[i + 1] >> 4)];
+		*target++ = Base64[((src[i + 1] & 0x0f) << 2) + (src[i + 2] >> 6)];
+		*target++ = Base64[src[i + 2] & 0x3f];
+	}
+	return (i);
+}
+
+#ifdef B64_X86
+/*
+ * the vector encoders spread each three bytes over four, then pull out
+ * the 6 bit values with multiplies, and translate them to characters
+ * by adding an offset chosen per range of values.
+ */
+__attribute__((target("ssse3")))
+static size_t
+b64_encrun_ssse3(u_char const *src, size_t srclength, char *target)
+{
+	const __m128i spread = _mm_setr_epi8(
+	    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m128i lut = _mm_setr_epi8(
+	    71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0);
+	size_t i = 0;
+
+	while (srclength - i >= 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		in = _mm_shuffle_epi8(in, spread);
+		__m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+		__m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+		__m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+		__m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+		__m128i indices = _mm_or_si128(t1, t3);
+
+		__m128i off = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		__m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+		off = _mm_or_si128(off, _mm_and_si128(less, _mm_set1_epi8(13)));
+		off = _mm_shuffle_epi8(lut, off);
+		_mm_storeu_si128((__m128i *)target, _mm_add_epi8(indices, off));
+		i += 12;
+		target += 16;
+	}
+	return (i + b64_encrun_scalar(src + i, srclength - i, target));
+}
+
+__attribute__((target("avx2")))
+static size_t
+b64_encrun_avx2(u_char const *src, size_t srclength, char *target)
+{
+	const __m256i spread = _mm256_setr_epi8(
+	    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+	    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i lut = _mm256_setr_epi8(
+	    71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0,
+	    71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 65, 0, 0);
+	size_t i = 0;
+
+	while (srclength - i >= 28) {
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+		    _mm_loadu_si128((const __m128i *)(src + i))),
+		    _mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+		in = _mm256_shuffle_epi8(in, spread);
+		__m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+		__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		__m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+		__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		__m256i indices = _mm256_or_si256(t1, t3);
+
+		__m256i off = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		__m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		off = _mm256_or_si256(off,
+		    _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		off = _mm256_shuffle_epi8(lut, off);
+		_mm256_storeu_si256((__m256i *)target,
+		    _mm256_add_epi8(indices, off));
+		i += 24;
+		target += 32;
+	}
+	return (i + b64_encrun_ssse3(src + i, srclength - i, target));
+}
+#endif
+
+static size_t b64_encrun_resolve(u_char const *, size_t, char *);
+
+/* picks the best encoder for this cpu on first use */
+static size_t (*b64_encrun)(u_char const *, size_t, char *) =
+    b64_encrun_resolve;
+
+static size_t
+b64_encrun_resolve(u_char const *src, size_t srclength, char *target)
+{
+	size_t (*fn)(u_char const *, size_t, char *);
+
+	fn = b64_encrun_scalar;
+#ifdef B64_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fn = b64_encrun_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		fn = b64_encrun_ssse3;
+#endif
+	b64_encrun = fn;
+	return fn(src, srclength, target);
+}
+
 int
 reopb64_ntop(src, srclength, target, targsize)
 	u_char const *src;
@@ -129,6 +279,14 @@ reopb64_ntop(src, srclength, target, targsize)
 	u_char output[4];
 	int i;
 
+	/* Whole quanta go fast, if there's room. */
+	if (srclength / 3 * 4 < targsize) {
+		size_t amt = b64_encrun(src, srclength, target);
+		src += amt;
+		srclength -= amt;
+		datalength = amt / 3 * 4;
+	}
+
 	while (2 < srclength) {
 		input[0] = *src++;
 		input[1] = *src++;
@@ -175,6 +333,273 @@ reopb64_ntop(src, srclength, target, targsize)
 	return (datalength);
 }
 
+/*
+ * incremental encoding. output is wrapped at 76 columns, and every line,
+ * including the last, ends with a newline. the output of update and final
+ * is not nul terminated. they return the number of characters stored at
+ * the target, or -1 if it's too small; 4 / 3 of the input plus a newline
+ * for every 57 bytes and one extra line is always enough.
+ */
+#define B64LINE 76
+
+void
+reopb64_enc_init(struct reopb64_enc *enc)
+{
+	enc->inlen = 0;
+	enc->col = 0;
+}
+
+static size_t
+b64_quantum(struct reopb64_enc *enc, u_char const *input, char *target)
+{
+	size_t datalength = 0;
+
+	target[datalength++] = Base64[input[0] >> 2];
+	target[datalength++] = Base64[((input[0] & 0x03) << 4) + (input[1] >> 4)];
+	target[datalength++] = Base64[((input[1] & 0x0f) << 2) + (input[2] >> 6)];
+	target[datalength++] = Base64[input[2] & 0x3f];
+	enc->col += 4;
+	if (enc->col == B64LINE) {
+		target[datalength++] = '\n';
+		enc->col = 0;
+	}
+	return (datalength);
+}
+
+int
+reopb64_enc_update(struct reopb64_enc *enc, u_char const *src, size_t srclength,
+    char *target, size_t targsize)
+{
+	size_t datalength = 0;
+	size_t quanta, needed;
+
+	quanta = (enc->inlen + srclength) / 3;
+	needed = quanta * 4 + (enc->col + quanta * 4) / B64LINE;
+	if (needed > targsize)
+		return (-1);
+
+	if (enc->inlen != 0) {
+		while (enc->inlen < 3 && srclength != 0) {
+			enc->in[enc->inlen++] = *src++;
+			srclength--;
+		}
+		if (enc->inlen < 3)
+			return (0);
+		datalength += b64_quantum(enc, enc->in, target + datalength);
+		enc->inlen = 0;
+	}
+	/* Finish the current line, then do whole lines in bulk. */
+	while (enc->col != 0 && 2 < srclength) {
+		datalength += b64_quantum(enc, src, target + datalength);
+		src += 3;
+		srclength -= 3;
+	}
+	while (B64LINE / 4 * 3 <= srclength) {
+		b64_encrun(src, B64LINE / 4 * 3, target + datalength);
+		datalength += B64LINE;
+		target[datalength++] = '\n';
+		src += B64LINE / 4 * 3;
+		srclength -= B64LINE / 4 * 3;
+	}
+	while (2 < srclength) {
+		datalength += b64_quantum(enc, src, target + datalength);
+		src += 3;
+		srclength -= 3;
+	}
+	while (srclength != 0) {
+		enc->in[enc->inlen++] = *src++;
+		srclength--;
+	}
+	return (datalength);
+}
+
+int
+reopb64_enc_final(struct reopb64_enc *enc, char *target, size_t targsize)
+{
+	size_t datalength = 0;
+
+	if (enc->inlen != 0) {
+		if (targsize < 5)
+			return (-1);
+		if (reopb64_ntop(enc->in, enc->inlen, target, targsize) != 4)
+			return (-1);
+		datalength = 4;
+		enc->col += 4;
+		enc->inlen = 0;
+	}
+	if (enc->col != 0) {
+		if (datalength + 1 > targsize)
+			return (-1);
+		target[datalength++] = '\n';
+		enc->col = 0;
+	}
+	return (datalength);
+}
+
+/*
+ * bulk decoding of runs of base64 characters, without whitespace or
+ * padding, into the target. these stop at the first character that isn't
+ * in the alphabet, or when there isn't room for another block, leaving
+ * the rest to the careful character at a time code. they return the
+ * number of characters consumed, always a multiple of four, and set
+ * *tarlength to the number of bytes stored. the vector versions may
+ * write up to a full vector past the decoded bytes, but never past
+ * targsize.
+ */
+static size_t
+b64_decblocks_scalar(char const *src, size_t srclength, u_char *target,
+    size_t targsize, size_t *tarlength)
+{
+	const u_char *s = (const u_char *)src;
+	size_t i = 0, tarindex = 0;
+
+	while (srclength - i >= 4 && targsize - tarindex >= 3) {
+		u_char a = B64Dec[s[i]], b = B64Dec[s[i + 1]];
+		u_char c = B64Dec[s[i + 2]], d = B64Dec[s[i + 3]];
+		if ((a | b | c | d) & 0xc0)
+			break;
+		target[tarindex++] = (a << 2) | (b >> 4);
+		target[tarindex++] = (b << 4) | (c >> 2);
+		target[tarindex++] = (c << 6) | d;
+		i += 4;
+	}
+	*tarlength = tarindex;
+	return (i);
+}
+
+#ifdef B64_X86
+/*
+ * the vector decoders classify each character by its high and low nibbles.
+ * lut_lo and lut_hi have a common bit set only for invalid characters, and
+ * lut_roll has the offset that turns each class of valid character into
+ * its value. then the 6 bit values are packed together.
+ */
+__attribute__((target("sse4.1")))
+static size_t
+b64_decblocks_sse41(char const *src, size_t srclength, u_char *target,
+    size_t targsize, size_t *tarlength)
+{
+	const __m128i lut_lo = _mm_setr_epi8(
+	    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(
+	    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(
+	    0, 16, 19, 4, -65, -65, -71, -71,
+	    0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	const __m128i pack = _mm_setr_epi8(
+	    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	size_t i = 0, tarindex = 0, more;
+
+	while (srclength - i >= 16 && targsize - tarindex >= 16) {
+		__m128i str = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+		__m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+		__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+		__m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm_testz_si128(lo, hi))
+			break;
+		__m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+		__m128i roll = _mm_shuffle_epi8(lut_roll,
+		    _mm_add_epi8(eq_2f, hi_nibbles));
+		str = _mm_add_epi8(str, roll);
+
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		str = _mm_shuffle_epi8(str, pack);
+		_mm_storeu_si128((__m128i *)(target + tarindex), str);
+		i += 16;
+		tarindex += 12;
+	}
+	i += b64_decblocks_scalar(src + i, srclength - i, target + tarindex,
+	    targsize - tarindex, &more);
+	*tarlength = tarindex + more;
+	return (i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+b64_decblocks_avx2(char const *src, size_t srclength, u_char *target,
+    size_t targsize, size_t *tarlength)
+{
+	const __m256i lut_lo = _mm256_setr_epi8(
+	    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+	    0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(
+	    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	    0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+	    0, 16, 19, 4, -65, -65, -71, -71,
+	    0, 0, 0, 0, 0, 0, 0, 0,
+	    0, 16, 19, 4, -65, -65, -71, -71,
+	    0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	const __m256i pack = _mm256_setr_epi8(
+	    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+	size_t i = 0, tarindex = 0, more;
+
+	while (srclength - i >= 32 && targsize - tarindex >= 32) {
+		__m256i str = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4),
+		    mask_2f);
+		__m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+		__m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+		__m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+		__m256i roll = _mm256_shuffle_epi8(lut_roll,
+		    _mm256_add_epi8(eq_2f, hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		str = _mm256_permutevar8x32_epi32(str, lanes);
+		_mm256_storeu_si256((__m256i *)(target + tarindex), str);
+		i += 32;
+		tarindex += 24;
+	}
+	i += b64_decblocks_sse41(src + i, srclength - i, target + tarindex,
+	    targsize - tarindex, &more);
+	*tarlength = tarindex + more;
+	return (i);
+}
+#endif
+
+static size_t b64_decblocks_resolve(char const *, size_t, u_char *, size_t,
+    size_t *);
+
+/* picks the best decoder for this cpu on first use */
+static size_t (*b64_decblocks)(char const *, size_t, u_char *, size_t,
+    size_t *) = b64_decblocks_resolve;
+
+static size_t
+b64_decblocks_resolve(char const *src, size_t srclength, u_char *target,
+    size_t targsize, size_t *tarlength)
+{
+	size_t (*fn)(char const *, size_t, u_char *, size_t, size_t *);
+
+	fn = b64_decblocks_scalar;
+#ifdef B64_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fn = b64_decblocks_avx2;
+	else if (__builtin_cpu_supports("sse4.1"))
+		fn = b64_decblocks_sse41;
+#endif
+	b64_decblocks = fn;
+	return fn(src, srclength, target, targsize, tarlength);
+}
+
 /* skips all whitespace anywhere.
    converts characters, four at a time, starting at (or after)
    src from base - 64 numbers into three 8 bit bytes in the target area.
@@ -187,30 +612,42 @@ reopb64_pton(src, target, targsize)
 	u_char *target;
 	size_t targsize;
 {
-	int tarindex, state, ch;
+	int tarindex, state, ch, val;
 	u_char nextbyte;
-	char *pos;
+	char const *srcend = src + strlen(src);
+	size_t used, amt;
 
 	state = 0;
 	tarindex = 0;
 
 	while ((ch = (unsigned char)*src++) != '\0') {
-		if (isspace(ch))	/* Skip whitespace anywhere. */
+		val = B64Dec[ch];
+		if (val == SP)		/* Skip whitespace anywhere. */
 			continue;
 
-		if (ch == Pad64)
+		if (val == PD)
 			break;
 
-		pos = strchr(Base64, ch);
-		if (pos == 0) 		/* A non-base64 character. */
+		if (val == XX) 		/* A non-base64 character. */
 			return (-1);
 
+		if (state == 0 && target) {
+			/* Whole runs of characters can go fast. */
+			used = b64_decblocks(src - 1, srcend - src + 1,
+			    target + tarindex, targsize - tarindex, &amt);
+			if (used != 0) {
+				src += used - 1;
+				tarindex += amt;
+				continue;
+			}
+		}
+
 		switch (state) {
 		case 0:
 			if (target) {
 				if (tarindex >= targsize)
 					return (-1);
-				target[tarindex] = (pos - Base64) << 2;
+				target[tarindex] = val << 2;
 			}
 			state = 1;
 			break;
@@ -218,8 +655,8 @@ reopb64_pton(src, target, targsize)
 			if (target) {
 				if (tarindex >= targsize)
 					return (-1);
-				target[tarindex]   |=  (pos - Base64) >> 4;
-				nextbyte = ((pos - Base64) & 0x0f) << 4;
+				target[tarindex]   |=  val >> 4;
+				nextbyte = (val & 0x0f) << 4;
 				if (tarindex + 1 < targsize)
 					target[tarindex+1] = nextbyte;
 				else if (nextbyte)
@@ -232,8 +669,8 @@ reopb64_pton(src, target, targsize)
 			if (target) {
 				if (tarindex >= targsize)
 					return (-1);
-				target[tarindex]   |=  (pos - Base64) >> 2;
-				nextbyte = ((pos - Base64) & 0x03) << 6;
+				target[tarindex]   |=  val >> 2;
+				nextbyte = (val & 0x03) << 6;
 				if (tarindex + 1 < targsize)
 					target[tarindex+1] = nextbyte;
 				else if (nextbyte)
@@ -246,7 +683,7 @@ reopb64_pton(src, target, targsize)
 			if (target) {
 				if (tarindex >= targsize)
 					return (-1);
-				target[tarindex] |= (pos - Base64);
+				target[tarindex] |= val;
 			}
 			tarindex++;
 			state = 0;
@@ -269,7 +706,7 @@ reopb64_pton(src, target, targsize)
 		case 2:		/* Valid, means one byte of info */
 			/* Skip any number of spaces. */
 			for (; ch != '\0'; ch = (unsigned char)*src++)
-				if (!isspace(ch))
+				if (B64Dec[ch] != SP)
 					break;
 			/* Make sure there is another trailing = sign. */
 			if (ch != Pad64)
@@ -284,7 +721,7 @@ reopb64_pton(src, target, targsize)
 			 * whitespace after it?
 			 */
 			for (; ch != '\0'; ch = (unsigned char)*src++)
-				if (!isspace(ch))
+				if (B64Dec[ch] != SP)
 					return (-1);
 
 			/*
@@ -308,3 +745,113 @@ reopb64_pton(src, target, targsize)
 
 	return (tarindex);
 }
+
+/*
+ * incremental decoding, with the same rules as reopb64_pton.
+ * whitespace is skipped anywhere, and the decoder stops at the first '-',
+ * which begins the guard line after the data. srcused is set to the number
+ * of characters consumed, so the caller can find the guard. update returns
+ * the number of data bytes stored at the target, or -1 on error; srclength
+ * * 3 / 4 + 3 bytes is always enough. final returns -1 unless the data
+ * ended on a byte boundary or was properly padded.
+ */
+void
+reopb64_dec_init(struct reopb64_dec *dec)
+{
+	dec->state = 0;
+	dec->pad = 0;
+	dec->bits = 0;
+	dec->done = 0;
+}
+
+int
+reopb64_dec_update(struct reopb64_dec *dec, char const *src, size_t srclength,
+    u_char *target, size_t targsize, size_t *srcused)
+{
+	size_t i, tarindex = 0, used, amt;
+	int ch, val;
+
+	if (srclength * 3 / 4 + 3 > targsize)
+		return (-1);
+
+	for (i = 0; i < srclength && !dec->done; i++) {
+		ch = (unsigned char)src[i];
+		val = B64Dec[ch];
+		if (val == SP)		/* Skip whitespace anywhere. */
+			continue;
+		if (ch == '-') {	/* The guard line. */
+			dec->done = 1;
+			break;
+		}
+		if (val == PD) {
+			/* pad is the number of = still expected, -1 after all */
+			if (dec->pad == -1)
+				return (-1);
+			if (dec->pad == 0) {
+				if (dec->state == 2)		/* one byte of info */
+					dec->pad = 2;
+				else if (dec->state == 3)	/* two bytes of info */
+					dec->pad = 1;
+				else
+					return (-1);
+				/* The extra bits must be zeros. */
+				if (dec->bits != 0)
+					return (-1);
+			}
+			if (--dec->pad == 0)
+				dec->pad = -1;
+			continue;
+		}
+		/* Nothing but whitespace after the padding. */
+		if (dec->pad != 0)
+			return (-1);
+
+		if (val == XX)
+			return (-1);
+
+		if (dec->state == 0) {
+			/* Whole runs of characters can go fast. */
+			used = b64_decblocks(src + i, srclength - i,
+			    target + tarindex, targsize - tarindex, &amt);
+			if (used != 0) {
+				i += used - 1;
+				tarindex += amt;
+				continue;
+			}
+		}
+
+		switch (dec->state) {
+		case 0:
+			dec->bits = val;
+			dec->state = 1;
+			break;
+		case 1:
+			target[tarindex++] = (dec->bits << 2) | (val >> 4);
+			dec->bits = val & 0x0f;
+			dec->state = 2;
+			break;
+		case 2:
+			target[tarindex++] = (dec->bits << 4) | (val >> 2);
+			dec->bits = val & 0x03;
+			dec->state = 3;
+			break;
+		case 3:
+			target[tarindex++] = (dec->bits << 6) | val;
+			dec->bits = 0;
+			dec->state = 0;
+			break;
+		}
+	}
+	*srcused = i;
+	return (tarindex);
+}
+
+int
+reopb64_dec_final(struct reopb64_dec *dec)
+{
+	if (dec->pad == -1)
+		return (0);
+	if (dec->pad != 0 || dec->state != 0)
+		return (-1);
+	return (0);
+}
@@ -18,10 +18,12 @@
 #include <sys/types.h>
 #include <sys/param.h>
 
+#include <pthread.h>
 # include <stdlib.h>
 #include <string.h>
 
 # include <blf.h>
+#include <util.h>
 
 #include <sodium.h>
 #define SHA512_DIGEST_LENGTH crypto_hash_sha512_BYTES
@@ -53,32 +55,160 @@
 #define BCRYPT_BLOCKS 8
 #define BCRYPT_HASHSIZE (BCRYPT_BLOCKS * 4)
 
+/*
+ * The hash carries its own blowfish. The inputs are always 64 byte SHA512
+ * digests, which are converted to words once instead of a byte at a time
+ * for every one of the 129 expansions, the initial state is copied from
+ * a cache line aligned template, and the S-boxes are one flat 4K table.
+ * The result is identical to the generic blowfish code.
+ * This is no faster for a single hash: each round is a chain of dependent
+ * S-box loads, which the removed work was already hidden behind. It is
+ * here as the layout the lane kernel below is built on, which does run
+ * faster, and to keep the single hash path in step with it.
+ */
+#define BCRYPT_WORDS (SHA512_DIGEST_LENGTH / 4)
+
+#if defined(__GNUC__)
+#define BCRYPT_ALIGNED __attribute__((aligned(64)))
+#else
+#define BCRYPT_ALIGNED
+#endif
+
+struct bcrypt_state {
+	uint32_t S[4 * 256];
+	uint32_t P[BLF_N + 2];
+} BCRYPT_ALIGNED;
+
+static struct bcrypt_state bcrypt_initial;
+static pthread_once_t bcrypt_once = PTHREAD_ONCE_INIT;
+
+static void
+bcrypt_initonce(void)
+{
+	blf_ctx c;
+	int i;
+
+	Blowfish_initstate(&c);
+	for (i = 0; i < 4; i++)
+		memcpy(bcrypt_initial.S + 256 * i, c.S[i], sizeof(c.S[i]));
+	memcpy(bcrypt_initial.P, c.P, sizeof(c.P));
+}
+
+static void
+bcrypt_words(const u_int8_t *data, uint32_t *words)
+{
+	int i;
+
+	for (i = 0; i < BCRYPT_WORDS; i++, data += 4)
+		words[i] = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+		    (uint32_t)data[2] << 8 | data[3];
+}
+
+#define BCRYPT_F(S, x) \
+	(((S[(x) >> 24] + S[0x100 + ((x) >> 16 & 0xff)]) ^ \
+	S[0x200 + ((x) >> 8 & 0xff)]) + S[0x300 + ((x) & 0xff)])
+#define BCRYPT_RND(S, P, i, j, n) (i ^= (P)[n] ^ BCRYPT_F(S, j))
+
+static inline void
+bcrypt_encipher(const uint32_t *S, const uint32_t *P, uint32_t *xl,
+    uint32_t *xr)
+{
+	uint32_t l = *xl, r = *xr;
+
+	l ^= P[0];
+	BCRYPT_RND(S, P, r, l, 1); BCRYPT_RND(S, P, l, r, 2);
+	BCRYPT_RND(S, P, r, l, 3); BCRYPT_RND(S, P, l, r, 4);
+	BCRYPT_RND(S, P, r, l, 5); BCRYPT_RND(S, P, l, r, 6);
+	BCRYPT_RND(S, P, r, l, 7); BCRYPT_RND(S, P, l, r, 8);
+	BCRYPT_RND(S, P, r, l, 9); BCRYPT_RND(S, P, l, r, 10);
+	BCRYPT_RND(S, P, r, l, 11); BCRYPT_RND(S, P, l, r, 12);
+	BCRYPT_RND(S, P, r, l, 13); BCRYPT_RND(S, P, l, r, 14);
+	BCRYPT_RND(S, P, r, l, 15); BCRYPT_RND(S, P, l, r, 16);
+	*xl = r ^ P[BLF_N + 1];
+	*xr = l;
+}
+
+/*
+ * Blowfish_expandstate for 64 byte inputs. The subkeys are final once the
+ * first 18 words are done, so the S-box pass runs from a local copy which
+ * the compiler can keep out of the way of the S-box stores.
+ */
 static void
-bcrypt_hash(u_int8_t *sha2pass, u_int8_t *sha2salt, u_int8_t *out)
+bcrypt_expandstate(struct bcrypt_state *st, const uint32_t *data,
+    const uint32_t *key)
 {
-	blf_ctx state;
+	uint32_t *S = st->S, P[BLF_N + 2];
+	uint32_t l = 0, r = 0;
+	int i, j = 0;
+
+	for (i = 0; i < BLF_N + 2; i++)
+		st->P[i] ^= key[i % BCRYPT_WORDS];
+	for (i = 0; i < BLF_N + 2; i += 2) {
+		l ^= data[j++ % BCRYPT_WORDS];
+		r ^= data[j++ % BCRYPT_WORDS];
+		bcrypt_encipher(S, st->P, &l, &r);
+		st->P[i] = l;
+		st->P[i + 1] = r;
+	}
+	memcpy(P, st->P, sizeof(P));
+	for (i = 0; i < 4 * 256; i += 2) {
+		l ^= data[j++ % BCRYPT_WORDS];
+		r ^= data[j++ % BCRYPT_WORDS];
+		bcrypt_encipher(S, P, &l, &r);
+		S[i] = l;
+		S[i + 1] = r;
+	}
+}
+
+/* Blowfish_expand0state, likewise */
+static void
+bcrypt_expand0state(struct bcrypt_state *st, const uint32_t *key)
+{
+	uint32_t *S = st->S, P[BLF_N + 2];
+	uint32_t l = 0, r = 0;
+	int i;
+
+	for (i = 0; i < BLF_N + 2; i++)
+		st->P[i] ^= key[i % BCRYPT_WORDS];
+	for (i = 0; i < BLF_N + 2; i += 2) {
+		bcrypt_encipher(S, st->P, &l, &r);
+		st->P[i] = l;
+		st->P[i + 1] = r;
+	}
+	memcpy(P, st->P, sizeof(P));
+	for (i = 0; i < 4 * 256; i += 2) {
+		bcrypt_encipher(S, P, &l, &r);
+		S[i] = l;
+		S[i + 1] = r;
+	}
+}
+
+static void
+bcrypt_hash(const uint32_t *passwords, const uint32_t *saltwords, u_int8_t *out)
+{
+	struct bcrypt_state state;
 	u_int8_t ciphertext[BCRYPT_HASHSIZE] =
 	    "OxychromaticBlowfishSwatDynamite";
 	uint32_t cdata[BCRYPT_BLOCKS];
-	int i;
-	uint16_t j;
-	size_t shalen = SHA512_DIGEST_LENGTH;
+	int i, k;
 
 	/* key expansion */
-	Blowfish_initstate(&state);
-	Blowfish_expandstate(&state, sha2salt, shalen, sha2pass, shalen);
+	memcpy(&state, &bcrypt_initial, sizeof(state));
+	bcrypt_expandstate(&state, saltwords, passwords);
 	for (i = 0; i < 64; i++) {
-		Blowfish_expand0state(&state, sha2salt, shalen);
-		Blowfish_expand0state(&state, sha2pass, shalen);
+		bcrypt_expand0state(&state, saltwords);
+		bcrypt_expand0state(&state, passwords);
 	}
 
 	/* encryption */
-	j = 0;
 	for (i = 0; i < BCRYPT_BLOCKS; i++)
-		cdata[i] = Blowfish_stream2word(ciphertext, sizeof(ciphertext),
-		    &j);
+		cdata[i] = (uint32_t)ciphertext[4 * i] << 24 |
+		    (uint32_t)ciphertext[4 * i + 1] << 16 |
+		    (uint32_t)ciphertext[4 * i + 2] << 8 | ciphertext[4 * i + 3];
 	for (i = 0; i < 64; i++)
-		blf_enc(&state, cdata, sizeof(cdata) / sizeof(uint64_t));
+		for (k = 0; k < BCRYPT_BLOCKS; k += 2)
+			bcrypt_encipher(state.S, state.P, &cdata[k],
+			    &cdata[k + 1]);
 
 	/* copy out */
 	for (i = 0; i < BCRYPT_BLOCKS; i++) {
@@ -94,73 +224,321 @@ bcrypt_hash(u_int8_t *sha2pass, u_int8_t *sha2salt, u_int8_t *out)
 	memset(&state, 0, sizeof(state));
 }
 
-int
-bcrypt_pbkdf(const char *pass, size_t passlen, const u_int8_t *salt, size_t saltlen,
-    u_int8_t *key, size_t keylen, unsigned int rounds)
+/*
+ * The same hash for several independent inputs at once. Every round of
+ * the cipher waits on its own S-box loads, so one hash leaves most of the
+ * cpu idle; stepping a few through the schedule in lockstep fills it in.
+ * Six lanes measured best; their 24K of state still fits in L1.
+ */
+#define BCRYPT_LANES 6
+
+#define BCRYPT_LANELOOP(k) for (k = 0; k < BCRYPT_LANES; k++)
+
+static inline void
+bcrypt_encipher_lanes(uint32_t *const *S, const uint32_t *const *P,
+    uint32_t *l, uint32_t *r)
 {
-	u_int8_t sha2pass[SHA512_DIGEST_LENGTH];
-	u_int8_t sha2salt[SHA512_DIGEST_LENGTH];
-	u_int8_t out[BCRYPT_HASHSIZE];
-	u_int8_t tmpout[BCRYPT_HASHSIZE];
+	int k, n;
+
+	BCRYPT_LANELOOP(k)
+		l[k] ^= P[k][0];
+	for (n = 1; n < BLF_N; n += 2) {
+		BCRYPT_LANELOOP(k)
+			BCRYPT_RND(S[k], P[k], r[k], l[k], n);
+		BCRYPT_LANELOOP(k)
+			BCRYPT_RND(S[k], P[k], l[k], r[k], n + 1);
+	}
+	BCRYPT_LANELOOP(k) {
+		uint32_t t = l[k];
+		l[k] = r[k] ^ P[k][BLF_N + 1];
+		r[k] = t;
+	}
+}
+
+/* both expansions, with data NULL for expand0state */
+static void
+bcrypt_expand_lanes(struct bcrypt_state *st, const uint32_t *const *data,
+    const uint32_t *const *key)
+{
+	uint32_t P[BCRYPT_LANES][BLF_N + 2];
+	uint32_t *Sp[BCRYPT_LANES];
+	const uint32_t *Pp[BCRYPT_LANES];
+	uint32_t l[BCRYPT_LANES], r[BCRYPT_LANES];
+	int i, j = 0, k;
+
+	BCRYPT_LANELOOP(k) {
+		for (i = 0; i < BLF_N + 2; i++)
+			st[k].P[i] ^= key[k][i % BCRYPT_WORDS];
+		Sp[k] = st[k].S;
+		Pp[k] = st[k].P;
+		l[k] = r[k] = 0;
+	}
+	for (i = 0; i < BLF_N + 2; i += 2) {
+		if (data) {
+			BCRYPT_LANELOOP(k) {
+				l[k] ^= data[k][j % BCRYPT_WORDS];
+				r[k] ^= data[k][(j + 1) % BCRYPT_WORDS];
+			}
+			j += 2;
+		}
+		bcrypt_encipher_lanes(Sp, Pp, l, r);
+		BCRYPT_LANELOOP(k) {
+			st[k].P[i] = l[k];
+			st[k].P[i + 1] = r[k];
+		}
+	}
+	BCRYPT_LANELOOP(k) {
+		memcpy(P[k], st[k].P, sizeof(P[k]));
+		Pp[k] = P[k];
+	}
+	for (i = 0; i < 4 * 256; i += 2) {
+		if (data) {
+			BCRYPT_LANELOOP(k) {
+				l[k] ^= data[k][j % BCRYPT_WORDS];
+				r[k] ^= data[k][(j + 1) % BCRYPT_WORDS];
+			}
+			j += 2;
+		}
+		bcrypt_encipher_lanes(Sp, Pp, l, r);
+		BCRYPT_LANELOOP(k) {
+			Sp[k][i] = l[k];
+			Sp[k][i + 1] = r[k];
+		}
+	}
+}
+
+static void
+bcrypt_hash_lanes(struct bcrypt_state *st, const uint32_t *const *passwords,
+    const uint32_t *const *saltwords, u_int8_t *const *out)
+{
+	const u_int8_t ciphertext[BCRYPT_HASHSIZE] =
+	    "OxychromaticBlowfishSwatDynamite";
+	uint32_t cdata[BCRYPT_BLOCKS][BCRYPT_LANES];
+	uint32_t *Sp[BCRYPT_LANES];
+	const uint32_t *Pp[BCRYPT_LANES];
+	int i, k, b;
+
+	/* key expansion */
+	BCRYPT_LANELOOP(k)
+		memcpy(&st[k], &bcrypt_initial, sizeof(st[k]));
+	bcrypt_expand_lanes(st, saltwords, passwords);
+	for (i = 0; i < 64; i++) {
+		bcrypt_expand_lanes(st, NULL, saltwords);
+		bcrypt_expand_lanes(st, NULL, passwords);
+	}
+
+	/* encryption */
+	for (b = 0; b < BCRYPT_BLOCKS; b++)
+		BCRYPT_LANELOOP(k)
+			cdata[b][k] = (uint32_t)ciphertext[4 * b] << 24 |
+			    (uint32_t)ciphertext[4 * b + 1] << 16 |
+			    (uint32_t)ciphertext[4 * b + 2] << 8 |
+			    ciphertext[4 * b + 3];
+	BCRYPT_LANELOOP(k) {
+		Sp[k] = st[k].S;
+		Pp[k] = st[k].P;
+	}
+	for (i = 0; i < 64; i++)
+		for (b = 0; b < BCRYPT_BLOCKS; b += 2)
+			bcrypt_encipher_lanes(Sp, Pp, cdata[b], cdata[b + 1]);
+
+	/* copy out */
+	for (b = 0; b < BCRYPT_BLOCKS; b++) {
+		BCRYPT_LANELOOP(k) {
+			out[k][4 * b + 3] = (cdata[b][k] >> 24) & 0xff;
+			out[k][4 * b + 2] = (cdata[b][k] >> 16) & 0xff;
+			out[k][4 * b + 1] = (cdata[b][k] >> 8) & 0xff;
+			out[k][4 * b + 0] = cdata[b][k] & 0xff;
+		}
+	}
+	memset(cdata, 0, sizeof(cdata));
+}
+
+/*
+ * One pbkdf in progress. The loop of the original bcrypt_pbkdf is taken
+ * apart so that each bcrypt_hash can be handed to whichever kernel is
+ * running, and a lane picks up the next job when its key is done.
+ */
+struct bcrypt_lane {
+	struct bcrypt_job *job;
 	u_int8_t *countsalt;
-	size_t i, j, amt, stride;
+	size_t keylen, amt, stride;
 	uint32_t count;
-	size_t origkeylen = keylen;
+	unsigned int round;
+	uint32_t passwords[BCRYPT_WORDS];
+	uint32_t saltwords[BCRYPT_WORDS];
+	u_int8_t out[BCRYPT_HASHSIZE];
+	u_int8_t tmpout[BCRYPT_HASHSIZE];
+};
+
+static void
+bcrypt_lane_salt(struct bcrypt_lane *lane, const u_int8_t *data, size_t len)
+{
+	u_int8_t sha2salt[SHA512_DIGEST_LENGTH];
+
+	crypto_hash_sha512(sha2salt, data, len);
+	bcrypt_words(sha2salt, lane->saltwords);
+	memset(sha2salt, 0, sizeof(sha2salt));
+}
+
+static void
+bcrypt_lane_block(struct bcrypt_lane *lane)
+{
+	size_t saltlen = lane->job->salt_len;
+
+	lane->countsalt[saltlen + 0] = (lane->count >> 24) & 0xff;
+	lane->countsalt[saltlen + 1] = (lane->count >> 16) & 0xff;
+	lane->countsalt[saltlen + 2] = (lane->count >> 8) & 0xff;
+	lane->countsalt[saltlen + 3] = lane->count & 0xff;
 
+	/* first round, salt is salt */
+	bcrypt_lane_salt(lane, lane->countsalt, saltlen + 4);
+	lane->round = 0;
+}
+
+static int
+bcrypt_lane_start(struct bcrypt_lane *lane, struct bcrypt_job *job)
+{
+	u_int8_t sha2pass[SHA512_DIGEST_LENGTH];
+
+	job->rv = -1;
 	/* nothing crazy */
-	if (rounds < 1)
+	if (job->rounds < 1)
 		return -1;
-	if (passlen == 0 || saltlen == 0 || keylen == 0 ||
-	    keylen > sizeof(out) * sizeof(out) || saltlen > 1<<20)
+	if (job->pass_len == 0 || job->salt_len == 0 || job->key_len == 0 ||
+	    job->key_len > sizeof(lane->out) * sizeof(lane->out) ||
+	    job->salt_len > 1<<20)
 		return -1;
-	if ((countsalt = calloc(1, saltlen + 4)) == NULL)
+	if ((lane->countsalt = calloc(1, job->salt_len + 4)) == NULL)
 		return -1;
-	stride = (keylen + sizeof(out) - 1) / sizeof(out);
-	amt = (keylen + stride - 1) / stride;
+	lane->job = job;
+	lane->keylen = job->key_len;
+	lane->stride = (lane->keylen + sizeof(lane->out) - 1) / sizeof(lane->out);
+	lane->amt = (lane->keylen + lane->stride - 1) / lane->stride;
 
-	memcpy(countsalt, salt, saltlen);
+	memcpy(lane->countsalt, job->salt, job->salt_len);
 
 	/* collapse password */
-	crypto_hash_sha512(sha2pass, pass, passlen);
+	crypto_hash_sha512(sha2pass, (const u_int8_t *)job->pass, job->pass_len);
+	bcrypt_words(sha2pass, lane->passwords);
+	memset(sha2pass, 0, sizeof(sha2pass));
 
 	/* generate key, sizeof(out) at a time */
-	for (count = 1; keylen > 0; count++) {
-		countsalt[saltlen + 0] = (count >> 24) & 0xff;
-		countsalt[saltlen + 1] = (count >> 16) & 0xff;
-		countsalt[saltlen + 2] = (count >> 8) & 0xff;
-		countsalt[saltlen + 3] = count & 0xff;
-
-		/* first round, salt is salt */
-		crypto_hash_sha512(sha2salt, countsalt, saltlen + 4);
-
-		bcrypt_hash(sha2pass, sha2salt, tmpout);
-		memcpy(out, tmpout, sizeof(out));
-
-		for (i = 1; i < rounds; i++) {
-			/* subsequent rounds, salt is previous output */
-			crypto_hash_sha512(sha2salt, tmpout, sizeof(tmpout));
-			bcrypt_hash(sha2pass, sha2salt, tmpout);
-			for (j = 0; j < sizeof(out); j++)
-				out[j] ^= tmpout[j];
+	lane->count = 1;
+	bcrypt_lane_block(lane);
+	return 0;
+}
+
+/* fold in the hash just finished and set up the next one */
+static void
+bcrypt_lane_next(struct bcrypt_lane *lane)
+{
+	struct bcrypt_job *job = lane->job;
+	size_t i;
+
+	if (lane->round == 0)
+		memcpy(lane->out, lane->tmpout, sizeof(lane->out));
+	else
+		for (i = 0; i < sizeof(lane->out); i++)
+			lane->out[i] ^= lane->tmpout[i];
+	if (++lane->round < job->rounds) {
+		/* subsequent rounds, salt is previous output */
+		bcrypt_lane_salt(lane, lane->tmpout, sizeof(lane->tmpout));
+		return;
+	}
+
+	/*
+	 * pbkdf2 deviation: ouput the key material non-linearly.
+	 */
+	lane->amt = MIN(lane->amt, lane->keylen);
+	for (i = 0; i < lane->amt; i++) {
+		size_t dest = i * lane->stride + (lane->count - 1);
+		if (dest >= job->key_len)
+			break;
+		job->key[dest] = lane->out[i];
+	}
+	lane->keylen -= i;
+	if (lane->keylen > 0) {
+		lane->count++;
+		bcrypt_lane_block(lane);
+		return;
+	}
+
+	job->rv = 0;
+	memset(lane->countsalt, 0, job->salt_len + 4);
+	free(lane->countsalt);
+	lane->job = NULL;
+}
+
+/*
+ * Run a batch of independent derivations, BCRYPT_LANES at a time. With
+ * only one or two left the single kernel is quicker than idle lanes.
+ * Each job gets rv 0, or -1 for the same errors bcrypt_pbkdf returns.
+ */
+void
+bcrypt_pbkdf_batch(struct bcrypt_job *jobs, size_t njobs)
+{
+	struct bcrypt_state st[BCRYPT_LANES];
+	struct bcrypt_lane lanes[BCRYPT_LANES];
+	const uint32_t *pp[BCRYPT_LANES], *sp[BCRYPT_LANES];
+	u_int8_t *op[BCRYPT_LANES];
+	u_int8_t scratch[BCRYPT_HASHSIZE];
+	size_t next = 0;
+	int k, active = 0, nactive, used = 0;
+
+	pthread_once(&bcrypt_once, bcrypt_initonce);
+	BCRYPT_LANELOOP(k)
+		lanes[k].job = NULL;
+
+	while (1) {
+		nactive = 0;
+		BCRYPT_LANELOOP(k) {
+			while (!lanes[k].job && next < njobs)
+				bcrypt_lane_start(&lanes[k], &jobs[next++]);
+			if (lanes[k].job) {
+				active = k;
+				nactive++;
+			}
 		}
+		if (nactive == 0)
+			break;
 
-		/*
-		 * pbkdf2 deviation: ouput the key material non-linearly.
-		 */
-		amt = MIN(amt, keylen);
-		for (i = 0; i < amt; i++) {
-			size_t dest = i * stride + (count - 1);
-			if (dest >= origkeylen)
-				break;
-			key[dest] = out[i];
+		if (nactive <= 2) {
+			BCRYPT_LANELOOP(k)
+				if (lanes[k].job)
+					bcrypt_hash(lanes[k].passwords,
+					    lanes[k].saltwords, lanes[k].tmpout);
+		} else {
+			/* idle lanes repeat an active one */
+			BCRYPT_LANELOOP(k) {
+				int from = lanes[k].job ? k : active;
+
+				pp[k] = lanes[from].passwords;
+				sp[k] = lanes[from].saltwords;
+				op[k] = lanes[k].job ? lanes[k].tmpout : scratch;
+			}
+			bcrypt_hash_lanes(st, pp, sp, op);
+			used = 1;
 		}
-		keylen -= i;
+		BCRYPT_LANELOOP(k)
+			if (lanes[k].job)
+				bcrypt_lane_next(&lanes[k]);
 	}
 
 	/* zap */
-	memset(out, 0, sizeof(out));
-	memset(countsalt, 0, saltlen + 4);
-	free(countsalt);
+	memset(lanes, 0, sizeof(lanes));
+	memset(scratch, 0, sizeof(scratch));
+	if (used)
+		memset(st, 0, sizeof(st));
+}
 
-	return 0;
+int
+bcrypt_pbkdf(const char *pass, size_t passlen, const u_int8_t *salt, size_t saltlen,
+    u_int8_t *key, size_t keylen, unsigned int rounds)
+{
+	struct bcrypt_job job = { pass, passlen, salt, saltlen, key, keylen,
+	    rounds };
+
+	bcrypt_pbkdf_batch(&job, 1);
+	return job.rv;
 }
@@ -1,4 +1,27 @@
-
 int reopb64_ntop(unsigned char const *, size_t, char *, size_t);
 int reopb64_pton(char const *, unsigned char *, size_t);
 
+/* incremental encoding, wrapped to 76 columns */
+struct reopb64_enc {
+	unsigned char in[3];
+	size_t inlen;
+	size_t col;
+};
+
+void reopb64_enc_init(struct reopb64_enc *);
+int reopb64_enc_update(struct reopb64_enc *, unsigned char const *, size_t,
+    char *, size_t);
+int reopb64_enc_final(struct reopb64_enc *, char *, size_t);
+
+/* incremental decoding, stops at a '-' guard line */
+struct reopb64_dec {
+	int state;
+	int pad;
+	unsigned int bits;
+	int done;
+};
+
+void reopb64_dec_init(struct reopb64_dec *);
+int reopb64_dec_update(struct reopb64_dec *, char const *, size_t,
+    unsigned char *, size_t, size_t *);
+int reopb64_dec_final(struct reopb64_dec *);
@@ -9,3 +9,15 @@ size_t strlcat(char *dst, const char *src, size_t siz);
 int bcrypt_pbkdf(const char *pass, size_t pass_len, const uint8_t *salt,
          size_t salt_len, uint8_t *key, size_t key_len, unsigned int rounds);
 
+
+struct bcrypt_job {
+	const char *pass;
+	size_t pass_len;
+	const uint8_t *salt;
+	size_t salt_len;
+	uint8_t *key;
+	size_t key_len;
+	unsigned int rounds;
+	int rv;
+};
+void bcrypt_pbkdf_batch(struct bcrypt_job *jobs, size_t njobs);
@@ -0,0 +1,641 @@
+/*
+ * Copyright (c) 2014 Ted Unangst <tedu@tedunangst.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * reop-bench: time the library's hot paths and print the results as JSON.
+ * each case runs until it has used its share of time, and reports the
+ * median and 99th percentile latency of a single operation, plus
+ * throughput for cases that process a message.
+ */
+
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+#include <util.h>
+#include <reopbase64.h>
+
+#include <sodium.h>
+
+#include "reop.h"
+
+static const uint64_t sizes[] = {
+	64, 1024, 16384, 262144, 4194304, 67108864, 1073741824, 4294967296ULL
+};
+static const unsigned int kdfrounds[] = { 1, 8, 16, 42, 64 };
+static const unsigned int argonmemkib[] = { 8192, 65536, 262144 };
+static const int ringsizes[] = { 1, 100, 1000, 10000 };
+static const int batchsizes[] = { 1, 16, 256, 4096 };
+static const int kdfbatchsizes[] = { 1, 6, 24, 96 };
+
+static uint64_t maxsize = 67108864;
+static double budget = 0.25;
+static const char *filter;
+static int nresults;
+
+/* one benchmark case */
+struct bench {
+	const char *name;
+	void (*prep)(struct bench *);	/* untimed, before every run */
+	void (*run)(struct bench *);
+	uint64_t size;
+	uint8_t *buf;
+	uint8_t *orig;
+	char *str;
+	const void *msg;
+	const struct reop_pubkey *pubkey;
+	const struct reop_seckey *seckey;
+	const struct reop_pubkey *otherpub;
+	const struct reop_seckey *othersec;
+	const char *ident;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void *
+xmalloc(size_t len)
+{
+	void *p = malloc(len ? len : 1);
+
+	if (!p)
+		err(1, "malloc %zu", len);
+	return p;
+}
+
+/*
+ * time the case and print a result. param names what size means.
+ */
+static void
+measure(struct bench *b, const char *param)
+{
+	size_t nsamples = 0, maxsamples = 1024;
+	double *samples, start, total = 0;
+
+	if (filter && !strstr(b->name, filter))
+		return;
+
+	samples = xmalloc(maxsamples * sizeof(*samples));
+	start = now();
+	while (nsamples < 3 || (now() - start < budget && nsamples < 100000)) {
+		if (b->prep)
+			b->prep(b);
+		double t = now();
+		b->run(b);
+		t = now() - t;
+		if (nsamples == maxsamples) {
+			maxsamples *= 2;
+			samples = realloc(samples, maxsamples * sizeof(*samples));
+			if (!samples)
+				err(1, "realloc");
+		}
+		samples[nsamples++] = t;
+		total += t;
+	}
+	qsort(samples, nsamples, sizeof(*samples), cmpdouble);
+
+	printf("%s\n\t{ \"name\": \"%s\", \"%s\": %llu, \"iterations\": %zu, "
+	    "\"ops_per_s\": %.1f, ", nresults++ ? "," : "", b->name, param,
+	    (unsigned long long)b->size, nsamples, nsamples / total);
+	if (strcmp(param, "size") == 0)
+		printf("\"mb_per_s\": %.1f, ", b->size * nsamples / total / 1e6);
+	printf("\"p50_ns\": %.0f, \"p99_ns\": %.0f }",
+	    samples[nsamples / 2] * 1e9, samples[nsamples * 99 / 100] * 1e9);
+	fflush(stdout);
+	free(samples);
+}
+
+static void
+runsign(struct bench *b)
+{
+	reop_freesig(reop_sign(b->seckey, b->buf, b->size));
+}
+
+static void
+runsignencode(struct bench *b)
+{
+	const struct reop_sig *sig = reop_sign(b->seckey, b->buf, b->size);
+
+	reop_freestr(reop_encodesig(sig));
+	reop_freesig(sig);
+}
+
+/*
+ * the same, without touching the heap
+ */
+static void
+runsignencodeinto(struct bench *b)
+{
+	static struct reop_sig *sig;
+	static char sigdata[1024];
+
+	if (!sig)
+		sig = xmalloc(reop_sigsize());
+	if (reop_sign_into(b->seckey, b->buf, b->size, sig) != 0 ||
+	    reop_encodesig_into(sig, sigdata, sizeof(sigdata)) != 0)
+		errx(1, "sign failed");
+}
+
+static void
+runverify(struct bench *b)
+{
+	if (reop_verify(b->pubkey, b->buf, b->size, b->msg).v != REOP_V_OK)
+		errx(1, "verify failed");
+}
+
+static void
+runverifybatch(struct bench *b)
+{
+	const uint8_t **msgs = xmalloc(b->size * sizeof(*msgs));
+	uint64_t *msglens = xmalloc(b->size * sizeof(*msglens));
+	reop_verify_result *results = xmalloc(b->size * sizeof(*results));
+
+	for (uint64_t i = 0; i < b->size; i++) {
+		msgs[i] = b->buf;
+		msglens[i] = 1024;
+	}
+	if (reop_verify_batch(&b->pubkey, 1, msgs, msglens, b->msg, b->size,
+	    results) != 0)
+		errx(1, "verify batch failed");
+	for (uint64_t i = 0; i < b->size; i++)
+		if (results[i].v != REOP_V_OK)
+			errx(1, "verify failed");
+	free(msgs);
+	free(msglens);
+	free(results);
+}
+
+static void
+runpubencrypt(struct bench *b)
+{
+	reop_freeencmsg(reop_pubencrypt(b->otherpub, b->seckey, b->buf, b->size));
+}
+
+static void
+restore(struct bench *b)
+{
+	memcpy(b->buf, b->orig, b->size);
+}
+
+static void
+runpubdecrypt(struct bench *b)
+{
+	if (reop_pubdecrypt(b->msg, b->pubkey, b->othersec, b->buf, b->size).v !=
+	    REOP_D_OK)
+		errx(1, "pubdecrypt failed");
+}
+
+static void
+runsymencrypt(struct bench *b)
+{
+	reop_freesymmsg(reop_symencrypt(b->buf, b->size, "password"));
+}
+
+static void
+runsymdecrypt(struct bench *b)
+{
+	if (reop_symdecrypt(b->msg, "password", b->buf, b->size).v != REOP_D_OK)
+		errx(1, "symdecrypt failed");
+}
+
+static void
+runntop(struct bench *b)
+{
+	if (reopb64_ntop(b->buf, b->size, b->str, b->size / 3 * 4 + 5) == -1)
+		errx(1, "b64 encode failed");
+}
+
+static void
+runpton(struct bench *b)
+{
+	if (reopb64_pton(b->str, b->orig, b->size) != b->size)
+		errx(1, "b64 decode failed");
+}
+
+static void
+runkdf(struct bench *b)
+{
+	uint8_t salt[16] = { 0 }, key[32];
+
+	if (bcrypt_pbkdf("password", 8, salt, sizeof(salt), key, sizeof(key),
+	    b->size) == -1)
+		errx(1, "bcrypt pbkdf");
+}
+
+/* a batch of keys at 8 rounds */
+static void
+runkdfbatch(struct bench *b)
+{
+	struct bcrypt_job jobs[96];
+	uint8_t salt[16] = { 0 }, keys[96][32];
+	int i;
+
+	for (i = 0; i < b->size; i++) {
+		jobs[i].pass = "password";
+		jobs[i].pass_len = 8;
+		jobs[i].salt = salt;
+		jobs[i].salt_len = sizeof(salt);
+		jobs[i].key = keys[i];
+		jobs[i].key_len = sizeof(keys[i]);
+		jobs[i].rounds = 8;
+	}
+	bcrypt_pbkdf_batch(jobs, b->size);
+	for (i = 0; i < b->size; i++)
+		if (jobs[i].rv == -1)
+			errx(1, "bcrypt pbkdf");
+}
+
+static void
+prepsymdecryptbatch(struct bench *b)
+{
+	memcpy(b->buf, b->orig, 1024 * b->size);
+}
+
+static void
+runsymdecryptbatch(struct bench *b)
+{
+	const struct reop_symmsg *const *symmsgs = b->msg;
+	const char *passwords[96];
+	uint8_t *msgs[96];
+	uint64_t msglens[96];
+	reop_decrypt_result results[96];
+	int i;
+
+	for (i = 0; i < b->size; i++) {
+		passwords[i] = "password";
+		msgs[i] = b->buf + 1024 * i;
+		msglens[i] = 1024;
+	}
+	if (reop_symdecrypt_batch(symmsgs, passwords, msgs, msglens, b->size,
+	    results) == -1)
+		errx(1, "symdecrypt batch");
+	for (i = 0; i < b->size; i++)
+		if (results[i].v != REOP_D_OK)
+			errx(1, "symdecrypt batch failed");
+}
+
+static void
+runargon(struct bench *b)
+{
+	uint8_t salt[crypto_pwhash_SALTBYTES] = { 0 }, key[32];
+
+	if (crypto_pwhash(key, sizeof(key), "password", 8, salt, 2,
+	    b->size * 1024, crypto_pwhash_ALG_ARGON2ID13) == -1)
+		errx(1, "argon2id");
+}
+
+static void
+runparsepubkey(struct bench *b)
+{
+	reop_freepubkey(reop_parsepubkey(b->str));
+}
+
+static void
+rungetpubkey(struct bench *b)
+{
+	const struct reop_pubkey *pubkey = reop_getpubkey(NULL, b->ident);
+
+	if (!pubkey)
+		errx(1, "pubkey not found");
+	reop_freepubkey(pubkey);
+}
+
+/*
+ * everything that processes a message, at every size
+ */
+static void
+benchmessages(struct bench *b)
+{
+	int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (sizes[i] > maxsize)
+			break;
+		b->size = sizes[i];
+		b->buf = xmalloc(b->size);
+		b->orig = xmalloc(b->size);
+		b->str = xmalloc(b->size / 3 * 4 + 5);
+		memset(b->buf, 'x', b->size);
+
+		b->name = "sign";
+		b->prep = NULL;
+		b->run = runsign;
+		measure(b, "size");
+
+		if (b->size <= 1024) {
+			b->name = "sign_encode";
+			b->run = runsignencode;
+			measure(b, "size");
+
+			b->name = "sign_encode_into";
+			b->run = runsignencodeinto;
+			measure(b, "size");
+		}
+
+		const struct reop_sig *sig = reop_sign(b->seckey, b->buf, b->size);
+		b->name = "verify";
+		b->msg = sig;
+		b->run = runverify;
+		measure(b, "size");
+		reop_freesig(sig);
+
+		b->name = "pubencrypt";
+		b->run = runpubencrypt;
+		measure(b, "size");
+
+		const struct reop_encmsg *encmsg = reop_pubencrypt(b->otherpub,
+		    b->seckey, b->buf, b->size);
+		memcpy(b->orig, b->buf, b->size);
+		b->name = "pubdecrypt";
+		b->msg = encmsg;
+		b->prep = restore;
+		b->run = runpubdecrypt;
+		measure(b, "size");
+		reop_freeencmsg(encmsg);
+
+		b->name = "symencrypt";
+		b->prep = NULL;
+		b->run = runsymencrypt;
+		measure(b, "size");
+
+		const struct reop_symmsg *symmsg = reop_symencrypt(b->buf,
+		    b->size, "password");
+		memcpy(b->orig, b->buf, b->size);
+		b->name = "symdecrypt";
+		b->msg = symmsg;
+		b->prep = restore;
+		b->run = runsymdecrypt;
+		measure(b, "size");
+		reop_freesymmsg(symmsg);
+
+		b->name = "b64_ntop";
+		b->prep = NULL;
+		b->run = runntop;
+		measure(b, "size");
+
+		runntop(b);
+		b->name = "b64_pton";
+		b->run = runpton;
+		measure(b, "size");
+
+		free(b->buf);
+		free(b->orig);
+		free(b->str);
+	}
+}
+
+/*
+ * batches of signatures over 1k messages
+ */
+static void
+benchbatch(struct bench *b)
+{
+	int i;
+
+	b->buf = xmalloc(1024);
+	memset(b->buf, 'x', 1024);
+	const struct reop_sig *sig = reop_sign(b->seckey, b->buf, 1024);
+	int maxbatch = batchsizes[sizeof(batchsizes) / sizeof(batchsizes[0]) - 1];
+	const struct reop_sig **sigs = xmalloc(maxbatch * sizeof(*sigs));
+	for (i = 0; i < maxbatch; i++)
+		sigs[i] = sig;
+
+	b->name = "verify_batch";
+	b->prep = NULL;
+	b->run = runverifybatch;
+	b->msg = sigs;
+	for (i = 0; i < sizeof(batchsizes) / sizeof(batchsizes[0]); i++) {
+		b->size = batchsizes[i];
+		measure(b, "count");
+	}
+	free(sigs);
+	reop_freesig(sig);
+	free(b->buf);
+}
+
+static void
+benchkdf(struct bench *b)
+{
+	int i;
+
+	b->name = "bcrypt_pbkdf";
+	b->prep = NULL;
+	b->run = runkdf;
+	for (i = 0; i < sizeof(kdfrounds) / sizeof(kdfrounds[0]); i++) {
+		b->size = kdfrounds[i];
+		measure(b, "rounds");
+	}
+
+	b->name = "bcrypt_pbkdf_batch";
+	b->run = runkdfbatch;
+	for (i = 0; i < sizeof(kdfbatchsizes) / sizeof(kdfbatchsizes[0]); i++) {
+		b->size = kdfbatchsizes[i];
+		measure(b, "count");
+	}
+
+	/* 1k messages at 8 rounds, decrypted in place from a saved copy */
+	int maxbatch = kdfbatchsizes[sizeof(kdfbatchsizes) / sizeof(kdfbatchsizes[0]) - 1];
+	const struct reop_symmsg **symmsgs = xmalloc(maxbatch * sizeof(*symmsgs));
+	b->orig = xmalloc(1024 * maxbatch);
+	b->buf = xmalloc(1024 * maxbatch);
+	memset(b->orig, 'x', 1024 * maxbatch);
+	struct reop_ctx *ctx = reop_ctx_new();
+	for (i = 0; i < maxbatch; i++)
+		symmsgs[i] = reop_ctx_symencrypt(ctx, b->orig + 1024 * i, 1024,
+		    "password", 8);
+	reop_ctx_free(ctx);
+	b->name = "symdecrypt_batch";
+	b->prep = prepsymdecryptbatch;
+	b->run = runsymdecryptbatch;
+	b->msg = symmsgs;
+	for (i = 0; i < sizeof(kdfbatchsizes) / sizeof(kdfbatchsizes[0]); i++) {
+		b->size = kdfbatchsizes[i];
+		measure(b, "count");
+	}
+	for (i = 0; i < maxbatch; i++)
+		reop_freesymmsg(symmsgs[i]);
+	free(symmsgs);
+	free(b->orig);
+	free(b->buf);
+	b->prep = NULL;
+
+	b->name = "argon2id";
+	b->run = runargon;
+	for (i = 0; i < sizeof(argonmemkib) / sizeof(argonmemkib[0]); i++) {
+		b->size = argonmemkib[i];
+		measure(b, "mem_kib");
+	}
+}
+
+/*
+ * parsing a single key, and looking one up at the end of keyrings of
+ * different sizes. the keyrings go in a temporary home directory.
+ */
+static void
+benchkeys(struct bench *b)
+{
+	char home[] = "/tmp/reop-bench.XXXXXX";
+	char path[1024];
+	int i, n = 0;
+
+	if (!mkdtemp(home))
+		err(1, "mkdtemp");
+	snprintf(path, sizeof(path), "%s/.reop", home);
+	if (mkdir(path, 0700) == -1)
+		err(1, "mkdir %s", path);
+	snprintf(path, sizeof(path), "%s/.reop/pubkeyring", home);
+	setenv("HOME", home, 1);
+
+	b->str = (char *)reop_encodepubkey(b->pubkey);
+	b->name = "parsepubkey";
+	b->prep = NULL;
+	b->run = runparsepubkey;
+	b->size = 1;
+	measure(b, "keys");
+	reop_freestr(b->str);
+
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+		err(1, "fopen %s", path);
+	b->name = "getpubkey";
+	b->run = rungetpubkey;
+	for (i = 0; i < sizeof(ringsizes) / sizeof(ringsizes[0]); i++) {
+		char ident[64];
+		for (; n < ringsizes[i]; n++) {
+			snprintf(ident, sizeof(ident), "bench%d", n);
+			struct reop_keypair keypair = reop_generate(ident);
+			const char *str = reop_encodepubkey(keypair.pubkey);
+			fprintf(fp, "%s\n", str);
+			reop_freestr(str);
+			reop_freepubkey(keypair.pubkey);
+			reop_freeseckey(keypair.seckey);
+		}
+		fflush(fp);
+		b->ident = ident;
+		b->size = n;
+		measure(b, "keys");
+	}
+	fclose(fp);
+
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/.reop/pubkeyring.idx", home);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/.reop", home);
+	rmdir(path);
+	rmdir(home);
+}
+
+static uint64_t
+parsesize(const char *str)
+{
+	char *end;
+	uint64_t size = strtoull(str, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K':
+		size <<= 10;
+		end++;
+		break;
+	case 'm': case 'M':
+		size <<= 20;
+		end++;
+		break;
+	case 'g': case 'G':
+		size <<= 30;
+		end++;
+		break;
+	}
+	if (end == str || *end != '\0')
+		errx(1, "invalid size: %s", str);
+	return size;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: reop-bench [-f filter] [-m max-size] [-t seconds]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "f:m:t:")) != -1) {
+		switch (ch) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 'm':
+			maxsize = parsesize(optarg);
+			break;
+		case 't':
+			budget = atof(optarg);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	reop_init();
+
+	memset(&b, 0, sizeof(b));
+	struct reop_keypair mine = reop_generate("bench");
+	struct reop_keypair theirs = reop_generate("other");
+	b.pubkey = mine.pubkey;
+	b.seckey = mine.seckey;
+	b.otherpub = theirs.pubkey;
+	b.othersec = theirs.seckey;
+
+	printf("{ \"benchmarks\": [");
+	benchmessages(&b);
+	benchbatch(&b);
+	benchkdf(&b);
+	benchkeys(&b);
+	printf("\n] }\n");
+
+	reop_freepubkey(mine.pubkey);
+	reop_freeseckey(mine.seckey);
+	reop_freepubkey(theirs.pubkey);
+	reop_freeseckey(theirs.seckey);
+	return 0;
+}
@@ -14,19 +14,26 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include <arpa/inet.h>
 
+#include <ctype.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <err.h>
+#include <time.h>
 #include <unistd.h>
 #include <readpassphrase.h>
 #include <util.h>
@@ -56,12 +63,18 @@
 
 /* magic */
 #define SIGALG "Ed"	/* Ed25519 */
+#define SIGPHALG "EP"	/* Ed25519ph, the message prehashed with SHA-512 */
+#define SIGTREEALG "ET"	/* Ed25519ph over the root of a BLAKE2b hash tree */
 #define ENCALG "eC"	/* ephemeral Curve25519-Salsa20 */
 #define OLDENCALG "CS"	/* Curve25519-Salsa20 */
 #define ENCKEYALG "CS"	/* same as "old", didn't change */
 #define OLDEKCALG "eS"	/* ephemeral-curve25519-Salsa20 */
 #define SYMALG "SP"	/* Salsa20-Poly1305 */
+#define ENCCHUNKALG "ec"	/* chunked ephemeral Curve25519-Salsa20 */
+#define ENCMULTIALG "em"	/* chunked, many recipients */
+#define SYMCHUNKALG "Sc"	/* chunked Salsa20-Poly1305 */
 #define KDFALG "BK"	/* bcrypt kdf */
+#define ARGONKDFALG "A2"	/* argon2id kdf */
 #define IDENTLEN 64
 #define RANDOMIDLEN 8
 #define REOP_BINARY "RBF"
@@ -102,6 +115,9 @@ struct reop_seckey {
 	uint8_t sigkey[SIGSECRETBYTES];
 	uint8_t enckey[ENCSECRETBYTES];
 	char ident[IDENTLEN];
+	int agent;	/* the keys are really in an agent */
+	int agentfd;
+	pthread_mutex_t agentlock;	/* one request at a time */
 };
 const size_t seckeysize = offsetof(struct reop_seckey, ident);
 
@@ -146,6 +162,164 @@ struct reop_encmsg {
 };
 const size_t encmsgsize = offsetof(struct reop_encmsg, ident);
 
+/*
+ * chunked messages. the header nonce is the base for the per chunk nonces,
+ * and each chunk carries its own tag.
+ */
+struct symchunkmsg {
+	uint8_t symalg[2];
+	uint8_t kdfalg[2];
+	uint32_t kdfrounds;
+	uint8_t salt[16];
+	uint8_t nonce[SYMNONCEBYTES];
+};
+const size_t symchunkmsgsize = sizeof(struct symchunkmsg);
+
+struct encchunkmsg {
+	uint8_t encalg[2];
+	uint8_t secrandomid[RANDOMIDLEN];
+	uint8_t pubrandomid[RANDOMIDLEN];
+	uint8_t ephpubkey[ENCPUBLICBYTES];
+	uint8_t ephnonce[ENCNONCEBYTES];
+	uint8_t ephtag[ENCTAGBYTES];
+	uint8_t nonce[SYMNONCEBYTES];
+	char ident[IDENTLEN];
+};
+const size_t encchunkmsgsize = offsetof(struct encchunkmsg, ident);
+
+/*
+ * multi recipient messages. the chunks are encrypted once with a random
+ * data key. the header is followed by an entry for each recipient, with
+ * the data key boxed by an ephemeral key, which is in turn boxed by our
+ * seckey, as in a single recipient message.
+ */
+struct encmultimsg {
+	uint8_t encalg[2];
+	uint8_t secrandomid[RANDOMIDLEN];
+	uint8_t nonce[SYMNONCEBYTES];
+	uint8_t nrecipients[2];	/* big endian */
+};
+const size_t encmultimsgsize = sizeof(struct encmultimsg);
+
+struct encrecipient {
+	uint8_t pubrandomid[RANDOMIDLEN];
+	uint8_t ephpubkey[ENCPUBLICBYTES];
+	uint8_t ephnonce[ENCNONCEBYTES];
+	uint8_t ephtag[ENCTAGBYTES];
+	uint8_t keynonce[ENCNONCEBYTES];
+	uint8_t keytag[ENCTAGBYTES];
+	uint8_t datakey[SYMKEYBYTES];
+};
+
+struct reop_stream {
+	union {
+		uint8_t alg[2];
+		struct symchunkmsg symmsg;
+		struct encchunkmsg encmsg;
+	} hdr;
+	uint8_t *hdrbuf;	/* instead of hdr, if it doesn't fit */
+	size_t hdrsize;
+	uint8_t nonce[SYMNONCEBYTES];
+	uint8_t key[SYMKEYBYTES];
+	uint64_t chunk;
+	int done;
+};
+
+/*
+ * per caller state. the kdf for new keys and messages, where passwords
+ * come from, and why the last call failed. nothing else in the library
+ * changes after reop_init, so threads can work in parallel with a ctx each.
+ * the plain functions use a copy of defctx, which prompts on the tty.
+ */
+struct reop_ctx {
+	uint8_t kdfalg[2];
+	uint32_t kdfrounds;
+	reop_password_cb passwordcb;
+	void *passwordarg;
+	char error[256];
+};
+
+static struct reop_ctx defctx = { { 'B', 'K' }, 42, reop_ttypassword, NULL };
+
+static void
+ctxerr(struct reop_ctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(ctx->error, sizeof(ctx->error), fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * tracing. if REOP_TRACE names a file (or - for stderr), the time spent
+ * in each phase of work and the number of bytes processed are written
+ * there as chrome trace events. otherwise tracestart returns 0 and
+ * traceend returns right away. each thread is numbered the first time it
+ * traces, so workers get their own track.
+ */
+static FILE *tracefp;
+static int tracecount;
+static int tracethreads;
+static __thread int tracetid;
+
+static void
+traceclose(void)
+{
+	fprintf(tracefp, "%s\n]\n", tracecount ? "" : "[");
+	if (tracefp == stderr)
+		fflush(tracefp);
+	else
+		fclose(tracefp);
+	tracefp = NULL;
+}
+
+static void
+traceinit(void)
+{
+	const char *tracefile = getenv("REOP_TRACE");
+
+	if (tracefp || !tracefile || !*tracefile)
+		return;
+	if (strcmp(tracefile, "-") == 0)
+		tracefp = stderr;
+	else if (!(tracefp = fopen(tracefile, "w")))
+		return;
+	atexit(traceclose);
+}
+
+static uint64_t
+nanotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+tracestart(void)
+{
+	if (!tracefp)
+		return 0;
+	return nanotime();
+}
+
+static void
+traceend(const char *phase, uint64_t start, uint64_t bytes)
+{
+	if (!start || !tracefp)
+		return;
+	uint64_t end = tracestart();
+	flockfile(tracefp);
+	if (!tracetid)
+		tracetid = ++tracethreads;
+	fprintf(tracefp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+	    "\"pid\":%d,\"tid\":%d,\"args\":{\"bytes\":%llu}}",
+	    tracecount++ ? "," : "[", phase, start / 1e3, (end - start) / 1e3,
+	    (int)getpid(), tracetid, (unsigned long long)bytes);
+	funlockfile(tracefp);
+}
 
 /* utility */
 static int
@@ -173,15 +347,66 @@ xopen(const char *filename, int oflags, mode_t mode)
 	return fd;
 }
 
+/*
+ * number of threads to run, one per cpu, between 1 and max
+ */
+static long
+cpucount(long max)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	if (n > max)
+		n = max;
+	return n;
+}
+
+/*
+ * run fn on one thread per cpu, but no more than there are blocks of
+ * work. the calling thread works too. fn takes blocks until none are left.
+ * work started from inside a worker, such as hashing a tree to verify one
+ * sig of a batch, runs on that worker alone, since every cpu is busy.
+ */
+static __thread int inworkers;
+
+struct workerstart {
+	void *(*fn)(void *);
+	void *arg;
+};
+
 static void *
-xmalloc(size_t len)
+workerthread(void *arg)
 {
-	void *p;
+	struct workerstart *ws = arg;
 
-	p = malloc(len);
-	if (!p)
-		err(1, "malloc %zu", len);
-	return p;
+	inworkers = 1;
+	return ws->fn(ws->arg);
+}
+
+static void
+runworkers(void *(*fn)(void *), void *arg, uint64_t nblocks)
+{
+	struct workerstart ws = { fn, arg };
+	pthread_t threads[64];
+	long nthreads = cpucount(64);
+	long started = 0;
+
+	if (inworkers) {
+		fn(arg);
+		return;
+	}
+	if (nthreads > nblocks)
+		nthreads = nblocks;
+	for (long i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, workerthread, &ws) != 0)
+			break;
+		started++;
+	}
+	inworkers = 1;
+	fn(arg);
+	inworkers = 0;
+	for (long i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
 }
 
 static void
@@ -199,6 +424,29 @@ reop_freestr(const char *str)
 	xfree((void *)str, strlen(str));
 }
 
+/*
+ * storage sizes for the *_into functions, which fill caller memory
+ * instead of allocating. the structs hold only bytes, so any alignment
+ * will do.
+ */
+size_t
+reop_sigsize(void)
+{
+	return sizeof(struct reop_sig);
+}
+
+size_t
+reop_pubkeysize(void)
+{
+	return sizeof(struct reop_pubkey);
+}
+
+size_t
+reop_encmsgsize(void)
+{
+	return sizeof(struct reop_encmsg);
+}
+
 /*
  * nacl wrapper functions.
  * the nacl API isn't very friendly, requiring the caller to provide padding
@@ -220,8 +468,10 @@ reop_freestr(const char *str)
 static void
 symencryptraw(uint8_t *buf, uint64_t buflen, uint8_t *nonce, uint8_t *tag, const uint8_t *symkey)
 {
+	uint64_t t = tracestart();
 	randombytes(nonce, SYMNONCEBYTES);
 	crypto_secretbox_detached(buf, tag, buf, buflen, nonce, symkey);
+	traceend("secretbox", t, buflen);
 }
 
 /*
@@ -232,12 +482,28 @@ static int
 symdecryptraw(uint8_t *buf, uint64_t buflen, const uint8_t *nonce, const uint8_t *tag,
     const uint8_t *symkey)
 {
-	if (crypto_secretbox_open_detached(buf, buf, tag,
-	    buflen, nonce, symkey) == -1)
+	uint64_t t = tracestart();
+	int rv = crypto_secretbox_open_detached(buf, buf, tag, buflen, nonce, symkey);
+	traceend("secretbox_open", t, buflen);
+	if (rv == -1)
 		return -1;
 	return 0;
 }
 
+/*
+ * wrapper around crypto_secretbox for chunks.
+ * the caller provides the nonce.
+ * operates on buf "in place".
+ */
+static void
+chunkencryptraw(uint8_t *buf, uint64_t buflen, const uint8_t *nonce, uint8_t *tag,
+    const uint8_t *symkey)
+{
+	uint64_t t = tracestart();
+	crypto_secretbox_detached(buf, tag, buf, buflen, nonce, symkey);
+	traceend("secretbox", t, buflen);
+}
+
 /*
  * wrapper around crypto_box.
  * operates on buf "in place".
@@ -246,8 +512,10 @@ static void
 pubencryptraw(uint8_t *buf, uint64_t buflen, uint8_t *nonce, uint8_t *tag,
     const uint8_t *pubkey, const uint8_t *seckey)
 {
+	uint64_t t = tracestart();
 	randombytes(nonce, ENCNONCEBYTES);
 	crypto_box_detached(buf, tag, buf, buflen, nonce, pubkey, seckey);
+	traceend("box", t, buflen);
 }
 
 /*
@@ -258,8 +526,10 @@ static int
 pubdecryptraw(uint8_t *buf, uint64_t buflen, const uint8_t *nonce, const uint8_t *tag,
     const uint8_t *pubkey, const uint8_t *seckey)
 {
-	if (crypto_box_open_detached(buf, buf, tag,
-	    buflen, nonce, pubkey, seckey) == -1)
+	uint64_t t = tracestart();
+	int rv = crypto_box_open_detached(buf, buf, tag, buflen, nonce, pubkey, seckey);
+	traceend("box_open", t, buflen);
+	if (rv == -1)
 		return -1;
 	return 0;
 }
@@ -271,7 +541,9 @@ static void
 signraw(const uint8_t *seckey, const uint8_t *buf, uint64_t buflen,
     uint8_t *sig)
 {
+	uint64_t t = tracestart();
 	crypto_sign_detached(sig, NULL, buf, buflen, seckey);
+	traceend("sign", t, buflen);
 }
 
 /*
@@ -281,95 +553,286 @@ static int
 verifyraw(const uint8_t *pubkey, const uint8_t *buf, uint64_t buflen,
     const uint8_t *sig)
 {
-	if (crypto_sign_verify_detached(sig, buf, buflen, pubkey) == -1)
+	uint64_t t = tracestart();
+	int rv = crypto_sign_verify_detached(sig, buf, buflen, pubkey);
+	traceend("verify", t, buflen);
+	if (rv == -1)
+		return -1;
+	return 0;
+}
+
+/*
+ * agent protocol.
+ * a request is a header followed by len bytes of data, and the reply is
+ * the same, with a status (0 for success) in place of the op.
+ * data is sent and received in two pieces, a and b, to save some copying.
+ */
+enum {
+	AGENT_INFO = 1,		/* -> sigalg, encalg, randomid, ident */
+	AGENT_SIGN,		/* msg -> sig */
+	AGENT_BOX,		/* pubkey, msg -> nonce, tag, msg */
+	AGENT_BOXOPEN,		/* pubkey, nonce, tag, msg -> msg */
+	AGENT_BEFORENM,		/* pubkey -> shared key, for any pubkey */
+	AGENT_SIGNPH,		/* sha512 prehash -> Ed25519ph sig */
+};
+
+struct agenthdr {
+	uint32_t len;
+	uint8_t op;
+	uint8_t pad[3];
+};
+
+static int
+agentwrite(int fd, const void *buf, size_t buflen)
+{
+	while (buflen != 0) {
+		ssize_t x = write(fd, buf, buflen);
+		if (x == -1 && errno == EINTR)
+			continue;
+		if (x <= 0)
+			return -1;
+		buflen -= x;
+		buf = (const uint8_t *)buf + x;
+	}
+	return 0;
+}
+
+static int
+agentread(int fd, void *buf, size_t buflen)
+{
+	while (buflen != 0) {
+		ssize_t x = read(fd, buf, buflen);
+		if (x == -1 && errno == EINTR)
+			continue;
+		if (x <= 0)
+			return -1;
+		buflen -= x;
+		buf = (uint8_t *)buf + x;
+	}
+	return 0;
+}
+
+/*
+ * make a request. the reply must be exactly ralen + rblen long.
+ */
+static int
+agentcall(int fd, int op, const void *a, size_t alen, const void *b, size_t blen,
+    void *ra, size_t ralen, void *rb, size_t rblen)
+{
+	struct agenthdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.len = htonl(alen + blen);
+	hdr.op = op;
+	if (agentwrite(fd, &hdr, sizeof(hdr)) == -1 ||
+	    agentwrite(fd, a, alen) == -1 ||
+	    agentwrite(fd, b, blen) == -1)
 		return -1;
+	if (agentread(fd, &hdr, sizeof(hdr)) == -1)
+		return -1;
+	if (hdr.op != 0 || ntohl(hdr.len) != ralen + rblen)
+		return -1;
+	if (agentread(fd, ra, ralen) == -1 ||
+	    agentread(fd, rb, rblen) == -1)
+		return -1;
+	return 0;
+}
+
+/*
+ * operations using a seckey, which may be held by an agent.
+ * these work like the raw functions above, but an agent can fail.
+ */
+static int
+seckeycall(const struct reop_seckey *seckey, int op, const void *a, size_t alen,
+    const void *b, size_t blen, void *ra, size_t ralen, void *rb, size_t rblen)
+{
+	pthread_mutex_t *lock = (pthread_mutex_t *)&seckey->agentlock;
+
+	pthread_mutex_lock(lock);
+	int rv = agentcall(seckey->agentfd, op, a, alen, b, blen, ra, ralen,
+	    rb, rblen);
+	pthread_mutex_unlock(lock);
+	return rv;
+}
+
+static int
+seckeysign(const struct reop_seckey *seckey, const uint8_t *buf, uint64_t buflen,
+    uint8_t *sig)
+{
+	if (seckey->agent)
+		return seckeycall(seckey, AGENT_SIGN, NULL, 0, buf, buflen,
+		    sig, SIGBYTES, NULL, 0);
+	signraw(seckey->sigkey, buf, buflen, sig);
+	return 0;
+}
+
+static int
+seckeysignph(const struct reop_seckey *seckey, crypto_sign_state *state, uint8_t *sig)
+{
+	if (seckey->agent) {
+		uint8_t ph[crypto_hash_sha512_BYTES];
+		crypto_hash_sha512_final(&state->hs, ph);
+		return seckeycall(seckey, AGENT_SIGNPH, NULL, 0, ph, sizeof(ph),
+		    sig, SIGBYTES, NULL, 0);
+	}
+	crypto_sign_final_create(state, sig, NULL, seckey->sigkey);
+	return 0;
+}
+
+static int
+seckeybox(const struct reop_seckey *seckey, const uint8_t *pubkey, uint8_t *buf,
+    uint64_t buflen, uint8_t *nonce, uint8_t *tag)
+{
+	if (seckey->agent) {
+		uint8_t noncetag[ENCNONCEBYTES + ENCTAGBYTES];
+		if (seckeycall(seckey, AGENT_BOX, pubkey, ENCPUBLICBYTES,
+		    buf, buflen, noncetag, sizeof(noncetag), buf, buflen) == -1)
+			return -1;
+		memcpy(nonce, noncetag, ENCNONCEBYTES);
+		memcpy(tag, noncetag + ENCNONCEBYTES, ENCTAGBYTES);
+		return 0;
+	}
+	pubencryptraw(buf, buflen, nonce, tag, pubkey, seckey->enckey);
+	return 0;
+}
+
+static int
+seckeyboxopen(const struct reop_seckey *seckey, const uint8_t *pubkey, uint8_t *buf,
+    uint64_t buflen, const uint8_t *nonce, const uint8_t *tag)
+{
+	if (seckey->agent) {
+		uint8_t req[ENCPUBLICBYTES + ENCNONCEBYTES + ENCTAGBYTES];
+		memcpy(req, pubkey, ENCPUBLICBYTES);
+		memcpy(req + ENCPUBLICBYTES, nonce, ENCNONCEBYTES);
+		memcpy(req + ENCPUBLICBYTES + ENCNONCEBYTES, tag, ENCTAGBYTES);
+		return seckeycall(seckey, AGENT_BOXOPEN, req, sizeof(req),
+		    buf, buflen, NULL, 0, buf, buflen);
+	}
+	return pubdecryptraw(buf, buflen, nonce, tag, pubkey, seckey->enckey);
+}
+
+static int
+seckeybeforenm(const struct reop_seckey *seckey, const uint8_t *pubkey, uint8_t *key)
+{
+	if (seckey->agent)
+		return seckeycall(seckey, AGENT_BEFORENM, pubkey, ENCPUBLICBYTES,
+		    NULL, 0, key, crypto_box_BEFORENMBYTES, NULL, 0);
+	crypto_box_beforenm(key, pubkey, seckey->enckey);
 	return 0;
 }
 
+/*
+ * connect to an agent, and make a seckey that refers to it.
+ * only the public parts of the key are copied here.
+ */
+static struct reop_seckey *
+agentseckey(const char *sockname)
+{
+	struct sockaddr_un sa;
+	uint8_t info[2 + 2 + RANDOMIDLEN + IDENTLEN];
+
+	memset(&sa, 0, sizeof(sa));
+	if (strlcpy(sa.sun_path, sockname, sizeof(sa.sun_path)) >= sizeof(sa.sun_path))
+		return NULL;
+	sa.sun_family = AF_UNIX;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return NULL;
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+	    agentcall(fd, AGENT_INFO, NULL, 0, NULL, 0, info, sizeof(info),
+	    NULL, 0) == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	struct reop_seckey *seckey = malloc(sizeof(*seckey));
+	if (!seckey) {
+		close(fd);
+		return NULL;
+	}
+	memset(seckey, 0, sizeof(*seckey));
+	memcpy(seckey->sigalg, info, 2);
+	memcpy(seckey->encalg, info + 2, 2);
+	memcpy(seckey->randomid, info + 4, RANDOMIDLEN);
+	memcpy(seckey->ident, info + 4 + RANDOMIDLEN, IDENTLEN);
+	seckey->ident[IDENTLEN - 1] = '\0';
+	seckey->agent = 1;
+	seckey->agentfd = fd;
+	pthread_mutex_init(&seckey->agentlock, NULL);
+	return seckey;
+}
+
 /* file utilities */
+static const uint64_t maxmsgsize = 1UL << 30;
+
 static int
-readall(const char *filename, uint8_t **msgp, uint64_t *msglenp)
+readallfd(int fd, const uint8_t *prefix, size_t prefixlen, uint8_t **msgp,
+    uint64_t *msglenp)
 {
 	struct stat sb;
 	ssize_t x, space;
-	const uint64_t maxmsgsize = 1UL << 30;
-	int rv = -1;
+	uint64_t t = tracestart();
 
 	*msgp = NULL;
 	*msglenp = 0;
 
-	int fd = xopen(filename, O_RDONLY | O_NOFOLLOW, 0);
-	if (fd == -1)
-		return -1;
-	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
-		if (sb.st_size > maxmsgsize) {
-			close(fd);
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size >= prefixlen) {
+		if (sb.st_size > maxmsgsize)
 			return -2;
-		}
-		space = sb.st_size + 1;
+		space = sb.st_size - prefixlen + 1;
 	} else {
 		space = 64 * 1024 - 1;
 	}
 
-	uint8_t *msg = malloc(space + 1);
-	if (!msg) {
-		close(fd);
+	uint8_t *msg = malloc(prefixlen + space + 1);
+	if (!msg)
 		return -2;
-	}
-	uint64_t msglen = 0;
+	if (prefixlen)
+		memcpy(msg, prefix, prefixlen);
+	uint64_t msglen = prefixlen;
 	while (1) {
 		if (space == 0) {
 			if (msglen * 2 > maxmsgsize) {
-				rv = -2;
-				goto fail;
+				free(msg);
+				return -2;
 			}
 			space = msglen;
 			uint8_t *newmsg;
 			if (!(newmsg = realloc(msg, msglen + space + 1))) {
-				rv = -2;
-				goto fail;
+				free(msg);
+				return -2;
 			}
 			msg = newmsg;
 		}
 		if ((x = read(fd, msg + msglen, space)) == -1) {
-			rv = -3;
-			goto fail;
+			free(msg);
+			return -3;
 		}
 		if (x == 0)
 			break;
 		space -= x;
 		msglen += x;
 	}
-	close(fd);
 
 	msg[msglen] = 0;
 	*msgp = msg;
 	*msglenp = msglen;
+	traceend("read", t, msglen);
 	return 0;
-fail:
-	close(fd);
-	free(msg);
-	return rv;
 }
 
-/*
- * wrap lines in place.
- * start at the end and pull the string down as we go.
- */
-static void
-wraplines(char *str, size_t space)
+static int
+readall(const char *filename, uint8_t **msgp, uint64_t *msglenp)
 {
-	size_t len = strlen(str);
-	size_t num = (len - 1) / 76;
-	if (len + num + 1 > space)
-		return;
-	while (num > 0) {
-		size_t pos = 76 * num - 1;
-		size_t amt = len - pos < 76 ? len - pos : 76;
-		memmove(str + pos + num, str + pos, amt + 1);
-		str[pos + num] = '\n';
-		num--;
-	}
+	*msgp = NULL;
+	*msglenp = 0;
+
+	int fd = xopen(filename, O_RDONLY | O_NOFOLLOW, 0);
+	if (fd == -1)
+		return -1;
+	int rv = readallfd(fd, NULL, 0, msgp, msglenp);
+	close(fd);
+	return rv;
 }
 
 /*
@@ -395,94 +858,275 @@ gethomefile(const char *filename, char *buf, size_t buflen)
 /*
  * parse ident line, return pointer to next line
  */
-static char *
-readident(char *buf, char *ident)
+static const char *
+readident(struct reop_ctx *ctx, const char *buf, char *ident)
 {
 #if IDENTLEN != 64
 #error fix sscanf
 #endif
-	if (sscanf(buf, "ident:%63s", ident) != 1)
-		errx(1, "no ident found: %s", buf);
-	if (!(buf = strchr(buf + 1, '\n')))
-		errx(1, "invalid header");
-	return buf + 1;
-}
+	if (sscanf(buf, "ident:%63s", ident) != 1) {
+		ctxerr(ctx, "no ident found");
+		return NULL;
+	}
+	if (!(buf = strchr(buf + 1, '\n'))) {
+		ctxerr(ctx, "invalid header");
+		return NULL;
+	}
+	return buf + 1;
+}
 
 /*
- * will parse a few different kinds of keys
+ * will parse a few different kinds of keys.
+ * the input is not duplicated; the base64 up to the end guard is decoded
+ * through a fixed buffer on the stack, then copied into the key.
  */
 static int
-parsekeydata(const char *keydataorig, const char *keytype, void *key, size_t keylen, char *ident)
+parsekeydata(struct reop_ctx *ctx, const char *keydata, const char *keytype,
+    void *key, size_t keylen, char *ident)
 {
 	const char *beginkey = "-----BEGIN REOP ";
 	const char *endkey = "-----END REOP ";
+	uint8_t buf[768];
+	int rv = -1;
 
-	char *keydata = strdup(keydataorig);
 	if (strncmp(keydata, beginkey, strlen(beginkey)) != 0)
 		goto invalid;
 	if (strncmp(keydata + strlen(beginkey), keytype, strlen(keytype)) != 0)
 		goto invalid;
-	char *end;
+	const char *end;
 	if (!(end = strstr(keydata, endkey)))
 		goto invalid;
-	*end = 0;
-	char *begin;
-	if (!(begin = strchr(keydata, '\n')))
+	const char *begin;
+	if (!(begin = strchr(keydata, '\n')) || begin > end)
+		goto invalid;
+	if (!(begin = readident(ctx, begin + 1, ident)))
+		return -1;
+	if (begin > end)
+		goto invalid;
+
+	size_t datalen = end - begin;
+	if (datalen * 3 / 4 + 3 > sizeof(buf))
 		goto invalid;
-	begin = readident(begin + 1, ident);
-	*end = 0;
-	if (reopb64_pton(begin, key, keylen) != keylen)
-		errx(1, "invalid b64 encoding");
+	struct reopb64_dec dec;
+	size_t used;
+	int amt;
+	reopb64_dec_init(&dec);
+	if ((amt = reopb64_dec_update(&dec, begin, datalen, buf, sizeof(buf),
+	    &used)) != keylen || reopb64_dec_final(&dec) != 0) {
+		ctxerr(ctx, "invalid b64 encoding");
+		goto done;
+	}
+	memcpy(key, buf, keylen);
+	rv = 0;
+	goto done;
+
+invalid:
+	ctxerr(ctx, "invalid key data");
+done:
+	sodium_memzero(buf, sizeof(buf));
+	return rv;
+}
+
+/*
+ * the kdf used for new secret keys and symmetric messages.
+ * for argon2id, rounds packs the ops limit into the top byte and the
+ * memory limit in KiB into the rest.
+ */
+static int
+kdfknown(const uint8_t *alg)
+{
+	return memcmp(alg, KDFALG, 2) == 0 || memcmp(alg, ARGONKDFALG, 2) == 0;
+}
+
+/*
+ * choose the kdf for new keys and messages.
+ * bcrypt takes only a number of rounds, in ops.
+ */
+int
+reop_ctx_setkdf(struct reop_ctx *ctx, enum reop_kdfalg alg, uint32_t ops,
+    uint32_t memkib)
+{
+	switch (alg) {
+	case REOP_KDF_BCRYPT:
+		if (ops < 1 || memkib != 0)
+			break;
+		memcpy(ctx->kdfalg, KDFALG, 2);
+		ctx->kdfrounds = ops;
+		return 0;
+	case REOP_KDF_ARGON2ID:
+		if (ops < 1 || ops > 0xff || memkib < 8 || memkib > 0xffffff)
+			break;
+		memcpy(ctx->kdfalg, ARGONKDFALG, 2);
+		ctx->kdfrounds = ops << 24 | memkib;
+		return 0;
+	}
+	ctxerr(ctx, "invalid kdf parameters");
+	return -1;
+}
 
-	xfree(keydata, strlen(keydata));
+/*
+ * the same, for the plain functions. call before starting any threads.
+ */
+int
+reop_setkdf(enum reop_kdfalg alg, uint32_t ops, uint32_t memkib)
+{
+	return reop_ctx_setkdf(&defctx, alg, ops, memkib);
+}
 
+/*
+ * the kdf and its stored rounds for a new key or message.
+ * rounds overrides the cost of the default kdf: bcrypt rounds, or argon2id
+ * passes over the same memory. 0 keeps the default.
+ */
+static int
+kdfparams(struct reop_ctx *ctx, uint32_t rounds, uint8_t *alg, uint32_t *kdfrounds)
+{
+	memcpy(alg, ctx->kdfalg, 2);
+	if (rounds == 0)
+		*kdfrounds = ctx->kdfrounds;
+	else if (memcmp(alg, KDFALG, 2) == 0)
+		*kdfrounds = rounds;
+	else if (rounds <= 0xff)
+		*kdfrounds = rounds << 24 | (ctx->kdfrounds & 0xffffff);
+	else {
+		ctxerr(ctx, "too many argon2id passes");
+		return -1;
+	}
 	return 0;
+}
 
-invalid:
-	errx(1, "invalid key data");
-	return -1; /* xxx */
+/*
+ * find the rounds (bcrypt) or passes (argon2id, over memkib of memory)
+ * that take about millis milliseconds on this machine.
+ * a cheap run gives the cost of each round; a second run at the estimate
+ * corrects for the fixed overhead.
+ */
+uint32_t
+reop_kdfcalibrate(enum reop_kdfalg alg, uint32_t memkib, uint32_t millis)
+{
+	uint8_t salt[16] = { 0 }, key[SYMKEYBYTES];
+	const char *password = "calibrate";
+	uint32_t max = alg == REOP_KDF_ARGON2ID ? 0xff : 0xffff;
+	uint32_t rounds = alg == REOP_KDF_ARGON2ID ? 1 : 4;
+	uint64_t target = millis * 1000000ULL;
+
+	if (alg == REOP_KDF_ARGON2ID && (memkib < 8 || memkib > 0xffffff))
+		return 0;
+	for (int pass = 0; pass < 2; pass++) {
+		uint64_t t = nanotime();
+		int rv;
+		if (alg == REOP_KDF_ARGON2ID)
+			rv = crypto_pwhash(key, sizeof(key), password, strlen(password),
+			    salt, rounds, (size_t)memkib * 1024,
+			    crypto_pwhash_ALG_ARGON2ID13);
+		else
+			rv = bcrypt_pbkdf(password, strlen(password), salt,
+			    sizeof(salt), key, sizeof(key), rounds);
+		if (rv == -1)
+			return 0;
+		t = nanotime() - t;
+		if (t == 0)
+			t = 1;
+		uint64_t est = target * rounds / t;
+		if (est < 1)
+			est = 1;
+		if (est > max)
+			est = max;
+		if (est == rounds)
+			break;
+		rounds = est;
+	}
+	sodium_memzero(key, sizeof(key));
+	return rounds;
+}
+
+/*
+ * the password callback for the plain functions: REOP_PASSPHRASE if it's
+ * set, or else ask on the tty.
+ */
+int
+reop_ttypassword(void *arg, const char *prompt, char *buf, size_t buflen)
+{
+	const char *password = getenv("REOP_PASSPHRASE");
+
+	if (password)
+		return strlcpy(buf, password, buflen) < buflen ? 0 : -1;
+	if (!readpassphrase(prompt, buf, buflen, RPP_REQUIRE_TTY | RPP_ECHO_OFF))
+		return -1;
+	return 0;
 }
 
 /*
  * generate a symmetric encryption key.
  * caller creates and provides salt.
  * if rounds is 0 (no password requested), generates a dummy zero key.
+ * without a password, the ctx callback is asked for one.
  */
-static void
-kdf(const uint8_t *salt, size_t saltlen, int rounds, const char *password,
-    kdf_confirm confirm, uint8_t *key, size_t keylen)
+static int
+kdf(struct reop_ctx *ctx, const uint8_t *alg, uint32_t rounds, const uint8_t *salt,
+    size_t saltlen, const char *password, kdf_confirm confirm, uint8_t *key,
+    size_t keylen)
 {
 	if (rounds == 0) {
 		memset(key, 0, keylen);
-		return;
+		return 0;
 	}
 
-	if (!password)
-		password = getenv("REOP_PASSPHRASE");
-
 	char passbuf[1024];
+	int rv = -1;
 	if (!password) {
-		int rppflags = RPP_REQUIRE_TTY | RPP_ECHO_OFF;
-		if (!readpassphrase("passphrase: ", passbuf, sizeof(passbuf), rppflags))
-			errx(1, "unable to read passphrase");
-		if (strlen(passbuf) == 0)
-			errx(1, "please provide a password");
+		if (!ctx->passwordcb) {
+			ctxerr(ctx, "no password");
+			return -1;
+		}
+		if (ctx->passwordcb(ctx->passwordarg, "passphrase: ", passbuf,
+		    sizeof(passbuf)) != 0) {
+			ctxerr(ctx, "unable to read passphrase");
+			goto done;
+		}
+		if (strlen(passbuf) == 0) {
+			ctxerr(ctx, "please provide a password");
+			goto done;
+		}
 		if (confirm.v) {
 			char pass2[1024];
 
-			if (!readpassphrase("confirm passphrase: ", pass2,
-			    sizeof(pass2), rppflags))
-				errx(1, "unable to read passphrase");
-			if (strcmp(passbuf, pass2) != 0)
-				errx(1, "passwords don't match");
+			int cbrv = ctx->passwordcb(ctx->passwordarg,
+			    "confirm passphrase: ", pass2, sizeof(pass2));
+			int same = cbrv == 0 && strcmp(passbuf, pass2) == 0;
 			sodium_memzero(pass2, sizeof(pass2));
+			if (cbrv != 0) {
+				ctxerr(ctx, "unable to read passphrase");
+				goto done;
+			}
+			if (!same) {
+				ctxerr(ctx, "passwords don't match");
+				goto done;
+			}
 		}
 		password = passbuf;
 	}
-	if (bcrypt_pbkdf(password, strlen(password), salt, saltlen, key,
-	    keylen, rounds) == -1)
-		errx(1, "bcrypt pbkdf");
+	uint64_t t = tracestart();
+	if (memcmp(alg, ARGONKDFALG, 2) == 0) {
+		if (saltlen != crypto_pwhash_SALTBYTES ||
+		    crypto_pwhash(key, keylen, password, strlen(password), salt,
+		    rounds >> 24, (size_t)(rounds & 0xffffff) * 1024,
+		    crypto_pwhash_ALG_ARGON2ID13) == -1) {
+			ctxerr(ctx, "argon2id");
+			goto done;
+		}
+	} else {
+		if (bcrypt_pbkdf(password, strlen(password), salt, saltlen, key,
+		    keylen, rounds) == -1) {
+			ctxerr(ctx, "bcrypt pbkdf");
+			goto done;
+		}
+	}
+	traceend("kdf", t, keylen);
+	rv = 0;
+done:
 	sodium_memzero(passbuf, sizeof(passbuf));
+	return rv;
 }
 
 /*
@@ -491,65 +1135,204 @@ kdf(const uint8_t *salt, size_t saltlen, int rounds, const char *password,
  * are still encrypted with a null key.
  * these functions will prompt for password if none is provided.
  */
-static void
-encryptseckey(struct reop_seckey *seckey, const char *password)
+static int
+encryptseckey(struct reop_ctx *ctx, struct reop_seckey *seckey, const char *password,
+    uint32_t rounds)
 {
 	uint8_t symkey[SYMKEYBYTES];
 	kdf_confirm confirm = { 1 };
 
-	int rounds = 42;
-	if (password && strlen(password) == 0)
+	if (kdfparams(ctx, rounds, seckey->kdfalg, &rounds) != 0)
+		return -1;
+	if (password && strlen(password) == 0) {
 		rounds = 0;
+		memcpy(seckey->kdfalg, KDFALG, 2);
+	}
 
 	randombytes(seckey->salt, sizeof(seckey->salt));
 	seckey->kdfrounds = htonl(rounds);
 
-	kdf(seckey->salt, sizeof(seckey->salt), rounds, password,
-	    confirm, symkey, sizeof(symkey));
+	if (kdf(ctx, seckey->kdfalg, rounds, seckey->salt, sizeof(seckey->salt),
+	    password, confirm, symkey, sizeof(symkey)) != 0)
+		return -1;
 	symencryptraw(seckey->sigkey, sizeof(seckey->sigkey) + sizeof(seckey->enckey),
 	    seckey->nonce, seckey->tag, symkey);
 	sodium_memzero(symkey, sizeof(symkey));
+	return 0;
 }
 
 static int
-decryptseckey(struct reop_seckey *seckey, const char *password)
+decryptseckey(struct reop_ctx *ctx, struct reop_seckey *seckey, const char *password)
 {
-	if (memcmp(seckey->kdfalg, KDFALG, 2) != 0)
+	if (!kdfknown(seckey->kdfalg)) {
+		ctxerr(ctx, "unsupported key format");
 		return -2;
+	}
 
 	uint8_t symkey[SYMKEYBYTES];
 	kdf_confirm confirm = { 0 };
 
-	int rounds = ntohl(seckey->kdfrounds);
+	uint32_t rounds = ntohl(seckey->kdfrounds);
 
-	kdf(seckey->salt, sizeof(seckey->salt), rounds, password,
-	    confirm, symkey, sizeof(symkey));
+	if (kdf(ctx, seckey->kdfalg, rounds, seckey->salt, sizeof(seckey->salt),
+	    password, confirm, symkey, sizeof(symkey)) != 0)
+		return -1;
 	int rv = symdecryptraw(seckey->sigkey, sizeof(seckey->sigkey) + sizeof(seckey->enckey),
 	    seckey->nonce, seckey->tag, symkey);
 	sodium_memzero(symkey, sizeof(symkey));
-	if (rv != 0)
+	if (rv != 0) {
+		ctxerr(ctx, "incorrect passphrase");
 		return rv;
+	}
+
+	return 0;
+}
+
+/*
+ * the pubkeyring is indexed by a sidecar file, pubkeyring.idx, so lookups
+ * don't scan the whole ring. the index is a copy of every key followed by
+ * two open addressed hash tables, one by ident and one by randomid, which
+ * hold entry numbers plus one. it records the ring's inode, size, and
+ * mtime and is rebuilt when they change. it's a private cache, so it's
+ * written in native byte order.
+ */
+struct ringindexhdr {
+	char magic[8];
+	uint8_t hashkey[crypto_shorthash_KEYBYTES];
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;
+	int64_t mtimensec;
+	uint32_t nkeys;
+	uint32_t nbuckets;
+};
+static const char ringindexmagic[8] = "REOPIDX";
+
+struct ringindex {
+	struct ringindexhdr *hdr;
+	struct reop_pubkey *keys;
+	uint32_t *byident;
+	uint32_t *byid;
+	void *buf;
+	size_t buflen;
+	int mapped;
+};
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+static void
+ringstat(const struct stat *sb, struct ringindexhdr *hdr)
+{
+	hdr->ino = sb->st_ino;
+	hdr->size = sb->st_size;
+	hdr->mtime = sb->st_mtim.tv_sec;
+	hdr->mtimensec = sb->st_mtim.tv_nsec;
+}
+
+static uint32_t
+ringhash(const struct ringindexhdr *hdr, const void *data, size_t len)
+{
+	uint8_t h[crypto_shorthash_BYTES];
+	uint32_t v;
+
+	crypto_shorthash(h, data, len, hdr->hashkey);
+	memcpy(&v, h, sizeof(v));
+	return v;
+}
+
+static size_t
+ringindexsize(uint32_t nkeys, uint32_t nbuckets)
+{
+	return sizeof(struct ringindexhdr) + (size_t)nkeys * sizeof(struct reop_pubkey) +
+	    2 * (size_t)nbuckets * sizeof(uint32_t);
+}
 
+static void
+ringindexinit(struct ringindex *idx, void *buf, size_t buflen)
+{
+	idx->buf = buf;
+	idx->buflen = buflen;
+	idx->hdr = buf;
+	idx->keys = (struct reop_pubkey *)(idx->hdr + 1);
+	idx->byident = (uint32_t *)(idx->keys + idx->hdr->nkeys);
+	idx->byid = idx->byident + idx->hdr->nbuckets;
+}
+
+static void
+ringinsert(const struct ringindex *idx, uint32_t *table, uint32_t n,
+    const void *data, size_t len, size_t offset)
+{
+	uint32_t mask = idx->hdr->nbuckets - 1;
+	uint32_t slot = ringhash(idx->hdr, data, len) & mask;
+	uint32_t e;
+
+	while ((e = table[slot])) {
+		/* first key in the ring wins, same as a scan */
+		if (memcmp((char *)&idx->keys[e - 1] + offset, data, len) == 0)
+			return;
+		slot = (slot + 1) & mask;
+	}
+	table[slot] = n + 1;
+}
+
+/*
+ * build an index in memory from an array of keys
+ */
+static int
+fillringindex(const struct reop_pubkey *keys, size_t nkeys, struct ringindex *idx)
+{
+	if (nkeys > UINT32_MAX / 4)
+		return -1;
+	uint32_t nbuckets = 16;
+	while (nbuckets < nkeys * 2)
+		nbuckets *= 2;
+	size_t buflen = ringindexsize(nkeys, nbuckets);
+	void *buf = calloc(1, buflen);
+	if (!buf)
+		return -1;
+	struct ringindexhdr *hdr = buf;
+	memcpy(hdr->magic, ringindexmagic, sizeof(hdr->magic));
+	randombytes(hdr->hashkey, sizeof(hdr->hashkey));
+	hdr->nkeys = nkeys;
+	hdr->nbuckets = nbuckets;
+	ringindexinit(idx, buf, buflen);
+	idx->mapped = 0;
+	if (nkeys)
+		memcpy(idx->keys, keys, nkeys * sizeof(*keys));
+
+	for (uint32_t i = 0; i < nkeys; i++) {
+		const struct reop_pubkey *key = &idx->keys[i];
+		idx->keys[i].ident[IDENTLEN - 1] = 0;
+		ringinsert(idx, idx->byident, i, key->ident, strlen(key->ident) + 1,
+		    offsetof(struct reop_pubkey, ident));
+		ringinsert(idx, idx->byid, i, key->randomid, RANDOMIDLEN,
+		    offsetof(struct reop_pubkey, randomid));
+	}
 	return 0;
 }
 
 /*
- * read user's pubkeyring file to allow lookup by ident
- * blank lines are permitted between keys, but not within
+ * read user's pubkeyring file and build the index
+ * blank lines are permitted between keys, but not within.
+ * a malformed key ends the ring; the keys before it are still indexed.
  */
 static int
-findpubkey(const char *ident, struct reop_pubkey *key)
+buildringindex(int fd, const struct stat *sb, struct ringindex *idx)
 {
 	const char *beginkey = "-----BEGIN REOP PUBLIC KEY-----\n";
 	const char *endkey = "-----END REOP PUBLIC KEY-----\n";
+	struct reop_ctx ctx = defctx;
 
-	char keyringname[1024];
-	if (gethomefile("pubkeyring", keyringname, sizeof(keyringname)) != 0)
-		return -1;
-	FILE *fp = fopen(keyringname, "r");
-	if (!fp)
+	FILE *fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
 		return -1;
+	}
 
+	struct reop_pubkey *keys = NULL;
+	uint32_t nkeys = 0, maxkeys = 0;
 	char line[1024];
 	while (fgets(line, sizeof(line), fp)) {
 		char buf[1024];
@@ -558,31 +1341,203 @@ findpubkey(const char *ident, struct reop_pubkey *key)
 		if (line[0] == 0 || line[0] == '\n')
 			continue;
 		if (strncmp(line, beginkey, strlen(beginkey)) != 0)
-			goto fail;
+			break;
 		char identbuf[IDENTLEN];
-		while (1) {
-			if (!fgets(line, sizeof(line), fp))
-				goto fail;
+		int complete = 0;
+		while (fgets(line, sizeof(line), fp)) {
 			if (identline) {
-				readident(line, identbuf);
+				if (!readident(&ctx, line, identbuf))
+					break;
 				identline = 0;
 				continue;
 			}
-			if (strncmp(line, endkey, strlen(endkey)) == 0)
+			if (strncmp(line, endkey, strlen(endkey)) == 0) {
+				complete = 1;
 				break;
+			}
 			strlcat(buf, line, sizeof(buf));
 		}
-		if (strcmp(ident, identbuf) == 0) {
-			strlcpy(key->ident, identbuf, sizeof(key->ident));
-			if (reopb64_pton(buf, (void *)key, pubkeysize) != pubkeysize)
-				goto fail;
-			fclose(fp);
-			return 0;
+		if (!complete)
+			break;
+		if (nkeys == maxkeys) {
+			maxkeys = maxkeys ? maxkeys * 2 : 64;
+			struct reop_pubkey *newkeys;
+			if (maxkeys > UINT32_MAX / 4 ||
+			    !(newkeys = realloc(keys, maxkeys * sizeof(*keys)))) {
+				free(keys);
+				fclose(fp);
+				return -1;
+			}
+			keys = newkeys;
 		}
+		struct reop_pubkey *key = &keys[nkeys];
+		memset(key, 0, sizeof(*key));
+		if (reopb64_pton(buf, (void *)key, pubkeysize) != pubkeysize)
+			break;
+		strlcpy(key->ident, identbuf, sizeof(key->ident));
+		nkeys++;
 	}
-fail:
 	fclose(fp);
-	return -1;
+
+	int rv = fillringindex(keys, nkeys, idx);
+	free(keys);
+	if (rv == 0)
+		ringstat(sb, idx->hdr);
+	return rv;
+}
+
+static int
+openringindex(const char *indexname, const struct stat *sb, struct ringindex *idx)
+{
+	struct stat isb;
+	struct ringindexhdr want;
+
+	int fd = open(indexname, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &isb) == -1 || !S_ISREG(isb.st_mode) ||
+	    isb.st_size < sizeof(struct ringindexhdr) || isb.st_size > maxmsgsize) {
+		close(fd);
+		return -1;
+	}
+	void *buf = mmap(NULL, isb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return -1;
+
+	const struct ringindexhdr *hdr = buf;
+	ringstat(sb, &want);
+	if (memcmp(hdr->magic, ringindexmagic, sizeof(hdr->magic)) != 0 ||
+	    hdr->ino != want.ino || hdr->size != want.size ||
+	    hdr->mtime != want.mtime || hdr->mtimensec != want.mtimensec ||
+	    hdr->nkeys > UINT32_MAX / 4 || hdr->nbuckets < 16 ||
+	    (hdr->nbuckets & (hdr->nbuckets - 1)) != 0 ||
+	    hdr->nbuckets < hdr->nkeys * 2 ||
+	    ringindexsize(hdr->nkeys, hdr->nbuckets) != isb.st_size) {
+		munmap(buf, isb.st_size);
+		return -1;
+	}
+	ringindexinit(idx, buf, isb.st_size);
+	idx->mapped = 1;
+	return 0;
+}
+
+/*
+ * write the index next to the ring. a failure here only costs speed.
+ */
+static void
+saveringindex(const char *indexname, const struct ringindex *idx)
+{
+	char tmpname[1024];
+
+	if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXXXXXX", indexname) >=
+	    sizeof(tmpname))
+		return;
+	int fd = mkstemp(tmpname);
+	if (fd == -1)
+		return;
+	const uint8_t *p = idx->buf;
+	size_t left = idx->buflen;
+	while (left) {
+		ssize_t x = write(fd, p, left);
+		if (x == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		p += x;
+		left -= x;
+	}
+	if (close(fd) == -1 || left || rename(tmpname, indexname) == -1)
+		unlink(tmpname);
+}
+
+static int
+loadringindex(struct ringindex *idx)
+{
+	char keyringname[1024], indexname[1024];
+	struct stat sb;
+
+	if (gethomefile("pubkeyring", keyringname, sizeof(keyringname)) != 0 ||
+	    gethomefile("pubkeyring.idx", indexname, sizeof(indexname)) != 0)
+		return -1;
+	int fd = open(keyringname, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (openringindex(indexname, &sb, idx) == 0) {
+		close(fd);
+		return 0;
+	}
+	if (buildringindex(fd, &sb, idx) != 0)
+		return -1;
+	saveringindex(indexname, idx);
+	return 0;
+}
+
+static void
+freeringindex(struct ringindex *idx)
+{
+	if (idx->mapped)
+		munmap(idx->buf, idx->buflen);
+	else
+		free(idx->buf);
+}
+
+/*
+ * lookup by randomid if given, otherwise by ident
+ */
+static const struct reop_pubkey *
+ringlookup(const struct ringindex *idx, const char *ident, const uint8_t *randomid)
+{
+	const uint32_t *table;
+	const void *data;
+	size_t len, offset;
+
+	if (randomid) {
+		table = idx->byid;
+		data = randomid;
+		len = RANDOMIDLEN;
+		offset = offsetof(struct reop_pubkey, randomid);
+	} else {
+		table = idx->byident;
+		data = ident;
+		len = strlen(ident) + 1;
+		if (len > IDENTLEN)
+			return NULL;
+		offset = offsetof(struct reop_pubkey, ident);
+	}
+
+	uint32_t mask = idx->hdr->nbuckets - 1;
+	uint32_t slot = ringhash(idx->hdr, data, len) & mask;
+	uint32_t e, probes = 0;
+	while ((e = table[slot]) && e <= idx->hdr->nkeys &&
+	    probes++ < idx->hdr->nbuckets) {
+		const struct reop_pubkey *k = &idx->keys[e - 1];
+		if (memcmp((const char *)k + offset, data, len) == 0)
+			return k;
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+static int
+findpubkey(const char *ident, const uint8_t *randomid, struct reop_pubkey *key)
+{
+	struct ringindex idx;
+
+	if (loadringindex(&idx) != 0)
+		return -1;
+	const struct reop_pubkey *k = ringlookup(&idx, ident, randomid);
+	if (k) {
+		memcpy(key, k, sizeof(*key));
+		key->ident[IDENTLEN - 1] = 0;
+	}
+	freeringindex(&idx);
+	return k ? 0 : -1;
 }
 
 /*
@@ -598,7 +1553,7 @@ reop_getpubkey(const char *pubkeyfile, const char *ident)
 		return NULL;
 
 	if (!pubkeyfile && ident) {
-		if (findpubkey(ident, pubkey) == 0)
+		if (findpubkey(ident, NULL, pubkey) == 0)
 			return pubkey;
 		goto fail;
 	}
@@ -613,7 +1568,9 @@ reop_getpubkey(const char *pubkeyfile, const char *ident)
 	readall(pubkeyfile, &keydata, &keydatalen);
 	if (!keydata)
 		goto fail;
-	int rv = parsekeydata(keydata, "PUBLIC KEY", pubkey, pubkeysize, pubkey->ident);
+	struct reop_ctx ctx = defctx;
+	int rv = parsekeydata(&ctx, (char *)keydata, "PUBLIC KEY", pubkey, pubkeysize,
+	    pubkey->ident);
 	xfree(keydata, keydatalen);
 	if (rv != 0)
 		goto fail;
@@ -624,6 +1581,24 @@ fail:
 	return NULL;
 }
 
+/*
+ * pubkey for a signature. without a pubkey file, the ring is searched by
+ * the signing key's randomid first, since idents need not be unique.
+ */
+const struct reop_pubkey *
+reop_getsigpubkey(const char *pubkeyfile, const struct reop_sig *sig)
+{
+	if (!pubkeyfile) {
+		struct reop_pubkey *pubkey = malloc(sizeof(*pubkey));
+		if (!pubkey)
+			return NULL;
+		if (findpubkey(NULL, sig->randomid, pubkey) == 0)
+			return pubkey;
+		free(pubkey);
+	}
+	return reop_getpubkey(pubkeyfile, sig->ident);
+}
+
 /*
  * free pubkey
  */
@@ -635,31 +1610,48 @@ reop_freepubkey(const struct reop_pubkey *pubkey)
 
 /*
  * 1. specified file
- * 2. default seckey file
+ * 2. agent named by REOP_AGENT_SOCK
+ * 3. default seckey file
  */
 const struct reop_seckey *
-reop_getseckey(const char *seckeyfile, const char *password)
+reop_ctx_getseckey(struct reop_ctx *ctx, const char *seckeyfile, const char *password)
 {
+	const char *sockname;
+	if (!seckeyfile && (sockname = getenv("REOP_AGENT_SOCK")) && *sockname) {
+		struct reop_seckey *seckey = agentseckey(sockname);
+		if (!seckey)
+			ctxerr(ctx, "unable to use agent %s", sockname);
+		return seckey;
+	}
+
 	struct reop_seckey *seckey = malloc(sizeof(*seckey));
-	if (!seckey)
+	if (!seckey) {
+		ctxerr(ctx, "out of memory");
 		return NULL;
+	}
+	seckey->agent = 0;
 
 	char namebuf[1024];
 	if (!seckeyfile && gethomefile("seckey", namebuf, sizeof(namebuf)) == 0)
 		seckeyfile = namebuf;
-	if (!seckeyfile)
+	if (!seckeyfile) {
+		ctxerr(ctx, "no seckey");
 		goto fail;
+	}
 
 	uint64_t keydatalen;
 	uint8_t *keydata;
 	readall(seckeyfile, &keydata, &keydatalen);
-	if (!keydata)
+	if (!keydata) {
+		ctxerr(ctx, "could not read %s", seckeyfile);
 		goto fail;
-	int rv = parsekeydata(keydata, "SECRET KEY", seckey, seckeysize, seckey->ident);
+	}
+	int rv = parsekeydata(ctx, (char *)keydata, "SECRET KEY", seckey, seckeysize,
+	    seckey->ident);
 	xfree(keydata, keydatalen);
 	if (rv != 0)
 		goto fail;
-	rv = decryptseckey(seckey, password);
+	rv = decryptseckey(ctx, seckey, password);
 	if (rv != 0)
 		goto fail;
 	return seckey;
@@ -669,38 +1661,129 @@ fail:
 	return NULL;
 }
 
+const struct reop_seckey *
+reop_getseckey(const char *seckeyfile, const char *password)
+{
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_getseckey(&ctx, seckeyfile, password);
+}
+
 /*
  * free seckey
  */
 void
 reop_freeseckey(const struct reop_seckey *seckey)
 {
+	if (seckey->agent) {
+		close(seckey->agentfd);
+		pthread_mutex_destroy((pthread_mutex_t *)&seckey->agentlock);
+	}
 	xfree((void *)seckey, sizeof(*seckey));
 }
 
 /*
- * can write a few different file types
+ * can write a few different file types.
+ * the encoded length, counting the nul, is known up front: the b64 data is
+ * wrapped to 76 columns with a newline after every line, the last included.
  */
+static const char keyfmt[] = "-----BEGIN REOP %s-----\nident:%s\n";
+static const char keyendfmt[] = "-----END REOP %s-----\n";
+
+static size_t
+encodedkeylen(const char *info, size_t keylen, const char *ident)
+{
+	size_t b64len = (keylen + 2) / 3 * 4;
+
+	return strlen(keyfmt) - 4 + strlen(info) + strlen(ident) +
+	    b64len + (b64len + 75) / 76 +
+	    strlen(keyendfmt) - 2 + strlen(info) + 1;
+}
+
+static int
+encodekeyinto(const char *info, const void *key, size_t keylen, const char *ident,
+    char *buf, size_t buflen)
+{
+	struct reopb64_enc enc;
+	int amt;
+
+	if (buflen < encodedkeylen(info, keylen, ident))
+		return -1;
+	size_t len = snprintf(buf, buflen, keyfmt, info, ident);
+	reopb64_enc_init(&enc);
+	if ((amt = reopb64_enc_update(&enc, key, keylen, buf + len, buflen - len)) == -1)
+		return -1;
+	len += amt;
+	if ((amt = reopb64_enc_final(&enc, buf + len, buflen - len)) == -1)
+		return -1;
+	len += amt;
+	snprintf(buf + len, buflen - len, keyendfmt, info);
+	return 0;
+}
+
 static const char *
 encodekey(const char *info, const void *key, size_t keylen, const char *ident)
 {
-	char buf[1024];
-	char b64[1024];
+	size_t len = encodedkeylen(info, keylen, ident);
+	char *str = malloc(len);
 
-	if (reopb64_ntop(key, keylen, b64, sizeof(b64)) == -1)
-		errx(1, "b64 encode failed");
-	wraplines(b64, sizeof(b64));
-	snprintf(buf, sizeof(buf), "-----BEGIN REOP %s-----\n"
-	    "ident:%s\n"
-	    "%s\n"
-	    "-----END REOP %s-----\n",
-	    info, ident, b64, info);
-	char *str = strdup(buf);
-	sodium_memzero(b64, sizeof(b64));
-	sodium_memzero(buf, sizeof(buf));
+	if (str && encodekeyinto(info, key, keylen, ident, str, len) != 0) {
+		xfree(str, len);
+		return NULL;
+	}
 	return str;
 }
 
+/*
+ * binary keys and signatures are the fixed fields, then the ident length
+ * in network byte order, then the ident without a nul. parsing copies the
+ * fixed fields and the ident into the key, where the ident gets its nul,
+ * so it is a copy of fixed size and needs no allocation. the data need not
+ * be aligned or terminated.
+ */
+static size_t
+binkeylen(size_t keylen, const char *ident)
+{
+	return keylen + 4 + strlen(ident);
+}
+
+static int
+encodebin(const void *key, size_t keylen, const char *ident, uint8_t *buf,
+    size_t buflen)
+{
+	size_t identlen = strlen(ident);
+	uint32_t netlen = htonl(identlen);
+
+	if (buflen < keylen + 4 + identlen)
+		return -1;
+	memcpy(buf, key, keylen);
+	memcpy(buf + keylen, &netlen, 4);
+	memcpy(buf + keylen + 4, ident, identlen);
+	return 0;
+}
+
+static int
+parsebin(struct reop_ctx *ctx, const uint8_t *data, uint64_t datalen, void *key,
+    size_t keylen, char *ident)
+{
+	uint32_t identlen;
+
+	if (datalen < keylen + 4)
+		goto invalid;
+	memcpy(&identlen, data + keylen, 4);
+	identlen = ntohl(identlen);
+	if (identlen >= IDENTLEN || datalen != keylen + 4 + identlen ||
+	    memchr(data + keylen + 4, 0, identlen))
+		goto invalid;
+	memcpy(key, data, keylen);
+	memcpy(ident, data + keylen + 4, identlen);
+	ident[identlen] = '\0';
+	return 0;
+
+invalid:
+	ctxerr(ctx, "invalid key data");
+	return -1;
+}
+
 /*
  * generate a complete key pair (actually two, for signing and encryption)
  */
@@ -709,10 +1792,14 @@ reop_generate(const char *ident)
 {
 	uint8_t randomid[RANDOMIDLEN];
 
-	struct reop_pubkey *pubkey = xmalloc(sizeof(*pubkey));
+	struct reop_pubkey *pubkey = malloc(sizeof(*pubkey));
+	struct reop_seckey *seckey = malloc(sizeof(*seckey));
+	if (!pubkey || !seckey) {
+		free(pubkey);
+		free(seckey);
+		return (struct reop_keypair) { NULL, NULL };
+	}
 	memset(pubkey, 0, sizeof(*pubkey));
-
-	struct reop_seckey *seckey = xmalloc(sizeof(*seckey));
 	memset(seckey, 0, sizeof(*seckey));
 
 	strlcpy(pubkey->ident, ident, sizeof(pubkey->ident));
@@ -739,14 +1826,36 @@ reop_generate(const char *ident)
 /*
  * parse pubkey data into struct
  */
+int
+reop_parsepubkey_into(struct reop_ctx *ctx, const char *pubkeydata,
+    struct reop_pubkey *pubkey)
+{
+	return parsekeydata(ctx, pubkeydata, "PUBLIC KEY", pubkey, pubkeysize,
+	    pubkey->ident);
+}
+
 const struct reop_pubkey *
-reop_parsepubkey(const char *pubkeydata)
+reop_ctx_parsepubkey(struct reop_ctx *ctx, const char *pubkeydata)
 {
-	struct reop_pubkey *pubkey = xmalloc(sizeof(*pubkey));
-	parsekeydata(pubkeydata, "PUBLIC KEY", pubkey, pubkeysize, pubkey->ident);
+	struct reop_pubkey *pubkey = malloc(sizeof(*pubkey));
+	if (!pubkey) {
+		ctxerr(ctx, "out of memory");
+		return NULL;
+	}
+	if (reop_parsepubkey_into(ctx, pubkeydata, pubkey) != 0) {
+		free(pubkey);
+		return NULL;
+	}
 	return pubkey;
 }
 
+const struct reop_pubkey *
+reop_parsepubkey(const char *pubkeydata)
+{
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_parsepubkey(&ctx, pubkeydata);
+}
+
 /*
  * encode a pubkey to a string
  */
@@ -756,17 +1865,77 @@ reop_encodepubkey(const struct reop_pubkey *pubkey)
 	return encodekey("PUBLIC KEY", pubkey, pubkeysize, pubkey->ident);
 }
 
+size_t
+reop_encodedpubkeylen(const struct reop_pubkey *pubkey)
+{
+	return encodedkeylen("PUBLIC KEY", pubkeysize, pubkey->ident);
+}
+
+int
+reop_encodepubkey_into(const struct reop_pubkey *pubkey, char *buf, size_t buflen)
+{
+	return encodekeyinto("PUBLIC KEY", pubkey, pubkeysize, pubkey->ident,
+	    buf, buflen);
+}
+
+size_t
+reop_pubkeybinlen(const struct reop_pubkey *pubkey)
+{
+	return binkeylen(pubkeysize, pubkey->ident);
+}
+
+int
+reop_encodepubkey_bin(const struct reop_pubkey *pubkey, uint8_t *buf, size_t buflen)
+{
+	return encodebin(pubkey, pubkeysize, pubkey->ident, buf, buflen);
+}
+
+int
+reop_parsepubkey_bin(struct reop_ctx *ctx, const uint8_t *data, uint64_t datalen,
+    struct reop_pubkey *pubkey)
+{
+	return parsebin(ctx, data, datalen, pubkey, pubkeysize, pubkey->ident);
+}
+
 /*
  * parse seckey data into struct
  */
+const struct reop_seckey *
+reop_ctx_parseseckey(struct reop_ctx *ctx, const char *seckeydata, const char *password)
+{
+	struct reop_seckey *seckey = malloc(sizeof(*seckey));
+	if (!seckey) {
+		ctxerr(ctx, "out of memory");
+		return NULL;
+	}
+	seckey->agent = 0;
+	if (parsekeydata(ctx, seckeydata, "SECRET KEY", seckey, seckeysize,
+	    seckey->ident) != 0 || decryptseckey(ctx, seckey, password) != 0) {
+		xfree(seckey, sizeof(*seckey));
+		return NULL;
+	}
+	return seckey;
+}
+
 const struct reop_seckey *
 reop_parseseckey(const char *seckeydata, const char *password)
 {
-	struct reop_seckey *seckey = xmalloc(sizeof(*seckey));
-	parsekeydata(seckeydata, "SECRET KEY", seckey, seckeysize, seckey->ident);
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_parseseckey(&ctx, seckeydata, password);
+}
 
-	int rv = decryptseckey(seckey, password);
-	if (rv != 0) {
+const struct reop_seckey *
+reop_ctx_parseseckey_bin(struct reop_ctx *ctx, const uint8_t *data, uint64_t datalen,
+    const char *password)
+{
+	struct reop_seckey *seckey = malloc(sizeof(*seckey));
+	if (!seckey) {
+		ctxerr(ctx, "out of memory");
+		return NULL;
+	}
+	seckey->agent = 0;
+	if (parsebin(ctx, data, datalen, seckey, seckeysize, seckey->ident) != 0 ||
+	    decryptseckey(ctx, seckey, password) != 0) {
 		xfree(seckey, sizeof(*seckey));
 		return NULL;
 	}
@@ -776,12 +1945,52 @@ reop_parseseckey(const char *seckeydata, const char *password)
 /*
  * encode a seckey to a string
  */
+const char *
+reop_ctx_encodeseckey(struct reop_ctx *ctx, const struct reop_seckey *seckey,
+    const char *password, uint32_t rounds)
+{
+	if (seckey->agent) {
+		ctxerr(ctx, "can't export an agent key");
+		return NULL;
+	}
+	struct reop_seckey copy = *seckey;
+	const char *rv = NULL;
+	if (encryptseckey(ctx, &copy, password, rounds) == 0 &&
+	    !(rv = encodekey("SECRET KEY", &copy, seckeysize, seckey->ident)))
+		ctxerr(ctx, "out of memory");
+	sodium_memzero(&copy, sizeof(copy));
+	return rv;
+}
+
 const char *
 reop_encodeseckey(const struct reop_seckey *seckey, const char *password)
 {
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_encodeseckey(&ctx, seckey, password, 0);
+}
+
+size_t
+reop_seckeybinlen(const struct reop_seckey *seckey)
+{
+	return binkeylen(seckeysize, seckey->ident);
+}
+
+int
+reop_ctx_encodeseckey_bin(struct reop_ctx *ctx, const struct reop_seckey *seckey,
+    const char *password, uint32_t rounds, uint8_t *buf, size_t buflen)
+{
+	if (seckey->agent) {
+		ctxerr(ctx, "can't export an agent key");
+		return -1;
+	}
+	if (buflen < binkeylen(seckeysize, seckey->ident)) {
+		ctxerr(ctx, "buffer too small");
+		return -1;
+	}
 	struct reop_seckey copy = *seckey;
-	encryptseckey(&copy, password);
-	const char *rv = encodekey("SECRET KEY", &copy, seckeysize, seckey->ident);
+	int rv = encryptseckey(ctx, &copy, password, rounds);
+	if (rv == 0)
+		rv = encodebin(&copy, seckeysize, seckey->ident, buf, buflen);
 	sodium_memzero(&copy, sizeof(copy));
 	return rv;
 }
@@ -789,17 +1998,31 @@ reop_encodeseckey(const struct reop_seckey *seckey, const char *password)
 /*
  * basic sign function
  */
-const struct reop_sig *
-reop_sign(const struct reop_seckey *seckey, const uint8_t *msg, uint64_t msglen)
+int
+reop_sign_into(const struct reop_seckey *seckey, const uint8_t *msg, uint64_t msglen,
+    struct reop_sig *sig)
 {
-	struct reop_sig *sig = xmalloc(sizeof(*sig));
-
-	signraw(seckey->sigkey, msg, msglen, sig->sig);
+	if (seckeysign(seckey, msg, msglen, sig->sig) != 0)
+		return -1;
 
 	memcpy(sig->randomid, seckey->randomid, RANDOMIDLEN);
 	memcpy(sig->sigalg, SIGALG, 2);
 	strlcpy(sig->ident, seckey->ident, sizeof(sig->ident));
 
+	return 0;
+}
+
+const struct reop_sig *
+reop_sign(const struct reop_seckey *seckey, const uint8_t *msg, uint64_t msglen)
+{
+	struct reop_sig *sig = malloc(sizeof(*sig));
+	if (!sig)
+		return NULL;
+
+	if (reop_sign_into(seckey, msg, msglen, sig) != 0) {
+		free(sig);
+		return NULL;
+	}
 	return sig;
 }
 
@@ -815,14 +2038,34 @@ reop_freesig(const struct reop_sig *sig)
 /*
  * parse signature data into struct
  */
+int
+reop_parsesig_into(struct reop_ctx *ctx, const char *sigdata, struct reop_sig *sig)
+{
+	return parsekeydata(ctx, sigdata, "SIGNATURE", sig, sigsize, sig->ident);
+}
+
 const struct reop_sig *
-reop_parsesig(const char *sigdata)
+reop_ctx_parsesig(struct reop_ctx *ctx, const char *sigdata)
 {
-	struct reop_sig *sig = xmalloc(sizeof(*sig));
-	parsekeydata(sigdata, "SIGNATURE", sig, sigsize, sig->ident);
+	struct reop_sig *sig = malloc(sizeof(*sig));
+	if (!sig) {
+		ctxerr(ctx, "out of memory");
+		return NULL;
+	}
+	if (reop_parsesig_into(ctx, sigdata, sig) != 0) {
+		free(sig);
+		return NULL;
+	}
 	return sig;
 }
 
+const struct reop_sig *
+reop_parsesig(const char *sigdata)
+{
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_parsesig(&ctx, sigdata);
+}
+
 /*
  * encode a signature to a string
  */
@@ -832,568 +2075,3088 @@ reop_encodesig(const struct reop_sig *sig)
 	return encodekey("SIGNATURE", sig, sigsize, sig->ident);
 }
 
-/*
- * basic verify function
- */
-reop_verify_result
-reop_verify(const struct reop_pubkey *pubkey, const uint8_t *msg, uint64_t msglen,
-    const struct reop_sig *sig)
+size_t
+reop_encodedsiglen(const struct reop_sig *sig)
 {
-	if (memcmp(pubkey->randomid, sig->randomid, RANDOMIDLEN) != 0)
-		return (reop_verify_result) { REOP_V_MISMATCH };
+	return encodedkeylen("SIGNATURE", sigsize, sig->ident);
+}
 
-	if (verifyraw(pubkey->sigkey, msg, msglen, sig->sig) == -1)
-		return (reop_verify_result) { REOP_V_FAIL };
+int
+reop_encodesig_into(const struct reop_sig *sig, char *buf, size_t buflen)
+{
+	return encodekeyinto("SIGNATURE", sig, sigsize, sig->ident, buf, buflen);
+}
 
-	return (reop_verify_result) { REOP_V_OK };
+size_t
+reop_sigbinlen(const struct reop_sig *sig)
+{
+	return binkeylen(sigsize, sig->ident);
 }
 
-/*
- * encrypt a file using public key cryptography
- * an ephemeral key is used to make the encryption one way
- * that key is then encrypted with our seckey to provide authentication
- */
-const struct reop_encmsg *
-reop_pubencrypt(const struct reop_pubkey *pubkey, const struct reop_seckey *seckey,
-    uint8_t *msg, uint64_t msglen)
+int
+reop_encodesig_bin(const struct reop_sig *sig, uint8_t *buf, size_t buflen)
 {
-	struct reop_encmsg *encmsg = malloc(sizeof(*encmsg));
-	if (!encmsg)
-		return NULL;
+	return encodebin(sig, sigsize, sig->ident, buf, buflen);
+}
 
-	memcpy(encmsg->encalg, ENCALG, 2);
-	memcpy(encmsg->pubrandomid, pubkey->randomid, RANDOMIDLEN);
-	memcpy(encmsg->secrandomid, seckey->randomid, RANDOMIDLEN);
+int
+reop_parsesig_bin(struct reop_ctx *ctx, const uint8_t *data, uint64_t datalen,
+    struct reop_sig *sig)
+{
+	return parsebin(ctx, data, datalen, sig, sigsize, sig->ident);
+}
 
-	uint8_t ephseckey[ENCSECRETBYTES];
-	crypto_box_keypair(encmsg->ephpubkey, ephseckey);
-	strlcpy(encmsg->ident, seckey->ident, sizeof(encmsg->ident));
+/*
+ * streaming signatures, for messages of any size. the message is hashed
+ * as it goes, and the hash signed with Ed25519ph, so only the hash state
+ * is kept. the same state serves for signing or verifying.
+ * the hash starts with a prefix, so no stream signature is also a valid
+ * tree signature, which is Ed25519ph with a different prefix.
+ */
+struct reop_sigstream {
+	crypto_sign_state state;
+};
 
-	pubencryptraw(msg, msglen, encmsg->nonce, encmsg->tag, pubkey->enckey, ephseckey);
-	pubencryptraw(encmsg->ephpubkey, sizeof(encmsg->ephpubkey), encmsg->ephnonce,
-	    encmsg->ephtag, pubkey->enckey, seckey->enckey);
+static const char streamsigprefix[8] = "REOPSTRM";
 
-	sodium_memzero(&ephseckey, sizeof(ephseckey));
+static void
+sigstreamstart(crypto_sign_state *state)
+{
+	crypto_sign_init(state);
+	crypto_sign_update(state, (const uint8_t *)streamsigprefix,
+	    sizeof(streamsigprefix));
+}
 
-	return encmsg;
+struct reop_sigstream *
+reop_sigstream_init(void)
+{
+	struct reop_sigstream *ss = malloc(sizeof(*ss));
+	if (!ss)
+		return NULL;
+	sigstreamstart(&ss->state);
+	return ss;
 }
 
-reop_decrypt_result
-reop_pubdecrypt(const struct reop_encmsg *encmsg, const struct reop_pubkey *pubkey,
-    const struct reop_seckey *seckey, uint8_t *msg, uint64_t msglen)
+void
+reop_sigstream_update(struct reop_sigstream *ss, const uint8_t *msg, uint64_t msglen)
 {
-	if (memcmp(encmsg->pubrandomid, seckey->randomid, RANDOMIDLEN) != 0 ||
-	    memcmp(encmsg->secrandomid, pubkey->randomid, RANDOMIDLEN) != 0)
-		return (reop_decrypt_result) { REOP_D_MISMATCH };
+	uint64_t t = tracestart();
+	crypto_sign_update(&ss->state, msg, msglen);
+	traceend("sha512", t, msglen);
+}
 
-	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
-		return (reop_decrypt_result) { REOP_D_INVALID };
-	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
-		return (reop_decrypt_result) { REOP_D_INVALID };
+int
+reop_sigstream_sign_into(struct reop_sigstream *ss, const struct reop_seckey *seckey,
+    struct reop_sig *sig)
+{
+	if (seckeysignph(seckey, &ss->state, sig->sig) != 0)
+		return -1;
 
-	uint8_t ephpubkey[ENCPUBLICBYTES];
-	memcpy(ephpubkey, encmsg->ephpubkey, sizeof(encmsg->ephpubkey));
-	int rv = pubdecryptraw(ephpubkey, sizeof(ephpubkey),
-	    encmsg->ephnonce, encmsg->ephtag, pubkey->enckey, seckey->enckey);
-	if (rv != 0)
-		return (reop_decrypt_result) { REOP_D_FAIL };
+	memcpy(sig->randomid, seckey->randomid, RANDOMIDLEN);
+	memcpy(sig->sigalg, SIGPHALG, 2);
+	strlcpy(sig->ident, seckey->ident, sizeof(sig->ident));
 
-	rv = pubdecryptraw(msg, msglen, encmsg->nonce, encmsg->tag,
-	    ephpubkey, seckey->enckey);
-	if (rv != 0)
-		return (reop_decrypt_result) { REOP_D_FAIL };
+	return 0;
+}
 
-	sodium_memzero(ephpubkey, sizeof(ephpubkey));
+const struct reop_sig *
+reop_sigstream_sign(struct reop_sigstream *ss, const struct reop_seckey *seckey)
+{
+	struct reop_sig *sig = malloc(sizeof(*sig));
+	if (!sig)
+		return NULL;
 
-	return (reop_decrypt_result) { 0 };
+	if (reop_sigstream_sign_into(ss, seckey, sig) != 0) {
+		free(sig);
+		return NULL;
+	}
+	return sig;
 }
 
-reop_decrypt_result
-reop_symdecrypt(const struct reop_symmsg *symmsg, const char *password, uint8_t *msg,
-    uint64_t msglen)
+reop_verify_result
+reop_sigstream_verify(struct reop_sigstream *ss, const struct reop_pubkey *pubkey,
+    const struct reop_sig *sig)
 {
-	if (memcmp(symmsg->kdfalg, KDFALG, 2) != 0)
-		return (reop_decrypt_result) { REOP_D_INVALID };
-
-	kdf_confirm confirm = { 0 };
-	int rounds = ntohl(symmsg->kdfrounds);
-	uint8_t symkey[SYMKEYBYTES];
-	kdf(symmsg->salt, sizeof(symmsg->salt), rounds, NULL,
-	    confirm, symkey, sizeof(symkey));
+	if (memcmp(pubkey->randomid, sig->randomid, RANDOMIDLEN) != 0)
+		return (reop_verify_result) { REOP_V_MISMATCH };
+	if (memcmp(sig->sigalg, SIGPHALG, 2) != 0)
+		return (reop_verify_result) { REOP_V_FAIL };
 
-	int rv = symdecryptraw(msg, msglen, symmsg->nonce, symmsg->tag, symkey);
+	uint64_t t = tracestart();
+	int rv = crypto_sign_final_verify(&ss->state, sig->sig, pubkey->sigkey);
+	traceend("verify", t, 0);
 	if (rv != 0)
-		return (reop_decrypt_result) { REOP_D_FAIL };
-
-	sodium_memzero(symkey, sizeof(symkey));
+		return (reop_verify_result) { REOP_V_FAIL };
 
-	return (reop_decrypt_result) { 0 };
+	return (reop_verify_result) { REOP_V_OK };
 }
 
 void
-reop_freeencmsg(const struct reop_encmsg *encmsg)
+reop_freesigstream(struct reop_sigstream *ss)
 {
-	xfree((void *)encmsg, sizeof(*encmsg));
+	xfree(ss, sizeof(*ss));
 }
 
 /*
- * encrypt a message using symmetric cryptography (a password)
+ * hash tree signatures. the message is split into blocks, each block is
+ * hashed into a leaf, and pairs of nodes are hashed into the level above,
+ * an odd node at the end going up as is. the root and message length are
+ * signed with Ed25519ph, which never verifies as a plain Ed25519 sig.
+ * the leaves can be hashed in parallel, and one block can be checked
+ * with the siblings on its way to the root, its path.
+ * a tree is stored as an array of nodes, the leaves first, the root last.
  */
-const struct reop_symmsg *
-reop_symencrypt(uint8_t *msg, uint64_t msglen, const char *password)
-{
-	struct reop_symmsg *symmsg = malloc(sizeof(*symmsg));
-	if (!symmsg)
-		return NULL;
-
-	int rounds = 42;
-
-	memcpy(symmsg->symalg, SYMALG, 2);
-	memcpy(symmsg->kdfalg, KDFALG, 2);
-	symmsg->kdfrounds = htonl(rounds);
-	randombytes(symmsg->salt, sizeof(symmsg->salt));
-
-	uint8_t symkey[SYMKEYBYTES];
-	kdf_confirm confirm = { 1 };
-	kdf(symmsg->salt, sizeof(symmsg->salt), rounds, password,
-	    confirm, symkey, sizeof(symkey));
+static const char treesigprefix[8] = "REOPTREE";
 
-	symencryptraw(msg, msglen, symmsg->nonce, symmsg->tag, symkey);
+static uint64_t
+treeleaves(uint64_t msglen)
+{
+	uint64_t nleaves = msglen / REOP_TREEBLOCK + (msglen % REOP_TREEBLOCK != 0);
+	return nleaves ? nleaves : 1;
+}
 
-	sodium_memzero(symkey, sizeof(symkey));
+uint64_t
+reop_tree_nodes(uint64_t msglen)
+{
+	uint64_t n = treeleaves(msglen);
+	uint64_t nodes = n;
 
-	return symmsg;
+	while (n > 1) {
+		n = (n + 1) / 2;
+		nodes += n;
+	}
+	return nodes;
 }
 
 void
-reop_freesymmsg(const struct reop_symmsg *symmsg)
+reop_tree_leaf(const uint8_t *block, uint64_t blocklen, uint8_t *hash)
 {
-	xfree((void *)symmsg, sizeof(*symmsg));
+	crypto_generichash_state state;
+	uint8_t prefix = 0;
+
+	crypto_generichash_init(&state, NULL, 0, REOP_TREEHASHBYTES);
+	crypto_generichash_update(&state, &prefix, 1);
+	crypto_generichash_update(&state, block, blocklen);
+	crypto_generichash_final(&state, hash, REOP_TREEHASHBYTES);
 }
 
+static void
+treenode(const uint8_t *left, const uint8_t *right, uint8_t *hash)
+{
+	uint8_t buf[1 + 2 * REOP_TREEHASHBYTES];
+
+	buf[0] = 1;
+	memcpy(buf + 1, left, REOP_TREEHASHBYTES);
+	memcpy(buf + 1 + REOP_TREEHASHBYTES, right, REOP_TREEHASHBYTES);
+	crypto_generichash(hash, REOP_TREEHASHBYTES, buf, sizeof(buf), NULL, 0);
+}
+
+/*
+ * fill in the levels above the leaves
+ */
 void
-reop_init(void)
+reop_tree_build(uint8_t *tree, uint64_t msglen)
+{
+	uint64_t n = treeleaves(msglen);
+	uint8_t *level = tree;
+
+	while (n > 1) {
+		uint8_t *up = level + n * REOP_TREEHASHBYTES;
+		for (uint64_t i = 0; i < n / 2; i++)
+			treenode(level + 2 * i * REOP_TREEHASHBYTES,
+			    level + (2 * i + 1) * REOP_TREEHASHBYTES,
+			    up + i * REOP_TREEHASHBYTES);
+		if (n % 2)
+			memcpy(up + n / 2 * REOP_TREEHASHBYTES,
+			    level + (n - 1) * REOP_TREEHASHBYTES, REOP_TREEHASHBYTES);
+		level = up;
+		n = (n + 1) / 2;
+	}
+}
+
+struct treebatch {
+	const uint8_t *msg;
+	uint64_t msglen;
+	uint8_t *tree;
+	uint64_t nleaves;
+	uint64_t next;
+	pthread_mutex_t lock;
+};
+
+enum { TREEGROUP = 16 };
+
+static void *
+treeworker(void *arg)
+{
+	struct treebatch *tb = arg;
+
+	while (1) {
+		pthread_mutex_lock(&tb->lock);
+		uint64_t i = tb->next;
+		uint64_t end = tb->nleaves - i > TREEGROUP ? i + TREEGROUP : tb->nleaves;
+		tb->next = end;
+		pthread_mutex_unlock(&tb->lock);
+		if (i == end)
+			break;
+		for (; i < end; i++) {
+			uint64_t off = i * REOP_TREEBLOCK;
+			uint64_t len = tb->msglen - off > REOP_TREEBLOCK ?
+			    REOP_TREEBLOCK : tb->msglen - off;
+			reop_tree_leaf(tb->msg + off, len,
+			    tb->tree + i * REOP_TREEHASHBYTES);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * hash a message in memory into a tree of reop_tree_nodes() nodes,
+ * the leaves on one thread per cpu
+ */
+void
+reop_tree_hash(const uint8_t *msg, uint64_t msglen, uint8_t *tree)
+{
+	struct treebatch tb;
+
+	tb.msg = msg;
+	tb.msglen = msglen;
+	tb.tree = tree;
+	tb.nleaves = treeleaves(msglen);
+	tb.next = 0;
+	pthread_mutex_init(&tb.lock, NULL);
+	uint64_t t = tracestart();
+	runworkers(treeworker, &tb, (tb.nleaves + TREEGROUP - 1) / TREEGROUP);
+	traceend("treehash", t, msglen);
+	pthread_mutex_destroy(&tb.lock);
+
+	reop_tree_build(tree, msglen);
+}
+
+/*
+ * the path from a block's leaf to the root. path must hold 64 hashes.
+ * returns the number of hashes.
+ */
+uint64_t
+reop_tree_path(const uint8_t *tree, uint64_t msglen, uint64_t block, uint8_t *path)
+{
+	uint64_t n = treeleaves(msglen);
+	uint64_t pathlen = 0;
+
+	while (n > 1) {
+		if ((block ^ 1) < n)
+			memcpy(path + pathlen++ * REOP_TREEHASHBYTES,
+			    tree + (block ^ 1) * REOP_TREEHASHBYTES, REOP_TREEHASHBYTES);
+		tree += n * REOP_TREEHASHBYTES;
+		block /= 2;
+		n = (n + 1) / 2;
+	}
+	return pathlen;
+}
+
+/*
+ * compute the root from a leaf and its path
+ */
+int
+reop_tree_pathroot(const uint8_t *leaf, uint64_t block, uint64_t msglen,
+    const uint8_t *path, uint64_t pathlen, uint8_t *root)
+{
+	uint64_t n = treeleaves(msglen);
+	uint8_t hash[REOP_TREEHASHBYTES];
+
+	if (block >= n)
+		return -1;
+	memcpy(hash, leaf, sizeof(hash));
+	while (n > 1) {
+		if ((block ^ 1) < n) {
+			if (pathlen-- == 0)
+				return -1;
+			if (block & 1)
+				treenode(path, hash, hash);
+			else
+				treenode(hash, path, hash);
+			path += REOP_TREEHASHBYTES;
+		}
+		block /= 2;
+		n = (n + 1) / 2;
+	}
+	if (pathlen != 0)
+		return -1;
+	memcpy(root, hash, sizeof(hash));
+	return 0;
+}
+
+static void
+treesigmsg(const uint8_t *root, uint64_t msglen, uint8_t *buf)
+{
+	memcpy(buf, treesigprefix, sizeof(treesigprefix));
+	for (int i = 0; i < 8; i++)
+		buf[8 + i] = msglen >> (56 - 8 * i);
+	memcpy(buf + 16, root, REOP_TREEHASHBYTES);
+}
+
+int
+reop_tree_sign_into(const struct reop_seckey *seckey, const uint8_t *root,
+    uint64_t msglen, struct reop_sig *sig)
+{
+	uint8_t buf[16 + REOP_TREEHASHBYTES];
+	crypto_sign_state state;
+
+	treesigmsg(root, msglen, buf);
+	crypto_sign_init(&state);
+	crypto_sign_update(&state, buf, sizeof(buf));
+	if (seckeysignph(seckey, &state, sig->sig) != 0)
+		return -1;
+
+	memcpy(sig->randomid, seckey->randomid, RANDOMIDLEN);
+	memcpy(sig->sigalg, SIGTREEALG, 2);
+	strlcpy(sig->ident, seckey->ident, sizeof(sig->ident));
+
+	return 0;
+}
+
+const struct reop_sig *
+reop_tree_sign(const struct reop_seckey *seckey, const uint8_t *root, uint64_t msglen)
+{
+	struct reop_sig *sig = malloc(sizeof(*sig));
+	if (!sig)
+		return NULL;
+
+	if (reop_tree_sign_into(seckey, root, msglen, sig) != 0) {
+		free(sig);
+		return NULL;
+	}
+	return sig;
+}
+
+reop_verify_result
+reop_tree_verify(const struct reop_pubkey *pubkey, const uint8_t *root,
+    uint64_t msglen, const struct reop_sig *sig)
+{
+	uint8_t buf[16 + REOP_TREEHASHBYTES];
+	crypto_sign_state state;
+
+	if (memcmp(pubkey->randomid, sig->randomid, RANDOMIDLEN) != 0)
+		return (reop_verify_result) { REOP_V_MISMATCH };
+	if (memcmp(sig->sigalg, SIGTREEALG, 2) != 0)
+		return (reop_verify_result) { REOP_V_FAIL };
+
+	treesigmsg(root, msglen, buf);
+	crypto_sign_init(&state);
+	crypto_sign_update(&state, buf, sizeof(buf));
+	uint64_t t = tracestart();
+	int rv = crypto_sign_final_verify(&state, sig->sig, pubkey->sigkey);
+	traceend("verify", t, 0);
+	if (rv != 0)
+		return (reop_verify_result) { REOP_V_FAIL };
+
+	return (reop_verify_result) { REOP_V_OK };
+}
+
+/*
+ * basic verify function
+ */
+reop_verify_result
+reop_verify(const struct reop_pubkey *pubkey, const uint8_t *msg, uint64_t msglen,
+    const struct reop_sig *sig)
+{
+	if (memcmp(pubkey->randomid, sig->randomid, RANDOMIDLEN) != 0)
+		return (reop_verify_result) { REOP_V_MISMATCH };
+
+	if (memcmp(sig->sigalg, SIGPHALG, 2) == 0) {
+		struct reop_sigstream ss;
+		sigstreamstart(&ss.state);
+		reop_sigstream_update(&ss, msg, msglen);
+		return reop_sigstream_verify(&ss, pubkey, sig);
+	}
+	if (memcmp(sig->sigalg, SIGTREEALG, 2) == 0) {
+		uint64_t nodes = reop_tree_nodes(msglen);
+		uint8_t *tree = malloc(nodes * REOP_TREEHASHBYTES);
+		if (!tree)
+			return (reop_verify_result) { REOP_V_FAIL };
+		reop_tree_hash(msg, msglen, tree);
+		reop_verify_result rv = reop_tree_verify(pubkey,
+		    tree + (nodes - 1) * REOP_TREEHASHBYTES, msglen, sig);
+		free(tree);
+		return rv;
+	}
+	if (memcmp(sig->sigalg, SIGALG, 2) != 0)
+		return (reop_verify_result) { REOP_V_FAIL };
+
+	if (verifyraw(pubkey->sigkey, msg, msglen, sig->sig) == -1)
+		return (reop_verify_result) { REOP_V_FAIL };
+
+	return (reop_verify_result) { REOP_V_OK };
+}
+
+/*
+ * batch verification. the pubkeys are indexed by randomid, or if none are
+ * given the user's pubkeyring is used, and each signature is checked with
+ * the key that made it. a sig without a key is a mismatch. the work is
+ * handed out to one thread per cpu in small blocks.
+ */
+struct verifybatch {
+	struct ringindex keys;
+	const uint8_t *const *msgs;
+	const uint64_t *msglens;
+	const struct reop_sig *const *sigs;
+	reop_verify_result *results;
+	size_t count;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+enum { VERIFYBLOCK = 16 };
+
+static void *
+verifyworker(void *arg)
+{
+	struct verifybatch *vb = arg;
+
+	while (1) {
+		pthread_mutex_lock(&vb->lock);
+		size_t i = vb->next;
+		size_t end = vb->count - i > VERIFYBLOCK ? i + VERIFYBLOCK : vb->count;
+		vb->next = end;
+		pthread_mutex_unlock(&vb->lock);
+		if (i == end)
+			break;
+		for (; i < end; i++) {
+			const struct reop_sig *sig = vb->sigs[i];
+			const struct reop_pubkey *pubkey = ringlookup(&vb->keys,
+			    NULL, sig->randomid);
+			if (!pubkey)
+				vb->results[i].v = REOP_V_MISMATCH;
+			else
+				vb->results[i] = reop_verify(pubkey, vb->msgs[i],
+				    vb->msglens[i], sig);
+		}
+	}
+	return NULL;
+}
+
+int
+reop_verify_batch(const struct reop_pubkey *const *pubkeys, uint64_t npubkeys,
+    const uint8_t *const *msgs, const uint64_t *msglens,
+    const struct reop_sig *const *sigs, uint64_t count,
+    reop_verify_result *results)
+{
+	struct verifybatch vb;
+	int rv;
+
+	if (npubkeys) {
+		if (npubkeys > SIZE_MAX / sizeof(struct reop_pubkey))
+			return -1;
+		struct reop_pubkey *keys = malloc(npubkeys * sizeof(*keys));
+		if (!keys)
+			return -1;
+		for (uint64_t i = 0; i < npubkeys; i++)
+			keys[i] = *pubkeys[i];
+		rv = fillringindex(keys, npubkeys, &vb.keys);
+		free(keys);
+	} else {
+		rv = loadringindex(&vb.keys);
+	}
+	if (rv != 0)
+		return -1;
+
+	vb.msgs = msgs;
+	vb.msglens = msglens;
+	vb.sigs = sigs;
+	vb.results = results;
+	vb.count = count;
+	vb.next = 0;
+	pthread_mutex_init(&vb.lock, NULL);
+
+	runworkers(verifyworker, &vb, (count + VERIFYBLOCK - 1) / VERIFYBLOCK);
+
+	pthread_mutex_destroy(&vb.lock);
+	freeringindex(&vb.keys);
+	return 0;
+}
+
+/*
+ * encrypt a file using public key cryptography
+ * an ephemeral key is used to make the encryption one way
+ * that key is then encrypted with our seckey to provide authentication
+ */
+int
+reop_pubencrypt_into(const struct reop_pubkey *pubkey, const struct reop_seckey *seckey,
+    uint8_t *msg, uint64_t msglen, struct reop_encmsg *encmsg)
+{
+	memcpy(encmsg->encalg, ENCALG, 2);
+	memcpy(encmsg->pubrandomid, pubkey->randomid, RANDOMIDLEN);
+	memcpy(encmsg->secrandomid, seckey->randomid, RANDOMIDLEN);
+
+	uint8_t ephseckey[ENCSECRETBYTES];
+	crypto_box_keypair(encmsg->ephpubkey, ephseckey);
+	strlcpy(encmsg->ident, seckey->ident, sizeof(encmsg->ident));
+
+	pubencryptraw(msg, msglen, encmsg->nonce, encmsg->tag, pubkey->enckey, ephseckey);
+	sodium_memzero(&ephseckey, sizeof(ephseckey));
+	return seckeybox(seckey, pubkey->enckey, encmsg->ephpubkey,
+	    sizeof(encmsg->ephpubkey), encmsg->ephnonce, encmsg->ephtag);
+}
+
+const struct reop_encmsg *
+reop_pubencrypt(const struct reop_pubkey *pubkey, const struct reop_seckey *seckey,
+    uint8_t *msg, uint64_t msglen)
+{
+	struct reop_encmsg *encmsg = malloc(sizeof(*encmsg));
+	if (!encmsg)
+		return NULL;
+
+	if (reop_pubencrypt_into(pubkey, seckey, msg, msglen, encmsg) != 0) {
+		xfree(encmsg, sizeof(*encmsg));
+		return NULL;
+	}
+	return encmsg;
+}
+
+reop_decrypt_result
+reop_pubdecrypt(const struct reop_encmsg *encmsg, const struct reop_pubkey *pubkey,
+    const struct reop_seckey *seckey, uint8_t *msg, uint64_t msglen)
+{
+	if (memcmp(encmsg->pubrandomid, seckey->randomid, RANDOMIDLEN) != 0 ||
+	    memcmp(encmsg->secrandomid, pubkey->randomid, RANDOMIDLEN) != 0)
+		return (reop_decrypt_result) { REOP_D_MISMATCH };
+
+	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+
+	uint8_t ephpubkey[ENCPUBLICBYTES];
+	memcpy(ephpubkey, encmsg->ephpubkey, sizeof(encmsg->ephpubkey));
+	int rv = seckeyboxopen(seckey, pubkey->enckey, ephpubkey, sizeof(ephpubkey),
+	    encmsg->ephnonce, encmsg->ephtag);
+	if (rv != 0)
+		return (reop_decrypt_result) { REOP_D_FAIL };
+
+	rv = seckeyboxopen(seckey, ephpubkey, msg, msglen, encmsg->nonce, encmsg->tag);
+	if (rv != 0)
+		return (reop_decrypt_result) { REOP_D_FAIL };
+
+	sodium_memzero(ephpubkey, sizeof(ephpubkey));
+
+	return (reop_decrypt_result) { 0 };
+}
+
+reop_decrypt_result
+reop_ctx_symdecrypt(struct reop_ctx *ctx, const struct reop_symmsg *symmsg,
+    const char *password, uint8_t *msg, uint64_t msglen)
+{
+	if (!kdfknown(symmsg->kdfalg)) {
+		ctxerr(ctx, "unsupported key format");
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	}
+
+	kdf_confirm confirm = { 0 };
+	uint32_t rounds = ntohl(symmsg->kdfrounds);
+	uint8_t symkey[SYMKEYBYTES];
+	if (kdf(ctx, symmsg->kdfalg, rounds, symmsg->salt, sizeof(symmsg->salt),
+	    password, confirm, symkey, sizeof(symkey)) != 0)
+		return (reop_decrypt_result) { REOP_D_FAIL };
+
+	int rv = symdecryptraw(msg, msglen, symmsg->nonce, symmsg->tag, symkey);
+	sodium_memzero(symkey, sizeof(symkey));
+	if (rv != 0) {
+		ctxerr(ctx, "sym decryption failed");
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	}
+
+	return (reop_decrypt_result) { 0 };
+}
+
+reop_decrypt_result
+reop_symdecrypt(const struct reop_symmsg *symmsg, const char *password, uint8_t *msg,
+    uint64_t msglen)
+{
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_symdecrypt(&ctx, symmsg, password, msg, msglen);
+}
+
+/*
+ * batch symmetric decryption. the bcrypt keys for a block of messages are
+ * derived together by the multi lane kdf, and blocks go out to one thread
+ * per cpu. argon2id keys are derived one at a time. the ctx callback is
+ * asked once, before any threads start, for the password of every message
+ * given a NULL one.
+ */
+struct symdecryptbatch {
+	const struct reop_symmsg *const *symmsgs;
+	const char *const *passwords;
+	const char *defpassword;
+	uint8_t *const *msgs;
+	const uint64_t *msglens;
+	reop_decrypt_result *results;
+	size_t count;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+enum { SYMDECRYPTBLOCK = 24 };
+
+static void *
+symdecryptworker(void *arg)
+{
+	struct symdecryptbatch *sb = arg;
+	struct bcrypt_job jobs[SYMDECRYPTBLOCK];
+	size_t jobidx[SYMDECRYPTBLOCK];
+	uint8_t keys[SYMDECRYPTBLOCK][SYMKEYBYTES];
+
+	while (1) {
+		pthread_mutex_lock(&sb->lock);
+		size_t i = sb->next;
+		size_t end = sb->count - i > SYMDECRYPTBLOCK ? i + SYMDECRYPTBLOCK : sb->count;
+		sb->next = end;
+		pthread_mutex_unlock(&sb->lock);
+		if (i == end)
+			break;
+
+		size_t njobs = 0;
+		for (size_t n = i; n < end; n++) {
+			const struct reop_symmsg *symmsg = sb->symmsgs[n];
+			const char *password = sb->passwords[n] ? sb->passwords[n] :
+			    sb->defpassword;
+			uint32_t rounds = ntohl(symmsg->kdfrounds);
+			uint8_t *key = keys[n - i];
+
+			sb->results[n].v = REOP_D_OK;
+			if (!kdfknown(symmsg->kdfalg)) {
+				sb->results[n].v = REOP_D_INVALID;
+			} else if (rounds == 0) {
+				memset(key, 0, SYMKEYBYTES);
+			} else if (!password) {
+				sb->results[n].v = REOP_D_FAIL;
+			} else if (memcmp(symmsg->kdfalg, ARGONKDFALG, 2) == 0) {
+				if (crypto_pwhash(key, SYMKEYBYTES, password,
+				    strlen(password), symmsg->salt, rounds >> 24,
+				    (size_t)(rounds & 0xffffff) * 1024,
+				    crypto_pwhash_ALG_ARGON2ID13) == -1)
+					sb->results[n].v = REOP_D_FAIL;
+			} else {
+				struct bcrypt_job *job = &jobs[njobs];
+				job->pass = password;
+				job->pass_len = strlen(password);
+				job->salt = symmsg->salt;
+				job->salt_len = sizeof(symmsg->salt);
+				job->key = key;
+				job->key_len = SYMKEYBYTES;
+				job->rounds = rounds;
+				jobidx[njobs++] = n;
+			}
+		}
+		bcrypt_pbkdf_batch(jobs, njobs);
+		for (size_t j = 0; j < njobs; j++)
+			if (jobs[j].rv == -1)
+				sb->results[jobidx[j]].v = REOP_D_FAIL;
+
+		for (size_t n = i; n < end; n++) {
+			const struct reop_symmsg *symmsg = sb->symmsgs[n];
+
+			if (sb->results[n].v != REOP_D_OK)
+				continue;
+			if (symdecryptraw(sb->msgs[n], sb->msglens[n], symmsg->nonce,
+			    symmsg->tag, keys[n - i]) != 0)
+				sb->results[n].v = REOP_D_FAIL;
+		}
+		sodium_memzero(keys, sizeof(keys));
+	}
+	return NULL;
+}
+
+int
+reop_ctx_symdecrypt_batch(struct reop_ctx *ctx,
+    const struct reop_symmsg *const *symmsgs, const char *const *passwords,
+    uint8_t *const *msgs, const uint64_t *msglens, uint64_t count,
+    reop_decrypt_result *results)
+{
+	struct symdecryptbatch sb;
+	char passbuf[1024];
+	uint64_t i;
+	int nopass = 0;
+
+	sb.symmsgs = symmsgs;
+	sb.passwords = passwords;
+	sb.defpassword = NULL;
+	sb.msgs = msgs;
+	sb.msglens = msglens;
+	sb.results = results;
+	sb.count = count;
+	sb.next = 0;
+
+	for (i = 0; i < count; i++) {
+		if (passwords[i] || symmsgs[i]->kdfrounds == 0)
+			continue;
+		if (!ctx->passwordcb) {
+			ctxerr(ctx, "no password");
+			nopass = 1;
+		} else if (ctx->passwordcb(ctx->passwordarg, "passphrase: ",
+		    passbuf, sizeof(passbuf)) != 0) {
+			ctxerr(ctx, "unable to read passphrase");
+			nopass = 1;
+		} else {
+			sb.defpassword = passbuf;
+		}
+		break;
+	}
+
+	pthread_mutex_init(&sb.lock, NULL);
+	runworkers(symdecryptworker, &sb,
+	    (count + SYMDECRYPTBLOCK - 1) / SYMDECRYPTBLOCK);
+	pthread_mutex_destroy(&sb.lock);
+	sodium_memzero(passbuf, sizeof(passbuf));
+
+	for (i = 0; i < count; i++) {
+		if (results[i].v != REOP_D_OK) {
+			if (!nopass)
+				ctxerr(ctx, "sym decryption failed");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+reop_symdecrypt_batch(const struct reop_symmsg *const *symmsgs,
+    const char *const *passwords, uint8_t *const *msgs, const uint64_t *msglens,
+    uint64_t count, reop_decrypt_result *results)
+{
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_symdecrypt_batch(&ctx, symmsgs, passwords, msgs, msglens,
+	    count, results);
+}
+
+void
+reop_freeencmsg(const struct reop_encmsg *encmsg)
+{
+	xfree((void *)encmsg, sizeof(*encmsg));
+}
+
+/*
+ * encrypt a message using symmetric cryptography (a password)
+ */
+const struct reop_symmsg *
+reop_ctx_symencrypt(struct reop_ctx *ctx, uint8_t *msg, uint64_t msglen,
+    const char *password, uint32_t rounds)
+{
+	struct reop_symmsg *symmsg = malloc(sizeof(*symmsg));
+	if (!symmsg) {
+		ctxerr(ctx, "out of memory");
+		return NULL;
+	}
+
+	memcpy(symmsg->symalg, SYMALG, 2);
+	if (kdfparams(ctx, rounds, symmsg->kdfalg, &rounds) != 0) {
+		free(symmsg);
+		return NULL;
+	}
+	symmsg->kdfrounds = htonl(rounds);
+	randombytes(symmsg->salt, sizeof(symmsg->salt));
+
+	uint8_t symkey[SYMKEYBYTES];
+	kdf_confirm confirm = { 1 };
+	if (kdf(ctx, symmsg->kdfalg, rounds, symmsg->salt, sizeof(symmsg->salt),
+	    password, confirm, symkey, sizeof(symkey)) != 0) {
+		free(symmsg);
+		return NULL;
+	}
+
+	symencryptraw(msg, msglen, symmsg->nonce, symmsg->tag, symkey);
+
+	sodium_memzero(symkey, sizeof(symkey));
+
+	return symmsg;
+}
+
+const struct reop_symmsg *
+reop_symencrypt(uint8_t *msg, uint64_t msglen, const char *password)
+{
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_symencrypt(&ctx, msg, msglen, password, 0);
+}
+
+void
+reop_freesymmsg(const struct reop_symmsg *symmsg)
+{
+	xfree((void *)symmsg, sizeof(*symmsg));
+}
+
+/*
+ * chunked encryption, for messages too large to hold in memory.
+ * every chunk but the last is exactly REOP_CHUNKSIZE bytes. the last chunk
+ * is shorter, possibly empty, and marked as such in its nonce, so that
+ * truncating the message at a chunk boundary is detected.
+ */
+static void
+chunknonce(const uint8_t *base, uint64_t chunk, int final, uint8_t *nonce)
+{
+	memcpy(nonce, base, SYMNONCEBYTES);
+	for (int i = 0; i < 8; i++)
+		nonce[i] ^= (chunk >> (i * 8)) & 0xff;
+	if (final)
+		nonce[SYMNONCEBYTES - 1] ^= 0x80;
+}
+
+static struct reop_stream *
+newstream(void)
+{
+	struct reop_stream *stream = malloc(sizeof(*stream));
+	if (!stream)
+		return NULL;
+	memset(stream, 0, sizeof(*stream));
+	return stream;
+}
+
+/*
+ * start a chunked message using symmetric cryptography (a password)
+ */
+struct reop_stream *
+reop_ctx_symencrypt_init(struct reop_ctx *ctx, const char *password, uint32_t rounds)
+{
+	struct reop_stream *stream = newstream();
+	if (!stream) {
+		ctxerr(ctx, "out of memory");
+		return NULL;
+	}
+	struct symchunkmsg *symmsg = &stream->hdr.symmsg;
+
+	memcpy(symmsg->symalg, SYMCHUNKALG, 2);
+	if (kdfparams(ctx, rounds, symmsg->kdfalg, &rounds) != 0) {
+		free(stream);
+		return NULL;
+	}
+	symmsg->kdfrounds = htonl(rounds);
+	randombytes(symmsg->salt, sizeof(symmsg->salt));
+	randombytes(symmsg->nonce, sizeof(symmsg->nonce));
+	memcpy(stream->nonce, symmsg->nonce, sizeof(stream->nonce));
+	stream->hdrsize = symchunkmsgsize;
+
+	kdf_confirm confirm = { 1 };
+	if (kdf(ctx, symmsg->kdfalg, rounds, symmsg->salt, sizeof(symmsg->salt),
+	    password, confirm, stream->key, sizeof(stream->key)) != 0) {
+		reop_freestream(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+struct reop_stream *
+reop_symencrypt_init(const char *password)
+{
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_symencrypt_init(&ctx, password, 0);
+}
+
+/*
+ * start a chunked message using public key cryptography.
+ * same ephemeral key construction as reop_pubencrypt, but the chunks are
+ * encrypted with the precomputed shared key.
+ */
+struct reop_stream *
+reop_pubencrypt_init(const struct reop_pubkey *pubkey, const struct reop_seckey *seckey)
+{
+	struct reop_stream *stream = newstream();
+	if (!stream)
+		return NULL;
+	struct encchunkmsg *encmsg = &stream->hdr.encmsg;
+
+	memcpy(encmsg->encalg, ENCCHUNKALG, 2);
+	memcpy(encmsg->pubrandomid, pubkey->randomid, RANDOMIDLEN);
+	memcpy(encmsg->secrandomid, seckey->randomid, RANDOMIDLEN);
+	strlcpy(encmsg->ident, seckey->ident, sizeof(encmsg->ident));
+	randombytes(encmsg->nonce, sizeof(encmsg->nonce));
+	memcpy(stream->nonce, encmsg->nonce, sizeof(stream->nonce));
+	stream->hdrsize = encchunkmsgsize;
+
+	uint8_t ephseckey[ENCSECRETBYTES];
+	crypto_box_keypair(encmsg->ephpubkey, ephseckey);
+	crypto_box_beforenm(stream->key, pubkey->enckey, ephseckey);
+	sodium_memzero(ephseckey, sizeof(ephseckey));
+	if (seckeybox(seckey, pubkey->enckey, encmsg->ephpubkey,
+	    sizeof(encmsg->ephpubkey), encmsg->ephnonce, encmsg->ephtag) != 0) {
+		reop_freestream(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+/*
+ * start a chunked message for many recipients
+ */
+struct reop_stream *
+reop_pubencrypt_multi_init(const struct reop_pubkey *const *pubkeys,
+    uint64_t npubkeys, const struct reop_seckey *seckey)
+{
+	if (npubkeys == 0 || npubkeys > REOP_MAXRECIPIENTS)
+		return NULL;
+	struct reop_stream *stream = newstream();
+	if (!stream)
+		return NULL;
+	stream->hdrsize = encmultimsgsize + npubkeys * sizeof(struct encrecipient);
+	if (!(stream->hdrbuf = malloc(stream->hdrsize))) {
+		free(stream);
+		return NULL;
+	}
+	struct encmultimsg *encmsg = (struct encmultimsg *)stream->hdrbuf;
+	struct encrecipient *recips = (struct encrecipient *)(encmsg + 1);
+
+	memcpy(encmsg->encalg, ENCMULTIALG, 2);
+	memcpy(encmsg->secrandomid, seckey->randomid, RANDOMIDLEN);
+	encmsg->nrecipients[0] = npubkeys >> 8;
+	encmsg->nrecipients[1] = npubkeys & 0xff;
+	randombytes(encmsg->nonce, sizeof(encmsg->nonce));
+	memcpy(stream->nonce, encmsg->nonce, sizeof(stream->nonce));
+	randombytes(stream->key, sizeof(stream->key));
+
+	for (uint64_t i = 0; i < npubkeys; i++) {
+		const struct reop_pubkey *pubkey = pubkeys[i];
+		struct encrecipient *recip = &recips[i];
+		uint8_t ephseckey[ENCSECRETBYTES];
+
+		memcpy(recip->pubrandomid, pubkey->randomid, RANDOMIDLEN);
+		memcpy(recip->datakey, stream->key, sizeof(recip->datakey));
+		crypto_box_keypair(recip->ephpubkey, ephseckey);
+		pubencryptraw(recip->datakey, sizeof(recip->datakey), recip->keynonce,
+		    recip->keytag, pubkey->enckey, ephseckey);
+		sodium_memzero(ephseckey, sizeof(ephseckey));
+		if (seckeybox(seckey, pubkey->enckey, recip->ephpubkey,
+		    sizeof(recip->ephpubkey), recip->ephnonce, recip->ephtag) != 0) {
+			reop_freestream(stream);
+			return NULL;
+		}
+	}
+
+	return stream;
+}
+
+/*
+ * prepare to decrypt a chunked message from its header
+ */
+reop_decrypt_result
+reop_ctx_symdecrypt_init(struct reop_ctx *ctx, struct reop_stream **streamp,
+    const uint8_t *hdr, uint64_t hdrlen, const char *password)
+{
+	*streamp = NULL;
+	if (hdrlen != symchunkmsgsize || memcmp(hdr, SYMCHUNKALG, 2) != 0) {
+		ctxerr(ctx, "invalid header");
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	}
+
+	struct reop_stream *stream = newstream();
+	if (!stream) {
+		ctxerr(ctx, "out of memory");
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	}
+	struct symchunkmsg *symmsg = &stream->hdr.symmsg;
+	memcpy(symmsg, hdr, hdrlen);
+	if (!kdfknown(symmsg->kdfalg)) {
+		reop_freestream(stream);
+		ctxerr(ctx, "unsupported key format");
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	}
+	memcpy(stream->nonce, symmsg->nonce, sizeof(stream->nonce));
+	stream->hdrsize = symchunkmsgsize;
+
+	kdf_confirm confirm = { 0 };
+	uint32_t rounds = ntohl(symmsg->kdfrounds);
+	if (kdf(ctx, symmsg->kdfalg, rounds, symmsg->salt, sizeof(symmsg->salt),
+	    password, confirm, stream->key, sizeof(stream->key)) != 0) {
+		reop_freestream(stream);
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	}
+
+	*streamp = stream;
+	return (reop_decrypt_result) { REOP_D_OK };
+}
+
+reop_decrypt_result
+reop_symdecrypt_init(struct reop_stream **streamp, const uint8_t *hdr, uint64_t hdrlen,
+    const char *password)
+{
+	struct reop_ctx ctx = defctx;
+	return reop_ctx_symdecrypt_init(&ctx, streamp, hdr, hdrlen, password);
+}
+
+/*
+ * find our entry in a multi recipient header and recover the data key
+ */
+static reop_decrypt_result
+pubdecryptmulti(struct reop_stream **streamp, const uint8_t *hdr, uint64_t hdrlen,
+    const struct reop_pubkey *pubkey, const struct reop_seckey *seckey)
+{
+	struct encmultimsg encmsg;
+	struct encrecipient recip;
+
+	if (hdrlen < encmultimsgsize)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	memcpy(&encmsg, hdr, encmultimsgsize);
+	uint64_t nrecips = encmsg.nrecipients[0] << 8 | encmsg.nrecipients[1];
+	if (hdrlen != encmultimsgsize + nrecips * sizeof(recip))
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	if (memcmp(encmsg.secrandomid, pubkey->randomid, RANDOMIDLEN) != 0)
+		return (reop_decrypt_result) { REOP_D_MISMATCH };
+
+	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+
+	const uint8_t *entries = hdr + encmultimsgsize;
+	uint64_t i;
+	for (i = 0; i < nrecips; i++) {
+		memcpy(&recip, entries + i * sizeof(recip), sizeof(recip));
+		if (memcmp(recip.pubrandomid, seckey->randomid, RANDOMIDLEN) == 0)
+			break;
+	}
+	if (i == nrecips)
+		return (reop_decrypt_result) { REOP_D_MISMATCH };
+
+	int rv = seckeyboxopen(seckey, pubkey->enckey, recip.ephpubkey,
+	    sizeof(recip.ephpubkey), recip.ephnonce, recip.ephtag);
+	if (rv == 0)
+		rv = seckeyboxopen(seckey, recip.ephpubkey, recip.datakey,
+		    sizeof(recip.datakey), recip.keynonce, recip.keytag);
+	if (rv != 0) {
+		sodium_memzero(&recip, sizeof(recip));
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	}
+
+	struct reop_stream *stream = newstream();
+	if (!stream) {
+		sodium_memzero(&recip, sizeof(recip));
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	}
+	memcpy(stream->nonce, encmsg.nonce, sizeof(stream->nonce));
+	memcpy(stream->key, recip.datakey, sizeof(stream->key));
+	sodium_memzero(&recip, sizeof(recip));
+
+	*streamp = stream;
+	return (reop_decrypt_result) { REOP_D_OK };
+}
+
+reop_decrypt_result
+reop_pubdecrypt_init(struct reop_stream **streamp, const uint8_t *hdr, uint64_t hdrlen,
+    const struct reop_pubkey *pubkey, const struct reop_seckey *seckey)
+{
+	*streamp = NULL;
+	if (hdrlen >= 2 && memcmp(hdr, ENCMULTIALG, 2) == 0)
+		return pubdecryptmulti(streamp, hdr, hdrlen, pubkey, seckey);
+	if (hdrlen != encchunkmsgsize || memcmp(hdr, ENCCHUNKALG, 2) != 0)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+
+	struct encchunkmsg encmsg;
+	memcpy(&encmsg, hdr, hdrlen);
+	if (memcmp(encmsg.pubrandomid, seckey->randomid, RANDOMIDLEN) != 0 ||
+	    memcmp(encmsg.secrandomid, pubkey->randomid, RANDOMIDLEN) != 0)
+		return (reop_decrypt_result) { REOP_D_MISMATCH };
+
+	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+
+	uint8_t ephpubkey[ENCPUBLICBYTES];
+	memcpy(ephpubkey, encmsg.ephpubkey, sizeof(encmsg.ephpubkey));
+	int rv = seckeyboxopen(seckey, pubkey->enckey, ephpubkey, sizeof(ephpubkey),
+	    encmsg.ephnonce, encmsg.ephtag);
+	if (rv != 0)
+		return (reop_decrypt_result) { REOP_D_FAIL };
+
+	struct reop_stream *stream = newstream();
+	if (!stream)
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	memcpy(&stream->hdr.encmsg, &encmsg, hdrlen);
+	memcpy(stream->nonce, encmsg.nonce, sizeof(stream->nonce));
+	stream->hdrsize = encchunkmsgsize;
+	rv = seckeybeforenm(seckey, ephpubkey, stream->key);
+	sodium_memzero(ephpubkey, sizeof(ephpubkey));
+	if (rv != 0) {
+		reop_freestream(stream);
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	}
+
+	*streamp = stream;
+	return (reop_decrypt_result) { REOP_D_OK };
+}
+
+/*
+ * the header to write before the first chunk
+ */
+const uint8_t *
+reop_stream_header(const struct reop_stream *stream, uint64_t *hdrlen)
+{
+	*hdrlen = stream->hdrsize;
+	if (stream->hdrbuf)
+		return stream->hdrbuf;
+	return (const uint8_t *)&stream->hdr;
+}
+
+/*
+ * encrypt the next chunk "in place"
+ */
+int
+reop_stream_encrypt(struct reop_stream *stream, uint8_t *buf, uint64_t buflen,
+    int final, uint8_t *tag)
+{
+	if (stream->done)
+		return -1;
+	if (final ? buflen >= REOP_CHUNKSIZE : buflen != REOP_CHUNKSIZE)
+		return -1;
+
+	uint8_t nonce[SYMNONCEBYTES];
+	chunknonce(stream->nonce, stream->chunk, final, nonce);
+	chunkencryptraw(buf, buflen, nonce, tag, stream->key);
+	stream->chunk++;
+	stream->done = final;
+	return 0;
+}
+
+/*
+ * decrypt the next chunk "in place"
+ */
+reop_decrypt_result
+reop_stream_decrypt(struct reop_stream *stream, uint8_t *buf, uint64_t buflen,
+    int final, const uint8_t *tag)
+{
+	if (stream->done)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	if (final ? buflen >= REOP_CHUNKSIZE : buflen != REOP_CHUNKSIZE)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+
+	uint8_t nonce[SYMNONCEBYTES];
+	chunknonce(stream->nonce, stream->chunk, final, nonce);
+	if (symdecryptraw(buf, buflen, nonce, tag, stream->key) != 0)
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	stream->chunk++;
+	stream->done = final;
+	return (reop_decrypt_result) { REOP_D_OK };
+}
+
+/*
+ * many chunks at once, laid out as in a message: each chunk is its tag
+ * followed by its data. every chunk has its own nonce, so they are
+ * independent, and the work is handed out to one thread per cpu in blocks
+ * of a few chunks. buf is processed "in place".
+ */
+struct chunkbatch {
+	const struct reop_stream *stream;
+	uint8_t *buf;
+	uint64_t first;		/* number of the first chunk in buf */
+	uint64_t nchunks;
+	uint64_t lastlen;	/* of the final chunk, if any */
+	int final;
+	int decrypt;
+	int failed;
+	uint64_t next;
+	pthread_mutex_t lock;
+};
+
+enum { CHUNKSTRIDE = REOP_CHUNKTAGBYTES + REOP_CHUNKSIZE, CHUNKBLOCK = 4 };
+
+static void *
+chunkworker(void *arg)
+{
+	struct chunkbatch *cb = arg;
+	uint8_t nonce[SYMNONCEBYTES];
+
+	while (1) {
+		pthread_mutex_lock(&cb->lock);
+		uint64_t i = cb->next;
+		uint64_t end = cb->nchunks - i > CHUNKBLOCK ? i + CHUNKBLOCK : cb->nchunks;
+		cb->next = end;
+		pthread_mutex_unlock(&cb->lock);
+		if (i == end)
+			break;
+		for (; i < end; i++) {
+			int final = cb->final && i == cb->nchunks - 1;
+			uint8_t *tag = cb->buf + i * CHUNKSTRIDE;
+			uint8_t *data = tag + REOP_CHUNKTAGBYTES;
+			uint64_t len = final ? cb->lastlen : REOP_CHUNKSIZE;
+
+			chunknonce(cb->stream->nonce, cb->first + i, final, nonce);
+			if (!cb->decrypt)
+				chunkencryptraw(data, len, nonce, tag, cb->stream->key);
+			else if (symdecryptraw(data, len, nonce, tag, cb->stream->key) != 0) {
+				pthread_mutex_lock(&cb->lock);
+				cb->failed = 1;
+				pthread_mutex_unlock(&cb->lock);
+			}
+		}
+	}
+	return NULL;
+}
+
+static int
+runchunks(struct reop_stream *stream, uint8_t *buf, uint64_t buflen, int final,
+    int decrypt)
+{
+	struct chunkbatch cb;
+
+	if (stream->done)
+		return -1;
+	cb.nchunks = buflen / CHUNKSTRIDE;
+	cb.lastlen = 0;
+	if (final) {
+		uint64_t rem = buflen % CHUNKSTRIDE;
+		if (rem < REOP_CHUNKTAGBYTES)
+			return -1;
+		cb.lastlen = rem - REOP_CHUNKTAGBYTES;
+		cb.nchunks++;
+	} else if (buflen % CHUNKSTRIDE != 0) {
+		return -1;
+	}
+	cb.stream = stream;
+	cb.buf = buf;
+	cb.first = stream->chunk;
+	cb.final = final;
+	cb.decrypt = decrypt;
+	cb.failed = 0;
+	cb.next = 0;
+	pthread_mutex_init(&cb.lock, NULL);
+
+	runworkers(chunkworker, &cb, (cb.nchunks + CHUNKBLOCK - 1) / CHUNKBLOCK);
+
+	pthread_mutex_destroy(&cb.lock);
+	if (cb.failed)
+		return 1;
+	stream->chunk += cb.nchunks;
+	stream->done = final;
+	return 0;
+}
+
+int
+reop_stream_encrypt_chunks(struct reop_stream *stream, uint8_t *buf, uint64_t buflen,
+    int final)
+{
+	return runchunks(stream, buf, buflen, final, 0) == 0 ? 0 : -1;
+}
+
+/*
+ * the length of the message in a whole run of chunks, from the first to
+ * the final chunk
+ */
+int
+reop_stream_msglen(uint64_t chunkslen, uint64_t *msglen)
+{
+	uint64_t rem = chunkslen % CHUNKSTRIDE;
+
+	if (rem < REOP_CHUNKTAGBYTES)
+		return -1;
+	*msglen = chunkslen / CHUNKSTRIDE * REOP_CHUNKSIZE + rem - REOP_CHUNKTAGBYTES;
+	return 0;
+}
+
+/*
+ * random access. every chunk but the final one is the same size, so the
+ * chunks holding a byte range are found by arithmetic, and only they are
+ * read and authenticated. chunks is every chunk of the message, for
+ * instance a mapped file past its header and ident, and is left as is.
+ * the stream is not advanced and may be shared between threads.
+ */
+reop_decrypt_result
+reop_stream_decrypt_range(const struct reop_stream *stream, const uint8_t *chunks,
+    uint64_t chunkslen, uint64_t off, uint64_t len, uint8_t *out)
+{
+	uint64_t msglen;
+
+	if (reop_stream_msglen(chunkslen, &msglen) != 0 || off > msglen ||
+	    len > msglen - off)
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	if (len == 0)
+		return (reop_decrypt_result) { REOP_D_OK };
+
+	struct chunkbatch cb;
+	uint64_t nall = chunkslen / CHUNKSTRIDE + 1;
+	uint64_t last = (off + len - 1) / REOP_CHUNKSIZE;
+
+	cb.stream = stream;
+	cb.first = off / REOP_CHUNKSIZE;
+	cb.nchunks = last - cb.first + 1;
+	cb.final = last == nall - 1;
+	cb.lastlen = chunkslen % CHUNKSTRIDE - REOP_CHUNKTAGBYTES;
+	cb.decrypt = 1;
+	cb.failed = 0;
+	cb.next = 0;
+
+	uint64_t buflen = cb.final ? (cb.nchunks - 1) * CHUNKSTRIDE +
+	    REOP_CHUNKTAGBYTES + cb.lastlen : cb.nchunks * CHUNKSTRIDE;
+	if (buflen > SIZE_MAX || !(cb.buf = malloc(buflen)))
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	memcpy(cb.buf, chunks + cb.first * CHUNKSTRIDE, buflen);
+	pthread_mutex_init(&cb.lock, NULL);
+
+	runworkers(chunkworker, &cb, (cb.nchunks + CHUNKBLOCK - 1) / CHUNKBLOCK);
+
+	pthread_mutex_destroy(&cb.lock);
+	if (!cb.failed) {
+		uint64_t skip = off % REOP_CHUNKSIZE;
+		for (uint64_t i = 0, done = 0; done < len; i++) {
+			uint64_t amt = REOP_CHUNKSIZE - skip;
+			if (amt > len - done)
+				amt = len - done;
+			memcpy(out + done, cb.buf + i * CHUNKSTRIDE +
+			    REOP_CHUNKTAGBYTES + skip, amt);
+			done += amt;
+			skip = 0;
+		}
+	}
+	xfree(cb.buf, buflen);
+	if (cb.failed)
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	return (reop_decrypt_result) { REOP_D_OK };
+}
+
+reop_decrypt_result
+reop_stream_decrypt_chunks(struct reop_stream *stream, uint8_t *buf, uint64_t buflen,
+    int final)
+{
+	switch (runchunks(stream, buf, buflen, final, 1)) {
+	case 0:
+		return (reop_decrypt_result) { REOP_D_OK };
+	case 1:
+		return (reop_decrypt_result) { REOP_D_FAIL };
+	default:
+		return (reop_decrypt_result) { REOP_D_INVALID };
+	}
+}
+
+void
+reop_freestream(struct reop_stream *stream)
+{
+	if (stream->hdrbuf)
+		xfree(stream->hdrbuf, stream->hdrsize);
+	xfree(stream, sizeof(*stream));
+}
+
+struct reop_ctx *
+reop_ctx_new(void)
+{
+	struct reop_ctx *ctx = malloc(sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	memset(ctx, 0, sizeof(*ctx));
+	memcpy(ctx->kdfalg, KDFALG, 2);
+	ctx->kdfrounds = 42;
+	return ctx;
+}
+
+void
+reop_ctx_free(struct reop_ctx *ctx)
+{
+	xfree(ctx, sizeof(*ctx));
+}
+
+/*
+ * where passwords come from when none is passed in. a new ctx has no
+ * callback, and a call that needs a password without one fails.
+ */
+void
+reop_ctx_setpassword(struct reop_ctx *ctx, reop_password_cb cb, void *arg)
+{
+	ctx->passwordcb = cb;
+	ctx->passwordarg = arg;
+}
+
+const char *
+reop_ctx_error(const struct reop_ctx *ctx)
+{
+	return ctx->error;
+}
+
+void
+reop_init(void)
+{
+	sodium_init();
+	traceinit();
+}
+
+#ifdef REOPMAIN
+
+static void *
+xmalloc(size_t len)
+{
+	void *p;
+
+	p = malloc(len);
+	if (!p)
+		err(1, "malloc %zu", len);
+	return p;
+}
+
+/*
+ * the cli reads passwords from the tty and has one ctx for everything
+ */
+static struct reop_ctx *reopctx;
+
+static const struct reop_seckey *
+getseckeyorfail(const char *seckeyfile)
+{
+	const struct reop_seckey *seckey = reop_ctx_getseckey(reopctx, seckeyfile, NULL);
+	if (!seckey)
+		errx(1, "%s", reop_ctx_error(reopctx));
+	return seckey;
+}
+
+static int
+xopenorfail(const char *filename, int oflags, mode_t mode)
+{
+	int fd = xopen(filename, oflags, mode);
+	if (fd >= 0)
+		return fd;
+	switch (fd) {
+	case -1:
+		err(1, "can't open %s for %s", filename,
+		    (oflags & O_WRONLY) ? "writing" : "reading");
+		break;
+	case -2:
+		err(1, "dup failed");
+		break;
+	case -3:
+		errx(1, "not a valid file: %s", filename);
+		break;
+	default:
+		errx(1, "can't open %s", filename);
+		break;
+	}
+	return -1;
+}
+
+/*
+ * map a regular file instead of reading it.
+ * the mapping is private, so the crypto functions can still operate on it
+ * "in place". the file is mapped over an anonymous region at least one byte
+ * longer, so the data is nul terminated just like readall.
+ */
+static int
+mapfd(int fd, uint8_t **msgp, uint64_t *msglenp)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+		return -1;
+	if (sb.st_size > maxmsgsize)
+		return -2;
+
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	size_t maplen = (sb.st_size + pagesize) & ~(pagesize - 1);
+	uint8_t *msg = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (msg == MAP_FAILED)
+		return -1;
+	if (mmap(msg, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	    fd, 0) == MAP_FAILED) {
+		munmap(msg, maplen);
+		return -1;
+	}
+	madvise(msg, sb.st_size, MADV_SEQUENTIAL);
+
+	*msgp = msg;
+	*msglenp = sb.st_size;
+	return 0;
+}
+
+/*
+ * whether fd is the file which outfile names. opening the output truncates
+ * it, so a mapping of the same file would lose its pages while still in use.
+ */
+static int
+isoutput(int fd, const char *outfile)
+{
+	struct stat sb, outsb;
+
+	if (!outfile || strcmp(outfile, "-") == 0)
+		return 0;
+	if (fstat(fd, &sb) == -1 || stat(outfile, &outsb) == -1)
+		return 0;
+	return sb.st_dev == outsb.st_dev && sb.st_ino == outsb.st_ino;
+}
+
+/*
+ * map the file if possible, otherwise read it all. a file which is also
+ * the output is always read. mapped tells freeall how to release the data.
+ */
+static int
+mapallfd(int fd, const char *outfile, uint8_t **msgp, uint64_t *msglenp,
+    int *mappedp)
+{
+	int rv = isoutput(fd, outfile) ? -1 : mapfd(fd, msgp, msglenp);
+	*mappedp = rv == 0;
+	if (rv == -1)
+		rv = readallfd(fd, NULL, 0, msgp, msglenp);
+	close(fd);
+	return rv;
+}
+
+static int
+mapall(const char *filename, uint8_t **msgp, uint64_t *msglenp, int *mappedp)
+{
+	int fd = xopen(filename, O_RDONLY | O_NOFOLLOW, 0);
+	if (fd < 0)
+		return -1;
+	return mapallfd(fd, NULL, msgp, msglenp, mappedp);
+}
+
+static void
+mapallorfail(const char *filename, const char *outfile, uint8_t **msgp,
+    uint64_t *msglenp, int *mappedp)
+{
+	int fd = xopenorfail(filename, O_RDONLY | O_NOFOLLOW, 0);
+	int rv = mapallfd(fd, outfile, msgp, msglenp, mappedp);
+	switch (rv) {
+	case 0:
+		break;
+	case -2:
+		errx(1, "%s is too large", filename);
+		break;
+	default:
+		errx(1, "could not read %s", filename);
+		break;
+	}
+}
+
+/*
+ * mapped data is either unchanged file contents or will be written out,
+ * so it's not worth dirtying every page to zero it.
+ */
+static void
+freeall(uint8_t *msg, uint64_t msglen, int mapped)
+{
+	if (mapped) {
+		size_t pagesize = sysconf(_SC_PAGESIZE);
+		munmap(msg, (msglen + pagesize) & ~(pagesize - 1));
+	} else {
+		xfree(msg, msglen);
+	}
+}
+
+/*
+ * fill buf from fd, stopping early only at end of file
+ */
+static size_t
+readchunk(int fd, uint8_t *buf, size_t buflen, const char *filename)
+{
+	uint64_t t = tracestart();
+	size_t have = 0;
+	while (have < buflen) {
+		ssize_t x = read(fd, buf + have, buflen - have);
+		if (x == -1)
+			err(1, "read from %s", filename);
+		if (x == 0)
+			break;
+		have += x;
+	}
+	traceend("read", t, have);
+	return have;
+}
+
+static void
+writeall(int fd, const void *buf, size_t buflen, const char *filename)
+{
+	uint64_t t = tracestart();
+	uint64_t total = buflen;
+
+	while (buflen != 0) {
+		ssize_t x = write(fd, buf, buflen);
+		if (x == -1)
+			err(1, "write to %s", filename);
+		buflen -= x;
+		buf = (char *)buf + x;
+	}
+	traceend("write", t, total);
+}
+
+/*
+ * buffered output, so that lots of little writes (like base64 lines)
+ * turn into a few big ones. errors are reported as for writeall.
+ */
+#define OUTBUFSIZE (1024 * 1024)
+
+struct outbuf {
+	int fd;
+	const char *filename;
+	uint8_t *buf;
+	size_t len;
+};
+
+static void
+outopen(struct outbuf *out, const char *filename, int oflags, mode_t mode)
+{
+	out->fd = xopenorfail(filename, oflags, mode);
+	out->filename = filename;
+	out->buf = xmalloc(OUTBUFSIZE);
+	out->len = 0;
+}
+
+static void
+outflush(struct outbuf *out)
+{
+	writeall(out->fd, out->buf, out->len, out->filename);
+	out->len = 0;
+}
+
+static void
+outwrite(struct outbuf *out, const void *buf, size_t buflen)
+{
+	if (out->len + buflen > OUTBUFSIZE)
+		outflush(out);
+	if (buflen >= OUTBUFSIZE) {
+		writeall(out->fd, buf, buflen, out->filename);
+		return;
+	}
+	memcpy(out->buf + out->len, buf, buflen);
+	out->len += buflen;
+}
+
+static void
+outclose(struct outbuf *out)
+{
+	outflush(out);
+	close(out->fd);
+	xfree(out->buf, OUTBUFSIZE);
+	out->buf = NULL;
+}
+
+/*
+ * base64 encode data with line wrapping. the encoder state is kept by
+ * the caller, so data may be written a piece at a time.
+ */
+static void
+writeb64update(struct outbuf *out, struct reopb64_enc *enc, const void *data,
+    size_t datalen)
+{
+	char b64[16384];
+	const size_t blocklen = 57 * 192;
+
+	while (datalen > 0) {
+		size_t amt = datalen > blocklen ? blocklen : datalen;
+		uint64_t t = tracestart();
+		int b64len = reopb64_enc_update(enc, data, amt, b64, sizeof(b64));
+		if (b64len == -1)
+			errx(1, "b64 encode failed");
+		traceend("b64encode", t, amt);
+		outwrite(out, b64, b64len);
+		data = (const uint8_t *)data + amt;
+		datalen -= amt;
+	}
+}
+
+static void
+writeb64final(struct outbuf *out, struct reopb64_enc *enc)
+{
+	char b64[8];
+
+	int b64len = reopb64_enc_final(enc, b64, sizeof(b64));
+	if (b64len == -1)
+		errx(1, "b64 encode failed");
+	outwrite(out, b64, b64len);
+}
+
+static void
+writeb64data(struct outbuf *out, const void *data, size_t datalen)
+{
+	struct reopb64_enc enc;
+
+	reopb64_enc_init(&enc);
+	writeb64update(out, &enc, data, datalen);
+	writeb64final(out, &enc);
+}
+
+static void
+generate(const char *pubkeyfile, const char *seckeyfile, const char *ident,
+    const char *password)
+{
+	struct reop_keypair keypair = reop_generate(ident);
+	struct outbuf out;
+	if (!keypair.pubkey)
+		errx(1, "unable to generate keys");
+
+	char secnamebuf[1024];
+	if (!seckeyfile && gethomefile("seckey", secnamebuf, sizeof(secnamebuf)) == 0)
+		seckeyfile = secnamebuf;
+	if (!seckeyfile)
+		errx(1, "no seckeyfile");
+
+	outopen(&out, seckeyfile, O_CREAT|O_EXCL|O_NOFOLLOW|O_WRONLY, 0600);
+	const char *keydata = reop_ctx_encodeseckey(reopctx, keypair.seckey, password, 0);
+	if (!keydata)
+		errx(1, "%s", reop_ctx_error(reopctx));
+	outwrite(&out, keydata, strlen(keydata));
+	reop_freestr(keydata);
+	outclose(&out);
+
+
+	char pubnamebuf[1024];
+	if (!pubkeyfile && gethomefile("pubkey", pubnamebuf, sizeof(pubnamebuf)) == 0)
+		pubkeyfile = pubnamebuf;
+	if (!pubkeyfile)
+		errx(1, "no pubkeyfile");
+
+	outopen(&out, pubkeyfile, O_CREAT|O_EXCL|O_NOFOLLOW|O_WRONLY, 0666);
+	keydata = reop_encodepubkey(keypair.pubkey);
+	if (!keydata)
+		errx(1, "unable to encode pubkey");
+	outwrite(&out, keydata, strlen(keydata));
+	reop_freestr(keydata);
+	outclose(&out);
+
+	reop_freepubkey(keypair.pubkey);
+	reop_freeseckey(keypair.seckey);
+}
+
+/*
+ * write a combined message and signature
+ */
+static void
+writesignedmsg(const char *filename, const struct reop_sig *sig,
+    const char *ident, const uint8_t *msg, uint64_t msglen)
+{
+	char header[1024];
+	struct outbuf out;
+
+	outopen(&out, filename, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
+	snprintf(header, sizeof(header), "-----BEGIN REOP SIGNED MESSAGE-----\n");
+	outwrite(&out, header, strlen(header));
+	outwrite(&out, msg, msglen);
+
+	snprintf(header, sizeof(header), "-----BEGIN REOP SIGNATURE-----\n"
+	    "ident:%s\n", ident);
+	outwrite(&out, header, strlen(header));
+	writeb64data(&out, sig, sigsize);
+	snprintf(header, sizeof(header), "-----END REOP SIGNED MESSAGE-----\n");
+	outwrite(&out, header, strlen(header));
+	outclose(&out);
+}
+
+static const char begintree[] = "-----BEGIN REOP SIGNATURE TREE-----\n";
+static const char endtree[] = "-----END REOP SIGNATURE TREE-----\n";
+
+/*
+ * write a detached signature, followed by the hash tree if there is one
+ */
+static void
+writesigfile(const char *sigfile, const struct reop_sig *sig,
+    const uint8_t *tree, uint64_t nodes)
+{
+	struct outbuf out;
+
+	outopen(&out, sigfile, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
+	const char *sigdata = reop_encodesig(sig);
+	if (!sigdata)
+		errx(1, "unable to encode sig");
+	outwrite(&out, sigdata, strlen(sigdata));
+	reop_freestr(sigdata);
+	if (tree) {
+		outwrite(&out, begintree, strlen(begintree));
+		writeb64data(&out, tree, nodes * REOP_TREEHASHBYTES);
+		outwrite(&out, endtree, strlen(endtree));
+	}
+	outclose(&out);
+}
+
+/*
+ * hash a file of any size for a streaming signature, a buffer at a time
+ */
+static struct reop_sigstream *
+hashfile(const char *msgfile)
+{
+	struct reop_sigstream *ss = reop_sigstream_init();
+	if (!ss)
+		errx(1, "unable to hash");
+
+	int fd = xopenorfail(msgfile, O_RDONLY | O_NOFOLLOW, 0);
+	size_t buflen = 256 * 1024;
+	uint8_t *buf = xmalloc(buflen);
+	size_t amt;
+	do {
+		amt = readchunk(fd, buf, buflen, msgfile);
+		reop_sigstream_update(ss, buf, amt);
+	} while (amt == buflen);
+	free(buf);
+	close(fd);
+	return ss;
+}
+
+/*
+ * map a regular file of any size. only the pages used are read.
+ */
+static uint8_t *
+mapwhole(const char *msgfile, uint64_t *msglenp)
+{
+	struct stat sb;
+	uint8_t *msg = NULL;
+
+	int fd = xopenorfail(msgfile, O_RDONLY | O_NOFOLLOW, 0);
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+		errx(1, "%s is not a regular file", msgfile);
+	if (sb.st_size &&
+	    (msg = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		err(1, "mmap %s", msgfile);
+	close(fd);
+	*msglenp = sb.st_size;
+	return msg;
+}
+
+/*
+ * hash a file into a tree, on every cpu
+ */
+static uint8_t *
+hashtree(const char *msgfile, uint64_t *msglenp)
+{
+	uint64_t msglen;
+	uint8_t *msg = mapwhole(msgfile, &msglen);
+	uint8_t *tree = xmalloc(reop_tree_nodes(msglen) * REOP_TREEHASHBYTES);
+	reop_tree_hash(msg, msglen, tree);
+	if (msglen)
+		munmap(msg, msglen);
+	*msglenp = msglen;
+	return tree;
+}
+
+/*
+ * sign a file
+ */
+static void
+signfile(const char *seckeyfile, const char *msgfile, const char *sigfile,
+    int embedded, int streamed, int treed)
+{
+	uint64_t msglen = 0;
+	uint8_t *msg = NULL;
+	int mapped = 0;
+	const struct reop_sig *sig;
+
+	if (treed) {
+		uint8_t *tree = hashtree(msgfile, &msglen);
+		uint64_t nodes = reop_tree_nodes(msglen);
+		const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
+		sig = reop_tree_sign(seckey, tree + (nodes - 1) * REOP_TREEHASHBYTES,
+		    msglen);
+		reop_freeseckey(seckey);
+		if (!sig)
+			errx(1, "unable to sign");
+		writesigfile(sigfile, sig, tree, nodes);
+		reop_freesig(sig);
+		free(tree);
+		return;
+	}
+
+	if (streamed) {
+		struct reop_sigstream *ss = hashfile(msgfile);
+		const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
+		sig = reop_sigstream_sign(ss, seckey);
+		reop_freesigstream(ss);
+		reop_freeseckey(seckey);
+		if (!sig)
+			errx(1, "unable to sign");
+		writesigfile(sigfile, sig, NULL, 0);
+		reop_freesig(sig);
+		return;
+	}
+
+	mapallorfail(msgfile, embedded ? sigfile : NULL, &msg, &msglen, &mapped);
+
+	const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
+
+	sig = reop_sign(seckey, msg, msglen);
+	if (!sig)
+		errx(1, "unable to sign");
+
+	reop_freeseckey(seckey);
+
+	if (embedded)
+		writesignedmsg(sigfile, sig, sig->ident, msg, msglen);
+	else
+		writesigfile(sigfile, sig, NULL, 0);
+
+	reop_freesig(sig);
+	freeall(msg, msglen, mapped);
+}
+
+/*
+ * read signature file
+ */
+static const struct reop_sig *
+readsigfile(const char *sigfile)
 {
-	sodium_init();
+	uint64_t sigdatalen;
+	uint8_t *sigdata;
+	readall(sigfile, &sigdata, &sigdatalen);
+	if (!sigdata)
+		errx(1, "could not read %s", sigfile);
+	const struct reop_sig *sig = reop_ctx_parsesig(reopctx, (char *)sigdata);
+	xfree(sigdata, sigdatalen);
+	if (!sig)
+		errx(1, "%s", reop_ctx_error(reopctx));
+	return sig;
 }
 
-#ifdef REOPMAIN
+/*
+ * a byte range of the message, to decrypt or verify only part of it
+ */
+struct byterange {
+	uint64_t off;
+	uint64_t len;
+};
 
-static int
-xopenorfail(const char *filename, int oflags, mode_t mode)
+/*
+ * read the hash tree following a signature
+ */
+static uint8_t *
+readsigtree(const char *sigfile, uint64_t nodes)
 {
-	int fd = xopen(filename, oflags, mode);
-	if (fd >= 0)
-		return fd;
-	switch (fd) {
-	case -1:
-		err(1, "can't open %s for %s", filename,
-		    (oflags & O_WRONLY) ? "writing" : "reading");
-		break;
-	case -2:
-		err(1, "dup failed");
-		break;
-	case -3:
-		errx(1, "not a valid file: %s", filename);
+	uint64_t sigdatalen;
+	uint8_t *sigdata;
+	readall(sigfile, &sigdata, &sigdatalen);
+	if (!sigdata)
+		errx(1, "could not read %s", sigfile);
+	sigdata[sigdatalen] = '\0';
+
+	const char *begin, *end;
+	if (!(begin = strstr((char *)sigdata, begintree)) ||
+	    !(end = strstr(begin, endtree)))
+		errx(1, "no hash tree in %s", sigfile);
+	begin += strlen(begintree);
+	size_t treelen = nodes * REOP_TREEHASHBYTES;
+	size_t buflen = (end - begin) * 3 / 4 + 3;
+	if (buflen < treelen)
+		errx(1, "invalid hash tree in %s", sigfile);
+	uint8_t *tree = xmalloc(buflen);
+	struct reopb64_dec dec;
+	size_t used;
+	reopb64_dec_init(&dec);
+	if (reopb64_dec_update(&dec, begin, end - begin, tree, buflen,
+	    &used) != treelen || reopb64_dec_final(&dec) != 0)
+		errx(1, "invalid hash tree in %s", sigfile);
+	xfree(sigdata, sigdatalen);
+	return tree;
+}
+
+/*
+ * check a range of a file against a hash tree signature. the signed root
+ * is checked against the stored tree, then each block in the range with
+ * its path up to the root. the rest of the file is never read.
+ */
+static reop_verify_result
+verifytreerange(const struct reop_pubkey *pubkey, const struct reop_sig *sig,
+    const char *msgfile, const char *sigfile, const struct byterange *range)
+{
+	uint64_t msglen;
+	uint8_t *msg = mapwhole(msgfile, &msglen);
+	if (range->off > msglen || range->len > msglen - range->off)
+		errx(1, "range is past the end of the message");
+
+	uint64_t nodes = reop_tree_nodes(msglen);
+	uint8_t *tree = readsigtree(sigfile, nodes);
+	const uint8_t *root = tree + (nodes - 1) * REOP_TREEHASHBYTES;
+	reop_verify_result rv = reop_tree_verify(pubkey, root, msglen, sig);
+
+	uint64_t block = range->off / REOP_TREEBLOCK;
+	uint64_t last = (range->off + range->len - (range->len != 0)) / REOP_TREEBLOCK;
+	for (; rv.v == REOP_V_OK && range->len && block <= last; block++) {
+		uint8_t leaf[REOP_TREEHASHBYTES], check[REOP_TREEHASHBYTES];
+		uint8_t path[64 * REOP_TREEHASHBYTES];
+		uint64_t off = block * REOP_TREEBLOCK;
+		uint64_t len = msglen - off > REOP_TREEBLOCK ? REOP_TREEBLOCK :
+		    msglen - off;
+		reop_tree_leaf(msg + off, len, leaf);
+		uint64_t pathlen = reop_tree_path(tree, msglen, block, path);
+		if (reop_tree_pathroot(leaf, block, msglen, path, pathlen,
+		    check) != 0 || sodium_memcmp(check, root, sizeof(check)) != 0)
+			rv.v = REOP_V_FAIL;
+	}
+
+	free(tree);
+	if (msglen)
+		munmap(msg, msglen);
+	return rv;
+}
+
+/*
+ * simple case, detached signature
+ */
+static void
+verifysimple(const char *pubkeyfile, const char *msgfile, const char *sigfile,
+    const struct byterange *range, int quiet)
+{
+	uint64_t msglen = 0;
+	uint8_t *msg = NULL;
+	int mapped = 0;
+	reop_verify_result rv;
+
+	const struct reop_sig *sig = readsigfile(sigfile);
+	const struct reop_pubkey *pubkey = reop_getsigpubkey(pubkeyfile, sig);
+	if (!pubkey)
+		errx(1, "no pubkey");
+
+	if (range) {
+		if (memcmp(sig->sigalg, SIGTREEALG, 2) != 0)
+			errx(1, "only hash tree signatures can check a range");
+		rv = verifytreerange(pubkey, sig, msgfile, sigfile, range);
+	} else if (memcmp(sig->sigalg, SIGTREEALG, 2) == 0) {
+		/* the file is hashed on every cpu, and the tree rebuilt */
+		uint64_t treemsglen;
+		uint8_t *tree = hashtree(msgfile, &treemsglen);
+		uint64_t nodes = reop_tree_nodes(treemsglen);
+		rv = reop_tree_verify(pubkey, tree + (nodes - 1) * REOP_TREEHASHBYTES,
+		    treemsglen, sig);
+		free(tree);
+	} else if (memcmp(sig->sigalg, SIGPHALG, 2) == 0) {
+		/* prehashed signatures don't need the whole message at once */
+		struct reop_sigstream *ss = hashfile(msgfile);
+		rv = reop_sigstream_verify(ss, pubkey, sig);
+		reop_freesigstream(ss);
+	} else if (memcmp(sig->sigalg, SIGALG, 2) == 0) {
+		mapallorfail(msgfile, NULL, &msg, &msglen, &mapped);
+		rv = reop_verify(pubkey, msg, msglen, sig);
+	} else {
+		rv.v = REOP_V_FAIL;
+	}
+	switch (rv.v) {
+	case REOP_V_OK:
+		if (!quiet)
+			printf("Signature Verified\n");
 		break;
+	case REOP_V_MISMATCH:
+		errx(1, "verification failed: checked against wrong key");
 	default:
-		errx(1, "can't open %s", filename);
-		break;
+		errx(1, "signature verification failed");
 	}
-	return -1;
+
+	reop_freesig(sig);
+	reop_freepubkey(pubkey);
+	freeall(msg, msglen, mapped);
 }
 
+/*
+ * many messages, each with a detached signature beside it.
+ * the signatures are checked as a batch, a block of files at a time.
+ */
 static void
-readallorfail(const char *filename, uint8_t **msgp, uint64_t *msglenp)
+verifymany(const char *pubkeyfile, char **files, int nfiles, int quiet)
 {
-	int rv = readall(filename, msgp, msglenp);
-	switch (rv) {
-	case 0:
-		break;
-	case -1:
-		err(1, "could not open %s", filename);
-		break;
-	case -2:
-		errx(1, "%s is too large", filename);
+	enum { BLOCK = 1024 };
+	const uint8_t *msgs[BLOCK];
+	uint64_t msglens[BLOCK];
+	int mapped[BLOCK];
+	const struct reop_sig *sigs[BLOCK];
+	reop_verify_result results[BLOCK];
+	const char *names[BLOCK];
+	int failed = 0;
+
+	const struct reop_pubkey *pubkey = NULL;
+	if (pubkeyfile && !(pubkey = reop_getpubkey(pubkeyfile, NULL)))
+		errx(1, "no pubkey");
+
+	for (int base = 0; base < nfiles; base += BLOCK) {
+		int count = nfiles - base < BLOCK ? nfiles - base : BLOCK;
+		int n = 0;
+		/* files which can't be read fail alone; the rest are batched */
+		for (int i = 0; i < count; i++) {
+			const char *file = files[base + i];
+			char sigfile[1024];
+			uint8_t *msg, *sigdata;
+			uint64_t sigdatalen;
+
+			if (snprintf(sigfile, sizeof(sigfile), "%s.sig", file) >=
+			    sizeof(sigfile)) {
+				warnx("%s: path too long", file);
+				failed = 1;
+				continue;
+			}
+			if (mapall(file, &msg, &msglens[n], &mapped[n]) != 0) {
+				warnx("%s: could not read", file);
+				failed = 1;
+				continue;
+			}
+			readall(sigfile, &sigdata, &sigdatalen);
+			if (!sigdata) {
+				warnx("%s: could not read %s", file, sigfile);
+			} else {
+				sigs[n] = reop_ctx_parsesig(reopctx, (char *)sigdata);
+				xfree(sigdata, sigdatalen);
+				if (sigs[n]) {
+					msgs[n] = msg;
+					names[n++] = file;
+					continue;
+				}
+				warnx("%s: %s", sigfile, reop_ctx_error(reopctx));
+			}
+			freeall(msg, msglens[n], mapped[n]);
+			failed = 1;
+		}
+		if (reop_verify_batch(&pubkey, pubkey ? 1 : 0, msgs, msglens,
+		    sigs, n, results) != 0)
+			errx(1, "no pubkey");
+		for (int i = 0; i < n; i++) {
+			switch (results[i].v) {
+			case REOP_V_OK:
+				if (!quiet)
+					printf("%s: OK\n", names[i]);
+				break;
+			case REOP_V_MISMATCH:
+				warnx("%s: verification failed: checked against wrong key",
+				    names[i]);
+				failed = 1;
+				break;
+			default:
+				warnx("%s: signature verification failed", names[i]);
+				failed = 1;
+				break;
+			}
+			reop_freesig(sigs[i]);
+			freeall((uint8_t *)msgs[i], msglens[i], mapped[i]);
+		}
+	}
+	if (pubkey)
+		reop_freepubkey(pubkey);
+	if (failed)
+		exit(1);
+}
+
+/*
+ * check the signature at the end of a signed message, and return the
+ * message. msgdata must be nul terminated.
+ */
+static const char *
+verifysignedmsg(const char *pubkeyfile, const char *sigfile, char *msgdata,
+    uint64_t *msglenp, int quiet)
+{
+	const char *beginmsg = "-----BEGIN REOP SIGNED MESSAGE-----\n";
+	const char *beginsig = "-----BEGIN REOP SIGNATURE-----\n";
+
+	if (strncmp(msgdata, beginmsg, strlen(beginmsg)) != 0)
+		errx(1, "invalid signature: %s", sigfile);
+	char *msg = msgdata + 36;
+	char *sigdata, *nextsig;
+	if (!(sigdata = strstr(msg, beginsig)))
+		errx(1, "invalid signature: %s", sigfile);
+	while ((nextsig = strstr(sigdata + 1, beginsig)))
+		sigdata = nextsig;
+	uint64_t msglen = sigdata - msg;
+
+	const struct reop_sig *sig = reop_ctx_parsesig(reopctx, sigdata);
+	if (!sig)
+		errx(1, "%s", reop_ctx_error(reopctx));
+	const struct reop_pubkey *pubkey = reop_getsigpubkey(pubkeyfile, sig);
+	if (!pubkey)
+		errx(1, "no pubkey");
+
+	reop_verify_result rv = reop_verify(pubkey, (uint8_t *)msg, msglen, sig);
+	switch (rv.v) {
+	case REOP_V_OK:
+		if (!quiet)
+			printf("Signature Verified\n");
 		break;
+	case REOP_V_MISMATCH:
+		errx(1, "verification failed: checked against wrong key");
 	default:
-		errx(1, "could not read %s", filename);
-		break;
+		errx(1, "signature verification failed");
 	}
+
+	reop_freesig(sig);
+	reop_freepubkey(pubkey);
+
+	*msglenp = msglen;
+	return msg;
 }
 
+/*
+ * message followed by signature in one file
+ */
 static void
-writeall(int fd, const void *buf, size_t buflen, const char *filename)
+verifyembedded(const char *pubkeyfile, const char *sigfile, int quiet)
 {
-	while (buflen != 0) {
-		ssize_t x = write(fd, buf, buflen);
-		if (x == -1)
-			err(1, "write to %s", filename);
-		buflen -= x;
-		buf = (char *)buf + x;
+	uint64_t msgdatalen, msglen;
+	uint8_t *msgdata;
+	int mapped;
+	mapallorfail(sigfile, NULL, &msgdata, &msgdatalen, &mapped);
+
+	verifysignedmsg(pubkeyfile, sigfile, (char *)msgdata, &msglen, quiet);
+
+	freeall(msgdata, msgdatalen, mapped);
+}
+
+/*
+ * manifests list the BLAKE2b hash of many files, and are signed as one
+ * message. the files are hashed by one thread per cpu, each taking the
+ * next file when it finishes the last, since sizes vary.
+ */
+#define MANIFESTHASH "BLAKE2b"
+#define MANIFESTHASHBYTES crypto_generichash_BYTES
+
+struct manifestfile {
+	const char *name;
+	uint8_t want[MANIFESTHASHBYTES];
+	uint8_t hash[MANIFESTHASHBYTES];
+	int failed;
+};
+
+struct hashpool {
+	struct manifestfile *files;
+	size_t count;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+static int
+hashpath(const char *filename, uint8_t *hash)
+{
+	crypto_generichash_state state;
+	size_t buflen = 256 * 1024;
+	uint8_t *buf;
+	ssize_t x;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY | O_NOFOLLOW)) == -1)
+		return -1;
+	if (!(buf = malloc(buflen))) {
+		close(fd);
+		return -1;
+	}
+	crypto_generichash_init(&state, NULL, 0, MANIFESTHASHBYTES);
+	while ((x = read(fd, buf, buflen)) != 0) {
+		if (x == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		crypto_generichash_update(&state, buf, x);
+	}
+	free(buf);
+	close(fd);
+	if (x == -1)
+		return -1;
+	crypto_generichash_final(&state, hash, MANIFESTHASHBYTES);
+	return 0;
+}
+
+static void *
+hashworker(void *arg)
+{
+	struct hashpool *pool = arg;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		size_t i = pool->next;
+		if (i < pool->count)
+			pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i == pool->count)
+			break;
+		struct manifestfile *file = &pool->files[i];
+		file->failed = hashpath(file->name, file->hash) != 0;
+	}
+	return NULL;
+}
+
+static void
+hashfiles(struct manifestfile *files, size_t count)
+{
+	struct hashpool pool;
+
+	pool.files = files;
+	pool.count = count;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	runworkers(hashworker, &pool, count);
+	pthread_mutex_destroy(&pool.lock);
+}
+
+/*
+ * hash the files and sign the list
+ */
+static void
+signmanifest(const char *seckeyfile, const char *sigfile, char **names, int nnames)
+{
+	struct manifestfile *files = xmalloc(nnames * sizeof(*files));
+	for (int i = 0; i < nnames; i++) {
+		if (strchr(names[i], '\n'))
+			errx(1, "%s: newline in file name", names[i]);
+		files[i].name = names[i];
+	}
+	hashfiles(files, nnames);
+
+	size_t msgsize = 0, msglen = 0;
+	char *msg = NULL;
+	for (int i = 0; i < nnames; i++) {
+		if (files[i].failed)
+			errx(1, "%s: unable to read", files[i].name);
+		size_t need = strlen(MANIFESTHASH) + strlen(files[i].name) +
+		    2 * MANIFESTHASHBYTES + 8;
+		if (msglen + need > msgsize) {
+			msgsize = msgsize * 2 + need;
+			if (!(msg = realloc(msg, msgsize)))
+				err(1, "realloc");
+		}
+		msglen += snprintf(msg + msglen, msgsize - msglen, "%s (%s) = ",
+		    MANIFESTHASH, files[i].name);
+		for (int j = 0; j < MANIFESTHASHBYTES; j++)
+			msglen += snprintf(msg + msglen, msgsize - msglen, "%02x",
+			    files[i].hash[j]);
+		msg[msglen++] = '\n';
+	}
+	free(files);
+
+	const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
+	const struct reop_sig *sig = reop_sign(seckey, (uint8_t *)msg, msglen);
+	if (!sig)
+		errx(1, "unable to sign");
+	writesignedmsg(sigfile, sig, seckey->ident, (uint8_t *)msg, msglen);
+	reop_freeseckey(seckey);
+	reop_freesig(sig);
+	free(msg);
+}
+
+static int
+parsehex(const char *hex, uint8_t *buf, size_t buflen)
+{
+	for (size_t i = 0; i < buflen; i++) {
+		unsigned int b;
+		if (!isxdigit((unsigned char)hex[2 * i]) ||
+		    !isxdigit((unsigned char)hex[2 * i + 1]) ||
+		    sscanf(hex + 2 * i, "%2x", &b) != 1)
+			return -1;
+		buf[i] = b;
+	}
+	return 0;
+}
+
+/*
+ * check the signature once, then hash every file listed, or only those
+ * named, and compare
+ */
+static void
+verifymanifest(const char *pubkeyfile, const char *sigfile, char **names,
+    int nnames, int quiet)
+{
+	const char *prefix = MANIFESTHASH " (";
+	const char *sep = ") = ";
+	uint64_t msgdatalen, msglen;
+	uint8_t *msgdata;
+	int mapped;
+	mapallorfail(sigfile, NULL, &msgdata, &msgdatalen, &mapped);
+
+	char *msg = (char *)verifysignedmsg(pubkeyfile, sigfile, (char *)msgdata,
+	    &msglen, 1);
+	msg[msglen] = '\0';
+
+	size_t count = 0, maxcount = 0;
+	struct manifestfile *files = NULL;
+	char *line, *nl;
+	for (line = msg; *line; line = nl + 1) {
+		if (!(nl = strchr(line, '\n')))
+			errx(1, "invalid manifest: %s", sigfile);
+		*nl = '\0';
+		size_t linelen = nl - line;
+		size_t hexlen = 2 * MANIFESTHASHBYTES;
+		if (linelen < strlen(prefix) + strlen(sep) + hexlen ||
+		    strncmp(line, prefix, strlen(prefix)) != 0 ||
+		    strncmp(nl - hexlen - strlen(sep), sep, strlen(sep)) != 0)
+			errx(1, "invalid manifest: %s", sigfile);
+		if (count == maxcount) {
+			maxcount = maxcount ? maxcount * 2 : 64;
+			if (!(files = realloc(files, maxcount * sizeof(*files))))
+				err(1, "realloc");
+		}
+		struct manifestfile *file = &files[count++];
+		if (parsehex(nl - hexlen, file->want, MANIFESTHASHBYTES) != 0)
+			errx(1, "invalid manifest: %s", sigfile);
+		*(nl - hexlen - strlen(sep)) = '\0';
+		file->name = line + strlen(prefix);
+	}
+
+	int failed = 0;
+	if (nnames) {
+		/*
+		 * only the named files, which must all be listed. the chosen
+		 * ones move to the front, and a name given twice finds its
+		 * file already there.
+		 */
+		size_t n = 0;
+		for (int i = 0; i < nnames; i++) {
+			size_t j;
+			for (j = 0; j < count; j++)
+				if (strcmp(files[j].name, names[i]) == 0)
+					break;
+			if (j == count) {
+				warnx("%s: not in manifest", names[i]);
+				failed = 1;
+				continue;
+			}
+			if (j < n)
+				continue;
+			struct manifestfile tmp = files[n];
+			files[n++] = files[j];
+			files[j] = tmp;
+		}
+		count = n;
+	}
+
+	hashfiles(files, count);
+	for (size_t i = 0; i < count; i++) {
+		if (files[i].failed) {
+			warnx("%s: unable to read", files[i].name);
+			failed = 1;
+		} else if (sodium_memcmp(files[i].hash, files[i].want,
+		    MANIFESTHASHBYTES) != 0) {
+			warnx("%s: hash mismatch", files[i].name);
+			failed = 1;
+		} else if (!quiet) {
+			printf("%s: OK\n", files[i].name);
+		}
+	}
+	free(files);
+	freeall(msgdata, msgdatalen, mapped);
+	if (failed)
+		exit(1);
+}
+
+/*
+ * write an reop encrypted message header, up to the start of the data.
+ * binary messages have the magic, header and ident.
+ * otherwise the header is base64 encoded between guard lines.
+ */
+static void
+writeencheader(struct outbuf *out, const char *filename, const void *hdr,
+    size_t hdrlen, const char *ident, opt_binary binary)
+{
+	outopen(out, filename, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
+	if (binary.v) {
+		uint32_t identlen = strlen(ident);
+		identlen = htonl(identlen);
+
+		outwrite(out, REOP_BINARY, 4);
+		outwrite(out, hdr, hdrlen);
+		outwrite(out, &identlen, sizeof(identlen));
+		outwrite(out, ident, strlen(ident));
+	} else {
+		char header[1024];
+
+		snprintf(header, sizeof(header), "-----BEGIN REOP ENCRYPTED MESSAGE-----\n");
+		outwrite(out, header, strlen(header));
+		snprintf(header, sizeof(header), "ident:%s\n", ident);
+		outwrite(out, header, strlen(header));
+		writeb64data(out, hdr, hdrlen);
+		snprintf(header, sizeof(header), "-----BEGIN REOP ENCRYPTED MESSAGE DATA-----\n");
+		outwrite(out, header, strlen(header));
+	}
+}
+
+static void
+writeencfooter(struct outbuf *out, opt_binary binary)
+{
+	if (!binary.v) {
+		const char *endmsg = "-----END REOP ENCRYPTED MESSAGE-----\n";
+		outwrite(out, endmsg, strlen(endmsg));
 	}
+	outclose(out);
 }
 
 /*
- * can really write any kind of data, but we're usually interested in line
- * wrapping for base64 encoded blocks
+ * write an reop encrypted message header, followed by the data
  */
 static void
-writeb64data(int fd, const char *filename, char *b64)
+writeencfile(const char *filename, const void *hdr,
+    size_t hdrlen, const char *ident, uint8_t *msg, uint64_t msglen,
+    opt_binary binary)
 {
-	size_t rem = strlen(b64);
-	size_t pos = 0;
-	while (rem > 0) {
-		size_t amt = rem > 76 ? 76 : rem;
-		writeall(fd, b64 + pos, amt, filename);
-		writeall(fd, "\n", 1, filename);
-		pos += amt;
-		rem -= amt;
-	}
+	struct outbuf out;
+
+	writeencheader(&out, filename, hdr, hdrlen, ident, binary);
+	if (binary.v)
+		outwrite(&out, msg, msglen);
+	else
+		writeb64data(&out, msg, msglen);
+	writeencfooter(&out, binary);
 }
 
+/*
+ * encrypt a file using public key cryptography
+ * an ephemeral key is used to make the encryption one way
+ * that key is then encrypted with our seckey to provide authentication
+ */
 static void
-generate(const char *pubkeyfile, const char *seckeyfile, const char *ident,
-    const char *password)
+pubencrypt(const char *pubkeyfile, const char *ident, const char *seckeyfile,
+    const char *msgfile, const char *encfile, opt_binary binary)
 {
-	struct reop_keypair keypair = reop_generate(ident);
+	uint64_t msglen;
+	uint8_t *msg;
+	int mapped;
+	mapallorfail(msgfile, encfile, &msg, &msglen, &mapped);
 
-	char secnamebuf[1024];
-	if (!seckeyfile && gethomefile("seckey", secnamebuf, sizeof(secnamebuf)) == 0)
-		seckeyfile = secnamebuf;
-	if (!seckeyfile)
-		errx(1, "no seckeyfile");
+	const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, ident);
+	if (!pubkey)
+		errx(1, "no pubkey");
+	const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
 
-	int fd = xopenorfail(seckeyfile, O_CREAT|O_EXCL|O_NOFOLLOW|O_WRONLY, 0600);
-	const char *keydata = reop_encodeseckey(keypair.seckey, password);
-	writeall(fd, keydata, strlen(keydata), seckeyfile);
-	reop_freestr(keydata);
-	close(fd);
+	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
+		errx(1, "unsupported key format");
+	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
+		errx(1, "unsupported key format");
 
+	const struct reop_encmsg *encmsg = reop_pubencrypt(pubkey, seckey, msg, msglen);
+	reop_freeseckey(seckey);
+	reop_freepubkey(pubkey);
 
-	char pubnamebuf[1024];
-	if (!pubkeyfile && gethomefile("pubkey", pubnamebuf, sizeof(pubnamebuf)) == 0)
-		pubkeyfile = pubnamebuf;
-	if (!pubkeyfile)
-		errx(1, "no pubkeyfile");
+	writeencfile(encfile, encmsg, encmsgsize, encmsg->ident, msg, msglen, binary);
 
-	fd = xopenorfail(pubkeyfile, O_CREAT|O_EXCL|O_NOFOLLOW|O_WRONLY, 0666);
-	keydata = reop_encodepubkey(keypair.pubkey);
-	writeall(fd, keydata, strlen(keydata), pubkeyfile);
-	reop_freestr(keydata);
-	close(fd);
+	reop_freeencmsg(encmsg);
 
-	reop_freepubkey(keypair.pubkey);
-	reop_freeseckey(keypair.seckey);
+	freeall(msg, msglen, mapped);
 }
 
 /*
- * write a combined message and signature
+ * encrypt a file using public key cryptography
+ * old version 1.0 variant
  */
 static void
-writesignedmsg(const char *filename, const struct reop_sig *sig,
-    const char *ident, const uint8_t *msg, uint64_t msglen)
+v1pubencrypt(const char *pubkeyfile, const char *ident, const char *seckeyfile,
+    const char *msgfile, const char *encfile, opt_binary binary)
 {
-	char header[1024];
-	char b64[1024];
+	struct oldencmsg oldencmsg;
 
-	int fd = xopenorfail(filename, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
-	snprintf(header, sizeof(header), "-----BEGIN REOP SIGNED MESSAGE-----\n");
-	writeall(fd, header, strlen(header), filename);
-	writeall(fd, msg, msglen, filename);
+	const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, ident);
+	if (!pubkey)
+		errx(1, "no pubkey");
+	const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
 
-	snprintf(header, sizeof(header), "-----BEGIN REOP SIGNATURE-----\n"
-	    "ident:%s\n", ident);
-	writeall(fd, header, strlen(header), filename);
-	if (reopb64_ntop((void *)sig, sigsize, b64, sizeof(b64)) == -1)
-		errx(1, "b64 encode failed");
-	writeb64data(fd, filename, b64);
-	sodium_memzero(b64, sizeof(b64));
-	snprintf(header, sizeof(header), "-----END REOP SIGNED MESSAGE-----\n");
-	writeall(fd, header, strlen(header), filename);
-	close(fd);
+	uint64_t msglen;
+	uint8_t *msg;
+	int mapped;
+	mapallorfail(msgfile, encfile, &msg, &msglen, &mapped);
+
+	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
+		errx(1, "unsupported key format");
+	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
+		errx(1, "unsupported key format");
+	memcpy(oldencmsg.encalg, OLDENCALG, 2);
+	memcpy(oldencmsg.pubrandomid, pubkey->randomid, RANDOMIDLEN);
+	memcpy(oldencmsg.secrandomid, seckey->randomid, RANDOMIDLEN);
+	if (seckeybox(seckey, pubkey->enckey, msg, msglen, oldencmsg.nonce,
+	    oldencmsg.tag) != 0)
+		errx(1, "agent failed to encrypt");
+
+	writeencfile(encfile, &oldencmsg, sizeof(oldencmsg), seckey->ident, msg, msglen, binary);
+
+	reop_freeseckey(seckey);
+	reop_freepubkey(pubkey);
+
+	freeall(msg, msglen, mapped);
 }
 
-/*
- * sign a file
- */
 static void
-signfile(const char *seckeyfile, const char *msgfile, const char *sigfile,
-    int embedded)
+symencrypt(const char *msgfile, const char *encfile, opt_binary binary)
 {
 	uint64_t msglen;
 	uint8_t *msg;
-	readallorfail(msgfile, &msg, &msglen);
-
-	const struct reop_seckey *seckey = reop_getseckey(seckeyfile, NULL);
-	if (!seckey)
-		errx(1, "no seckey");
+	int mapped;
+	mapallorfail(msgfile, encfile, &msg, &msglen, &mapped);
 
-	const struct reop_sig *sig = reop_sign(seckey, msg, msglen);
+	const struct reop_symmsg *symmsg = reop_ctx_symencrypt(reopctx, msg, msglen, NULL, 0);
+	if (!symmsg)
+		errx(1, "%s", reop_ctx_error(reopctx));
 
-	reop_freeseckey(seckey);
+	writeencfile(encfile, symmsg, symmsgsize, "<symmetric>", msg, msglen, binary);
 
-	if (embedded)
-		writesignedmsg(sigfile, sig, sig->ident, msg, msglen);
-	else {
-		int fd = xopenorfail(sigfile, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
-		const char *sigdata = reop_encodesig(sig);
-		writeall(fd, sigdata, strlen(sigdata), sigfile);
-		reop_freestr(sigdata);
-		close(fd);
-	}
+	reop_freesymmsg(symmsg);
 
-	reop_freesig(sig);
-	xfree(msg, msglen);
+	freeall(msg, msglen, mapped);
 }
 
 /*
- * read signature file
+ * chunked messages are read and processed a group of chunks at a time,
+ * enough to keep every cpu busy
  */
-static const struct reop_sig *
-readsigfile(const char *sigfile)
+static size_t
+chunkgroup(void)
 {
-	uint64_t sigdatalen;
-	uint8_t *sigdata;
-	readall(sigfile, &sigdata, &sigdatalen);
-	if (!sigdata)
-		errx(1, "could not read %s", sigfile);
-	const struct reop_sig *sig = reop_parsesig(sigdata);
-	xfree(sigdata, sigdatalen);
-	return sig;
+	return 4 * cpucount(64) * (size_t)CHUNKSTRIDE;
 }
 
 /*
- * simple case, detached signature
+ * write a chunked message. the file layout is the same as for other
+ * messages, except the message is a sequence of tag and chunk pairs.
  */
 static void
-verifysimple(const char *pubkeyfile, const char *msgfile, const char *sigfile,
-    int quiet)
+encryptstream(const char *msgfile, const char *encfile, struct reop_stream *stream,
+    const char *ident, opt_binary binary)
 {
-	uint64_t msglen;
-	uint8_t *msg;
-	readallorfail(msgfile, &msg, &msglen);
+	struct outbuf out;
+	struct reopb64_enc enc;
+
+	int fd = xopenorfail(msgfile, O_RDONLY | O_NOFOLLOW, 0);
+	if (isoutput(fd, encfile))
+		errx(1, "%s is both input and output", msgfile);
+	uint64_t hdrlen;
+	const uint8_t *hdr = reop_stream_header(stream, &hdrlen);
+	writeencheader(&out, encfile, hdr, hdrlen, ident, binary);
+	reopb64_enc_init(&enc);
+
+	size_t buflen = chunkgroup();
+	uint8_t *buf = xmalloc(buflen);
+	int final = 0;
+	while (!final) {
+		size_t len = 0;
+		while (len < buflen && !final) {
+			size_t amt = readchunk(fd, buf + len + REOP_CHUNKTAGBYTES,
+			    REOP_CHUNKSIZE, msgfile);
+			final = amt < REOP_CHUNKSIZE;
+			len += REOP_CHUNKTAGBYTES + amt;
+		}
+		if (reop_stream_encrypt_chunks(stream, buf, len, final) != 0)
+			errx(1, "encrypt failed");
+		if (binary.v)
+			outwrite(&out, buf, len);
+		else
+			writeb64update(&out, &enc, buf, len);
+	}
+	if (!binary.v)
+		writeb64final(&out, &enc);
+	writeencfooter(&out, binary);
+	xfree(buf, buflen);
+	close(fd);
+}
 
-	const struct reop_sig *sig = readsigfile(sigfile);
-	const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, sig->ident);
+/*
+ * chunked public key encryption, for messages of any size
+ */
+static void
+pubencryptstream(const char *pubkeyfile, const char *ident, const char *seckeyfile,
+    const char *msgfile, const char *encfile, opt_binary binary)
+{
+	const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, ident);
 	if (!pubkey)
 		errx(1, "no pubkey");
+	const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
 
-	reop_verify_result rv = reop_verify(pubkey, msg, msglen, sig);
-	switch (rv.v) {
-	case REOP_V_OK:
-		if (!quiet)
-			printf("Signature Verified\n");
-		break;
-	case REOP_V_MISMATCH:
-		errx(1, "verification failed: checked against wrong key");
-	default:
-		errx(1, "signature verification failed");
-	}
+	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
+		errx(1, "unsupported key format");
+	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
+		errx(1, "unsupported key format");
 
-	reop_freesig(sig);
+	struct reop_stream *stream = reop_pubencrypt_init(pubkey, seckey);
+	if (!stream)
+		errx(1, "encrypt failed");
+	reop_freeseckey(seckey);
 	reop_freepubkey(pubkey);
-	xfree(msg, msglen);
+
+	encryptstream(msgfile, encfile, stream, stream->hdr.encmsg.ident, binary);
+
+	reop_freestream(stream);
 }
 
 /*
- * message followed by signature in one file
+ * chunked public key encryption to many recipients, named by pubkey file
+ * or ident. the message is only encrypted once.
  */
 static void
-verifyembedded(const char *pubkeyfile, const char *sigfile, int quiet)
+multiencryptstream(const char **pubkeyfiles, int npubkeyfiles, const char **idents,
+    int nidents, const char *seckeyfile, const char *msgfile, const char *encfile,
+    opt_binary binary)
 {
-	const char *beginmsg = "-----BEGIN REOP SIGNED MESSAGE-----\n";
-	const char *beginsig = "-----BEGIN REOP SIGNATURE-----\n";
-
-	uint64_t msgdatalen;
-	uint8_t *msgdata;
-	readallorfail(sigfile, &msgdata, &msgdatalen);
-
-	if (strncmp(msgdata, beginmsg, strlen(beginmsg)) != 0)
- 		goto fail;
-	char *msg = msgdata + 36;
-	char *sigdata, *nextsig;
-	if (!(sigdata = strstr(msg, beginsig)))
- 		goto fail;
-	while ((nextsig = strstr(sigdata + 1, beginsig)))
-		sigdata = nextsig;
-	uint64_t msglen = sigdata - msg;
-
-	const struct reop_sig *sig = reop_parsesig(sigdata);
-	const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, sig->ident);
-	if (!pubkey)
-		errx(1, "no pubkey");
+	const struct reop_pubkey *pubkeys[REOP_MAXRECIPIENTS];
+	int npubkeys = 0;
 
-	reop_verify_result rv = reop_verify(pubkey, (uint8_t *)msg, msglen, sig);
-	switch (rv.v) {
-	case REOP_V_OK:
-		if (!quiet)
-			printf("Signature Verified\n");
-		break;
-	case REOP_V_MISMATCH:
-		errx(1, "verification failed: checked against wrong key");
-	default:
-		errx(1, "signature verification failed");
+	for (int i = 0; i < npubkeyfiles + nidents; i++) {
+		const struct reop_pubkey *pubkey;
+		if (i < npubkeyfiles)
+			pubkey = reop_getpubkey(pubkeyfiles[i], NULL);
+		else
+			pubkey = reop_getpubkey(NULL, idents[i - npubkeyfiles]);
+		if (!pubkey)
+			errx(1, "no pubkey for %s", i < npubkeyfiles ?
+			    pubkeyfiles[i] : idents[i - npubkeyfiles]);
+		if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
+			errx(1, "unsupported key format");
+		pubkeys[npubkeys++] = pubkey;
 	}
+	const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
+	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
+		errx(1, "unsupported key format");
 
-	reop_freesig(sig);
-	reop_freepubkey(pubkey);
-	xfree(msgdata, msgdatalen);
+	struct reop_stream *stream = reop_pubencrypt_multi_init(pubkeys, npubkeys,
+	    seckey);
+	if (!stream)
+		errx(1, "encrypt failed");
+	char ident[IDENTLEN];
+	strlcpy(ident, seckey->ident, sizeof(ident));
+	reop_freeseckey(seckey);
+	for (int i = 0; i < npubkeys; i++)
+		reop_freepubkey(pubkeys[i]);
 
-	return;
-fail:
-	errx(1, "invalid signature: %s", sigfile);
+	encryptstream(msgfile, encfile, stream, ident, binary);
+
+	reop_freestream(stream);
 }
 
 /*
- * write an reop encrypted message header, followed by base64 data
+ * chunked symmetric encryption, for messages of any size
  */
 static void
-writeencfile(const char *filename, const void *hdr,
-    size_t hdrlen, const char *ident, uint8_t *msg, uint64_t msglen,
-    opt_binary binary)
+symencryptstream(const char *msgfile, const char *encfile, opt_binary binary)
 {
-	if (binary.v) {
-		uint32_t identlen = strlen(ident);
-		identlen = htonl(identlen);
+	struct reop_stream *stream = reop_ctx_symencrypt_init(reopctx, NULL, 0);
+	if (!stream)
+		errx(1, "%s", reop_ctx_error(reopctx));
 
-		int fd = xopenorfail(filename, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
+	encryptstream(msgfile, encfile, stream, "<symmetric>", binary);
 
-		writeall(fd, REOP_BINARY, 4, filename);
-		writeall(fd, hdr, hdrlen, filename);
-		writeall(fd, &identlen, sizeof(identlen), filename);
-		writeall(fd, ident, strlen(ident), filename);
-		writeall(fd, msg, msglen, filename);
-		close(fd);
-	} else {
-		char header[1024];
-		char b64[1024];
+	reop_freestream(stream);
+}
 
-		size_t b64len = (msglen + 2) / 3 * 4 + 1;
-		char *b64data = xmalloc(b64len);
-		if (reopb64_ntop(msg, msglen, b64data, b64len) == -1)
-			errx(1, "b64 encode failed");
+/*
+ * buffered input for encrypted messages.
+ * armored messages are base64 decoded as they are read, up to the end
+ * guard, so they can be streamed just like binary messages.
+ */
+#define INBUFSIZE (64 * 1024)
 
-		int fd = xopenorfail(filename, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
-		snprintf(header, sizeof(header), "-----BEGIN REOP ENCRYPTED MESSAGE-----\n");
-		writeall(fd, header, strlen(header), filename);
-		snprintf(header, sizeof(header), "ident:%s\n", ident);
-		writeall(fd, header, strlen(header), filename);
-		if (reopb64_ntop(hdr, hdrlen, b64, sizeof(b64)) == -1)
-			errx(1, "b64 encode failed");
-		writeb64data(fd, filename, b64);
-		sodium_memzero(b64, sizeof(b64));
+struct inbuf {
+	int fd;
+	const char *filename;
+	uint8_t *buf;
+	size_t pos;
+	size_t len;
+	int armored;
+	struct reopb64_dec dec;
+	uint8_t *dbuf;
+	size_t dpos;
+	size_t dlen;
+};
 
-		snprintf(header, sizeof(header), "-----BEGIN REOP ENCRYPTED MESSAGE DATA-----\n");
-		writeall(fd, header, strlen(header), filename);
-		writeb64data(fd, filename, b64data);
-		xfree(b64data, b64len);
+static void
+ininit(struct inbuf *in, int fd, const char *filename)
+{
+	memset(in, 0, sizeof(*in));
+	in->fd = fd;
+	in->filename = filename;
+	in->buf = xmalloc(INBUFSIZE);
+}
 
-		snprintf(header, sizeof(header), "-----END REOP ENCRYPTED MESSAGE-----\n");
-		writeall(fd, header, strlen(header), filename);
-		close(fd);
-	}
+static void
+infree(struct inbuf *in)
+{
+	xfree(in->buf, INBUFSIZE);
+	xfree(in->dbuf, INBUFSIZE);
 }
 
 /*
- * encrypt a file using public key cryptography
- * an ephemeral key is used to make the encryption one way
- * that key is then encrypted with our seckey to provide authentication
+ * try to have at least want bytes buffered. returns the amount available.
  */
-static void
-pubencrypt(const char *pubkeyfile, const char *ident, const char *seckeyfile,
-    const char *msgfile, const char *encfile, opt_binary binary)
+static size_t
+infill(struct inbuf *in, size_t want)
 {
-	uint64_t msglen;
-	uint8_t *msg;
-	readallorfail(msgfile, &msg, &msglen);
+	if (in->len - in->pos >= want)
+		return in->len - in->pos;
+	memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+	in->len -= in->pos;
+	in->pos = 0;
+	in->len += readchunk(in->fd, in->buf + in->len, INBUFSIZE - in->len,
+	    in->filename);
+	return in->len;
+}
 
-	const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, ident);
-	if (!pubkey)
-		errx(1, "no pubkey");
-	const struct reop_seckey *seckey = reop_getseckey(seckeyfile, NULL);
-	if (!seckey)
-		errx(1, "no seckey");
+/*
+ * read a line, including the newline, and nul terminate it
+ */
+static char *
+ingetline(struct inbuf *in, char *line, size_t linelen)
+{
+	size_t avail = infill(in, 1);
+	uint8_t *nl;
+	while (!(nl = memchr(in->buf + in->pos, '\n', avail))) {
+		if (avail >= linelen || infill(in, avail + 1) == avail)
+			return NULL;
+		avail = in->len - in->pos;
+	}
+	size_t amt = nl - (in->buf + in->pos) + 1;
+	if (amt >= linelen)
+		return NULL;
+	memcpy(line, in->buf + in->pos, amt);
+	line[amt] = '\0';
+	in->pos += amt;
+	return line;
+}
 
-	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
-		errx(1, "unsupported key format");
-	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
-		errx(1, "unsupported key format");
+/*
+ * switch to decoding base64 data, until the end guard
+ */
+static void
+inarmor(struct inbuf *in)
+{
+	in->armored = 1;
+	reopb64_dec_init(&in->dec);
+	in->dbuf = xmalloc(INBUFSIZE);
+}
 
-	const struct reop_encmsg *encmsg = reop_pubencrypt(pubkey, seckey, msg, msglen);
-	reop_freeseckey(seckey);
-	reop_freepubkey(pubkey);
+static const char endmsg[] = "-----END REOP ENCRYPTED MESSAGE-----\n";
 
-	writeencfile(encfile, encmsg, encmsgsize, encmsg->ident, msg, msglen, binary);
+/*
+ * decode some more base64 data into dbuf
+ */
+static void
+indecode(struct inbuf *in)
+{
+	size_t avail = infill(in, 1);
+	if (avail == 0)
+		errx(1, "invalid encrypted message: %s", in->filename);
+	if (avail > INBUFSIZE / 4 * 3)
+		avail = INBUFSIZE / 4 * 3;
+	size_t used;
+	uint64_t t = tracestart();
+	int amt = reopb64_dec_update(&in->dec, (char *)in->buf + in->pos, avail,
+	    in->dbuf, INBUFSIZE, &used);
+	traceend("b64decode", t, amt == -1 ? 0 : amt);
+	if (amt == -1)
+		errx(1, "invalid encrypted message: %s", in->filename);
+	in->pos += used;
+	in->dpos = 0;
+	in->dlen = amt;
+	if (in->dec.done) {
+		if (infill(in, strlen(endmsg)) < strlen(endmsg) ||
+		    memcmp(in->buf + in->pos, endmsg, strlen(endmsg)) != 0 ||
+		    reopb64_dec_final(&in->dec) == -1)
+			errx(1, "invalid encrypted message: %s", in->filename);
+	}
+}
 
-	reop_freeencmsg(encmsg);
+/*
+ * read message data, which may be short only at the end
+ */
+static size_t
+inread(struct inbuf *in, uint8_t *buf, size_t buflen)
+{
+	size_t have = 0;
+
+	if (!in->armored) {
+		have = in->len - in->pos;
+		if (have > buflen)
+			have = buflen;
+		memcpy(buf, in->buf + in->pos, have);
+		in->pos += have;
+		return have + readchunk(in->fd, buf + have, buflen - have, in->filename);
+	}
+	while (have < buflen) {
+		if (in->dpos == in->dlen) {
+			if (in->dec.done)
+				break;
+			indecode(in);
+			continue;
+		}
+		size_t amt = in->dlen - in->dpos;
+		if (amt > buflen - have)
+			amt = buflen - have;
+		memcpy(buf + have, in->dbuf + in->dpos, amt);
+		in->dpos += amt;
+		have += amt;
+	}
+	return have;
+}
 
-	xfree(msg, msglen);
+/*
+ * after the message, only the end guard, if armored, may be left
+ */
+static int
+inatend(struct inbuf *in)
+{
+	if (in->armored) {
+		if (!in->dec.done || in->dpos != in->dlen)
+			return 0;
+		in->pos += strlen(endmsg);
+	}
+	return infill(in, 1) == 0;
 }
 
 /*
- * encrypt a file using public key cryptography
- * old version 1.0 variant
+ * decrypt a byte range of a binary chunked message. in is positioned at
+ * the first chunk. the file is mapped, so only the chunks in the range
+ * are read, and the range is decrypted a group of chunks at a time.
  */
 static void
-v1pubencrypt(const char *pubkeyfile, const char *ident, const char *seckeyfile,
-    const char *msgfile, const char *encfile, opt_binary binary)
+decryptrange(struct reop_stream *stream, struct inbuf *in,
+    const struct byterange *range, struct outbuf *out)
 {
-	struct oldencmsg oldencmsg;
-
-	const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, ident);
-	if (!pubkey)
-		errx(1, "no pubkey");
-	const struct reop_seckey *seckey = reop_getseckey(seckeyfile, NULL);
-	if (!seckey)
-		errx(1, "no seckey");
+	struct stat sb;
+	off_t pos;
+
+	if (in->armored || (pos = lseek(in->fd, 0, SEEK_CUR)) == -1 ||
+	    fstat(in->fd, &sb) == -1 || !S_ISREG(sb.st_mode))
+		errx(1, "%s is not a seekable binary file", in->filename);
+	pos -= in->len - in->pos;
+	if (sb.st_size <= pos)
+		errx(1, "invalid encrypted message: %s", in->filename);
+	uint8_t *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, in->fd, 0);
+	if (map == MAP_FAILED)
+		err(1, "mmap %s", in->filename);
+	const uint8_t *chunks = map + pos;
+	uint64_t chunkslen = sb.st_size - pos;
 
 	uint64_t msglen;
-	uint8_t *msg;
-	readallorfail(msgfile, &msg, &msglen);
+	if (reop_stream_msglen(chunkslen, &msglen) != 0)
+		errx(1, "invalid encrypted message: %s", in->filename);
+	if (range->off > msglen || range->len > msglen - range->off)
+		errx(1, "range is past the end of the message");
+
+	size_t buflen = chunkgroup() / CHUNKSTRIDE * REOP_CHUNKSIZE;
+	uint8_t *buf = xmalloc(buflen);
+	for (uint64_t done = 0; done < range->len; ) {
+		size_t amt = range->len - done < buflen ? range->len - done : buflen;
+		reop_decrypt_result rv = reop_stream_decrypt_range(stream, chunks,
+		    chunkslen, range->off + done, amt, buf);
+		if (rv.v != REOP_D_OK)
+			errx(1, "decryption failed");
+		outwrite(out, buf, amt);
+		done += amt;
+	}
+	xfree(buf, buflen);
+	munmap(map, sb.st_size);
+}
 
-	if (memcmp(pubkey->encalg, ENCKEYALG, 2) != 0)
-		errx(1, "unsupported key format");
-	if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
-		errx(1, "unsupported key format");
-	memcpy(oldencmsg.encalg, OLDENCALG, 2);
-	memcpy(oldencmsg.pubrandomid, pubkey->randomid, RANDOMIDLEN);
-	memcpy(oldencmsg.secrandomid, seckey->randomid, RANDOMIDLEN);
-	pubencryptraw(msg, msglen, oldencmsg.nonce, oldencmsg.tag, pubkey->enckey,
-	    seckey->enckey);
+/*
+ * decrypt a chunked message, given its header
+ */
+static void
+decryptchunks(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
+    const char *ident, const uint8_t *hdr, size_t hdrsize, struct inbuf *in,
+    const struct byterange *range)
+{
+	struct reop_stream *stream;
+	reop_decrypt_result rv;
 
-	writeencfile(encfile, &oldencmsg, sizeof(oldencmsg), seckey->ident, msg, msglen, binary);
+	/* chunks are written as they are read, so they can't go back over */
+	if (isoutput(in->fd, msgfile))
+		errx(1, "%s is both input and output", in->filename);
 
-	reop_freeseckey(seckey);
-	reop_freepubkey(pubkey);
+	if (memcmp(hdr, SYMCHUNKALG, 2) == 0) {
+		rv = reop_ctx_symdecrypt_init(reopctx, &stream, hdr, hdrsize, NULL);
+		if (rv.v == REOP_D_FAIL)
+			errx(1, "%s", reop_ctx_error(reopctx));
+	} else {
+		const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, ident);
+		if (!pubkey)
+			errx(1, "no pubkey");
+		const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
+		rv = reop_pubdecrypt_init(&stream, hdr, hdrsize, pubkey, seckey);
+		reop_freeseckey(seckey);
+		reop_freepubkey(pubkey);
+	}
+	switch (rv.v) {
+	case REOP_D_OK:
+		break;
+	case REOP_D_MISMATCH:
+		errx(1, "key mismatch");
+		break;
+	case REOP_D_INVALID:
+		errx(1, "unsupported key format");
+		break;
+	default:
+		errx(1, "decryption failed");
+		break;
+	}
 
-	xfree(msg, msglen);
+	struct outbuf out;
+	outopen(&out, msgfile, O_CREAT|O_TRUNC|O_NOFOLLOW|O_WRONLY, 0666);
+	if (range) {
+		decryptrange(stream, in, range, &out);
+		outclose(&out);
+		reop_freestream(stream);
+		return;
+	}
+	size_t buflen = chunkgroup();
+	uint8_t *buf = xmalloc(buflen);
+	int final = 0;
+	while (!final) {
+		size_t len = inread(in, buf, buflen);
+		final = len < buflen;
+		rv = reop_stream_decrypt_chunks(stream, buf, len, final);
+		if (rv.v == REOP_D_INVALID)
+			errx(1, "invalid encrypted message: %s", in->filename);
+		if (rv.v != REOP_D_OK)
+			errx(1, "decryption failed");
+		for (size_t off = 0; off < len; off += CHUNKSTRIDE) {
+			size_t amt = len - off < CHUNKSTRIDE ? len - off : CHUNKSTRIDE;
+			outwrite(&out, buf + off + REOP_CHUNKTAGBYTES,
+			    amt - REOP_CHUNKTAGBYTES);
+		}
+	}
+	if (!inatend(in))
+		errx(1, "invalid encrypted message: %s", in->filename);
+	xfree(buf, buflen);
+	outclose(&out);
+	reop_freestream(stream);
 }
 
+/*
+ * decrypt a binary chunked message. in is positioned after the magic.
+ */
 static void
-symencrypt(const char *msgfile, const char *encfile, opt_binary binary)
+decryptstream(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
+    const char *encfile, struct inbuf *in, const struct byterange *range)
 {
-	uint64_t msglen;
-	uint8_t *msg;
-	readallorfail(msgfile, &msg, &msglen);
+	char ident[IDENTLEN];
+	union {
+		uint8_t alg[2];
+		struct symchunkmsg symmsg;
+		struct encchunkmsg encmsg;
+	} hdr;
+	size_t hdrsize;
+	uint32_t identlen;
 
-	const struct reop_symmsg *symmsg = reop_symencrypt(msg, msglen, NULL);
-	if (!symmsg)
-		errx(1, "encrypt failed");
+	uint8_t *hdrbuf = hdr.alg;
 
-	writeencfile(encfile, symmsg, symmsgsize, "<symmetric>", msg, msglen, binary);
+	if (inread(in, hdr.alg, 2) != 2)
+		goto fail;
+	if (memcmp(hdr.alg, ENCMULTIALG, 2) == 0) {
+		struct encmultimsg encmsg;
+		memcpy(encmsg.encalg, hdr.alg, 2);
+		if (inread(in, encmsg.encalg + 2, encmultimsgsize - 2) !=
+		    encmultimsgsize - 2)
+			goto fail;
+		uint64_t nrecips = encmsg.nrecipients[0] << 8 | encmsg.nrecipients[1];
+		if (nrecips > REOP_MAXRECIPIENTS)
+			goto fail;
+		hdrsize = encmultimsgsize + nrecips * sizeof(struct encrecipient);
+		hdrbuf = xmalloc(hdrsize);
+		memcpy(hdrbuf, &encmsg, encmultimsgsize);
+		if (inread(in, hdrbuf + encmultimsgsize, hdrsize - encmultimsgsize) !=
+		    hdrsize - encmultimsgsize)
+			goto fail;
+	} else {
+		if (memcmp(hdr.alg, SYMCHUNKALG, 2) == 0)
+			hdrsize = symchunkmsgsize;
+		else
+			hdrsize = encchunkmsgsize;
+		if (inread(in, hdr.alg + 2, hdrsize - 2) != hdrsize - 2)
+			goto fail;
+	}
+	if (inread(in, (uint8_t *)&identlen, sizeof(identlen)) != sizeof(identlen))
+		goto fail;
+	identlen = ntohl(identlen);
+	if (identlen >= sizeof(ident))
+		goto fail;
+	if (inread(in, (uint8_t *)ident, identlen) != identlen)
+		goto fail;
+	ident[identlen] = '\0';
 
-	reop_freesymmsg(symmsg);
+	decryptchunks(pubkeyfile, seckeyfile, msgfile, ident, hdrbuf, hdrsize, in,
+	    range);
+	if (hdrbuf != hdr.alg)
+		free(hdrbuf);
+	return;
 
-	xfree(msg, msglen);
+fail:
+	errx(1, "invalid encrypted message: %s", encfile);
 }
 
 /*
- * decrypt a file, either public key or symmetric based on header
+ * decrypt a file, either public key or symmetric based on header.
+ * only binary chunked messages can be decrypted in part.
  */
 static void
 decrypt(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
-    const char *encfile)
+    const char *encfile, const struct byterange *range)
 {
 	char ident[IDENTLEN];
 	uint8_t *msg;
@@ -1404,14 +5167,50 @@ decrypt(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
 		struct reop_encmsg encmsg;
 		struct oldencmsg oldencmsg;
 		struct oldekcmsg oldekcmsg;
+		struct symchunkmsg symchunkmsg;
+		struct encchunkmsg encchunkmsg;
 	} hdr;
 	int hdrsize;
 
-	uint64_t encdatalen;
-	uint8_t *encdata;
-	readallorfail(encfile, &encdata, &encdatalen);
+	uint64_t encdatalen = 0;
+	uint8_t *encdata = NULL;
+	int mapped = 0;
+
+	/* peek at the start to see what kind of message this is */
+	struct inbuf in;
+	int encfd = xopenorfail(encfile, O_RDONLY | O_NOFOLLOW, 0);
+	ininit(&in, encfd, encfile);
+	infill(&in, 6);
+	if (in.len >= 6 && memcmp(in.buf, REOP_BINARY, 4) == 0 &&
+	    (memcmp(in.buf + 4, SYMCHUNKALG, 2) == 0 ||
+	    memcmp(in.buf + 4, ENCCHUNKALG, 2) == 0 ||
+	    memcmp(in.buf + 4, ENCMULTIALG, 2) == 0)) {
+		in.pos = 4;
+		decryptstream(pubkeyfile, seckeyfile, msgfile, encfile, &in, range);
+		infree(&in);
+		close(encfd);
+		return;
+	}
+	if (range)
+		errx(1, "%s is not a binary chunked message", encfile);
+	if (in.len >= 6 && memcmp(in.buf, REOP_BINARY, 4) == 0) {
+		/* binary messages are decrypted in place */
+		int rv = isoutput(encfd, msgfile) ? -1 :
+		    mapfd(encfd, &encdata, &encdatalen);
+		mapped = rv == 0;
+		if (rv == -1)
+			rv = readallfd(encfd, in.buf, in.len, &encdata, &encdatalen);
+		switch (rv) {
+		case 0:
+			break;
+		case -2:
+			errx(1, "%s is too large", encfile);
+			break;
+		default:
+			errx(1, "could not read %s", encfile);
+			break;
+		}
 
-	if (encdatalen >= 6 && memcmp(encdata, REOP_BINARY, 4) == 0) {
 		uint8_t *ptr = encdata + 4;
 		uint8_t *endptr = encdata + encdatalen;
 		uint32_t identlen;
@@ -1458,43 +5257,89 @@ decrypt(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
 		msg = ptr;
 		msglen = endptr - ptr;
 	} else {
-		char *begin, *end;
 		const char *beginmsg = "-----BEGIN REOP ENCRYPTED MESSAGE-----\n";
 		const char *begindata = "-----BEGIN REOP ENCRYPTED MESSAGE DATA-----\n";
-		const char *endmsg = "-----END REOP ENCRYPTED MESSAGE-----\n";
-
-		if (strncmp(encdata, beginmsg, strlen(beginmsg)) != 0)
+		char line[1024];
+		/* big enough for a header with the most recipients */
+		size_t b64size = (encmultimsgsize + REOP_MAXRECIPIENTS *
+		    sizeof(struct encrecipient)) / 3 * 4 + 1024;
+		char *b64 = xmalloc(b64size);
+		size_t b64len = 0;
+
+		if (!ingetline(&in, line, sizeof(line)) || strcmp(line, beginmsg) != 0)
 			goto fail;
-		begin = readident(encdata + strlen(beginmsg), ident);
-		if (!(end = strstr(begin, begindata)))
+		if (!ingetline(&in, line, sizeof(line)))
 			goto fail;
-		*end = 0;
-		if ((hdrsize = reopb64_pton(begin, (void *)&hdr, sizeof(hdr))) == -1)
+		if (!readident(reopctx, line, ident))
+			errx(1, "%s", reop_ctx_error(reopctx));
+		b64[0] = '\0';
+		while (1) {
+			if (!ingetline(&in, line, sizeof(line)))
+				goto fail;
+			if (strcmp(line, begindata) == 0)
+				break;
+			size_t linelen = strlen(line);
+			if (b64len + linelen >= b64size)
+				goto fail;
+			memcpy(b64 + b64len, line, linelen + 1);
+			b64len += linelen;
+		}
+		uint8_t *hdrbuf = xmalloc(b64len / 4 * 3 + 3);
+		hdrsize = reopb64_pton(b64, hdrbuf, b64len / 4 * 3 + 3);
+		free(b64);
+		if (hdrsize < 2)
 			goto fail;
-		begin = end + strlen(begindata);
-		if (!(end = strstr(begin, endmsg)))
+		inarmor(&in);
+
+		if (memcmp(hdrbuf, SYMCHUNKALG, 2) == 0 ||
+		    memcmp(hdrbuf, ENCCHUNKALG, 2) == 0 ||
+		    memcmp(hdrbuf, ENCMULTIALG, 2) == 0) {
+			decryptchunks(pubkeyfile, seckeyfile, msgfile, ident, hdrbuf,
+			    hdrsize, &in, NULL);
+			free(hdrbuf);
+			infree(&in);
+			close(encfd);
+			return;
+		}
+		if (hdrsize > sizeof(hdr))
 			goto fail;
-		*end = 0;
+		memcpy(&hdr, hdrbuf, hdrsize);
+		free(hdrbuf);
 
-		msglen = (strlen(begin) + 3) / 4 * 3 + 1;
-		msg = xmalloc(msglen);
-		msglen = reopb64_pton(begin, msg, msglen);
-		if (msglen == -1)
-			goto fail;
-		xfree(encdata, encdatalen);
-		encdata = NULL;
+		/* everything else must be decoded into memory */
+		uint64_t space = 64 * 1024;
+		msg = xmalloc(space);
+		msglen = 0;
+		while (1) {
+			if (msglen == space) {
+				if (space * 2 > maxmsgsize)
+					errx(1, "%s is too large", encfile);
+				uint8_t *newmsg = xmalloc(space * 2);
+				memcpy(newmsg, msg, msglen);
+				xfree(msg, space);
+				msg = newmsg;
+				space *= 2;
+			}
+			size_t amt = inread(&in, msg + msglen, space - msglen);
+			if (amt == 0)
+				break;
+			msglen += amt;
+		}
 	}
+	infree(&in);
+	close(encfd);
 
 	if (memcmp(hdr.alg, SYMALG, 2) == 0) {
 		if (hdrsize != symmsgsize)
 			goto fail;
 
-		reop_decrypt_result rv = reop_symdecrypt(&hdr.symmsg, NULL, msg, msglen);
+		reop_decrypt_result rv = reop_ctx_symdecrypt(reopctx, &hdr.symmsg, NULL,
+		    msg, msglen);
 		switch (rv.v) {
 		case REOP_D_OK:
 			break;
 		case REOP_D_FAIL:
-			errx(1, "sym decryption failed");
+			errx(1, "%s", reop_ctx_error(reopctx));
 			break;
 		case REOP_D_INVALID:
 			errx(1, "unsupported key format");
@@ -1510,9 +5355,7 @@ decrypt(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
 		const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, ident);
 		if (!pubkey)
 			errx(1, "no pubkey");
-		const struct reop_seckey *seckey = reop_getseckey(seckeyfile, NULL);
-		if (!seckey)
-			errx(1, "no seckey");
+		const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
 
 		reop_decrypt_result rv = reop_pubdecrypt(&hdr.encmsg, pubkey, seckey, msg, msglen);
 		switch (rv.v) {
@@ -1540,9 +5383,7 @@ decrypt(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
 		const struct reop_pubkey *pubkey = reop_getpubkey(pubkeyfile, ident);
 		if (!pubkey)
 			errx(1, "no pubkey");
-		const struct reop_seckey *seckey = reop_getseckey(seckeyfile, NULL);
-		if (!seckey)
-			errx(1, "no seckey");
+		const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
 		/* pub/sec pairs work both ways */
 		if (memcmp(hdr.oldencmsg.pubrandomid, pubkey->randomid, RANDOMIDLEN) == 0) {
 			if (memcmp(hdr.oldencmsg.secrandomid, seckey->randomid, RANDOMIDLEN) != 0)
@@ -1555,8 +5396,8 @@ decrypt(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
 			errx(1, "unsupported key format");
 		if (memcmp(seckey->encalg, ENCKEYALG, 2) != 0)
 			errx(1, "unsupported key format");
-		int rv = pubdecryptraw(msg, msglen, hdr.oldencmsg.nonce, hdr.oldencmsg.tag,
-		    pubkey->enckey, seckey->enckey);
+		int rv = seckeyboxopen(seckey, pubkey->enckey, msg, msglen,
+		    hdr.oldencmsg.nonce, hdr.oldencmsg.tag);
 		if (rv != 0)
 			errx(1, "pub decryption failed");
 		reop_freeseckey(seckey);
@@ -1564,14 +5405,12 @@ decrypt(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
 	} else if (memcmp(hdr.alg, OLDEKCALG, 2) == 0) {
 		if (hdrsize != sizeof(hdr.oldekcmsg))
 			goto fail;
-		const struct reop_seckey *seckey = reop_getseckey(seckeyfile, NULL);
-		if (!seckey)
-			errx(1, "no seckey");
+		const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
 		if (memcmp(hdr.oldekcmsg.pubrandomid, seckey->randomid, RANDOMIDLEN) != 0)
 			goto fpfail;
 
-		int rv = pubdecryptraw(msg, msglen, hdr.oldekcmsg.nonce, hdr.oldekcmsg.tag,
-		    hdr.oldekcmsg.pubkey, seckey->enckey);
+		int rv = seckeyboxopen(seckey, hdr.oldekcmsg.pubkey, msg, msglen,
+		    hdr.oldekcmsg.nonce, hdr.oldekcmsg.tag);
 		if (rv != 0)
 			errx(1, "pub decryption failed");
 		reop_freeseckey(seckey);
@@ -1584,11 +5423,10 @@ decrypt(const char *pubkeyfile, const char *seckeyfile, const char *msgfile,
 	/*
 	 * if encdata is not null, it is the original data read in.
 	 * msg points into encdata (don't free).
-	 * otherwise encdata was freed when it was base64 decoded into msg.
-	 * in this case, free msg.
+	 * otherwise msg was base64 decoded from the input; free it.
 	 */
 	if (encdata)
-		xfree(encdata, encdatalen);
+		freeall(encdata, encdatalen, mapped);
 	else
 		xfree(msg, msglen);
 	return;
@@ -1605,27 +5443,358 @@ usage(const char *error)
 	if (error)
 		fprintf(stderr, "%s\n", error);
 	fprintf(stderr, "Usage:\n"
-"\treop -G [-n] [-i identity] [-p public-key-file -s secret-key-file]\n"
+"\treop -K [-k kdf] [milliseconds]\n"
+"\treop -G [-n] [-i identity] [-k kdf] [-p public-key-file -s secret-key-file]\n"
 "\treop -D [-i identity] [-p public-key-file -s secret-key-file]\n"
+"\t\t[-r offset:length] -m message-file [-x ciphertext-file]\n"
+"\treop -E [-1bc] [-i identity] [-k kdf] [-p public-key-file -s secret-key-file]\n"
 "\t\t-m message-file [-x ciphertext-file]\n"
-"\treop -E [-1b] [-i identity] [-p public-key-file -s secret-key-file]\n"
+"\treop -E [-b] -i identity | -p public-key-file ... [-s secret-key-file]\n"
 "\t\t-m message-file [-x ciphertext-file]\n"
-"\treop -S [-e] [-x signature-file] -s secret-key-file -m message-file\n"
-"\treop -V [-eq] [-x signature-file] -p public-key-file -m message-file\n"
+"\treop -S [-c | -e | -t] [-x signature-file] -s secret-key-file -m message-file\n"
+"\treop -S -M -x manifest -s secret-key-file file ...\n"
+"\treop -V [-eq] [-r offset:length] [-x signature-file] -p public-key-file\n"
+"\t\t-m message-file\n"
+"\treop -V [-q] [-p public-key-file] file ...\n"
+"\treop -V -M [-q] [-p public-key-file] -x manifest [file ...]\n"
+"\treop -Z -z agent-socket [-s secret-key-file]\n"
 	    );
 	exit(1);
 }
 
-#if 0
+/*
+ * byte ranges are offset:length
+ */
+static int
+parserange(const char *str, struct byterange *range)
+{
+	unsigned long long off, len;
+	char extra;
+
+	if (sscanf(str, "%llu:%llu%c", &off, &len, &extra) != 2)
+		return -1;
+	range->off = off;
+	range->len = len;
+	return 0;
+}
+
+/*
+ * kdf profiles: bcrypt or bcrypt:rounds, the interactive or moderate
+ * argon2id presets, or argon2id:ops:mib to tune it
+ */
+static int
+parsekdfprofile(const char *profile, enum reop_kdfalg *alg, uint32_t *ops,
+    uint32_t *memkib)
+{
+	unsigned int n, mib;
+	char extra;
+
+	*alg = REOP_KDF_ARGON2ID;
+	*memkib = 0;
+	if (strcmp(profile, "bcrypt") == 0) {
+		*alg = REOP_KDF_BCRYPT;
+		*ops = 42;
+	} else if (sscanf(profile, "bcrypt:%u%c", &n, &extra) == 1) {
+		*alg = REOP_KDF_BCRYPT;
+		*ops = n;
+	} else if (strcmp(profile, "interactive") == 0) {
+		*ops = crypto_pwhash_OPSLIMIT_INTERACTIVE;
+		*memkib = crypto_pwhash_MEMLIMIT_INTERACTIVE / 1024;
+	} else if (strcmp(profile, "moderate") == 0) {
+		*ops = crypto_pwhash_OPSLIMIT_MODERATE;
+		*memkib = crypto_pwhash_MEMLIMIT_MODERATE / 1024;
+	} else if (sscanf(profile, "argon2id:%u:%u%c", &n, &mib, &extra) == 2 &&
+	    mib < 0x4000) {
+		*ops = n;
+		*memkib = mib * 1024;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * print kdf profiles that take about millis milliseconds here
+ */
+static void
+calibrate(const char *kdfprofile, uint32_t millis)
+{
+	enum reop_kdfalg alg = REOP_KDF_ARGON2ID;
+	uint32_t ops, memkib = crypto_pwhash_MEMLIMIT_INTERACTIVE / 1024;
+
+	if (kdfprofile && parsekdfprofile(kdfprofile, &alg, &ops, &memkib) == -1)
+		usage("unknown kdf");
+	if (!kdfprofile || alg == REOP_KDF_BCRYPT) {
+		uint32_t rounds = reop_kdfcalibrate(REOP_KDF_BCRYPT, 0, millis);
+		if (rounds == 0)
+			errx(1, "unable to calibrate bcrypt");
+		printf("bcrypt:%u\n", rounds);
+	}
+	if (!kdfprofile || alg == REOP_KDF_ARGON2ID) {
+		uint32_t passes = reop_kdfcalibrate(REOP_KDF_ARGON2ID, memkib, millis);
+		if (passes == 0)
+			errx(1, "unable to calibrate argon2id");
+		printf("argon2id:%u:%u\n", passes, memkib / 1024);
+	}
+}
+
+/*
+ * the agent holds an unlocked seckey in locked memory, and answers
+ * requests on a unix socket, so the kdf only runs once.
+ * the main thread polls for requests, and a pool of worker threads
+ * does the crypto and writes the replies, so a big message from one
+ * client doesn't hold up the others.
+ */
+struct agentconn {
+	int fd;
+	int busy;			/* queued or owned by a worker */
+	int dead;
+	struct agenthdr hdr;
+	size_t hdrhave;
+	uint8_t *data;
+	size_t datahave;
+	struct agentconn *next;		/* all connections */
+	struct agentconn *qnext;	/* work queue */
+};
+
+static struct {
+	const struct reop_seckey *seckey;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct agentconn *conns;
+	struct agentconn *qhead;
+	struct agentconn **qtail;
+	int wakefds[2];
+} agent;
+
+static volatile sig_atomic_t agentdone;
+
+static void
+agentwake(void)
+{
+	int saved = errno;
+	write(agent.wakefds[1], "", 1);
+	errno = saved;
+}
+
+static void
+agentsignal(int sig)
+{
+	agentdone = 1;
+	agentwake();
+}
+
+/*
+ * read some of a request. returns 1 when it's complete, -1 on eof or error.
+ */
+static int
+agentinput(struct agentconn *conn)
+{
+	ssize_t x;
+
+	if (conn->hdrhave < sizeof(conn->hdr)) {
+		x = read(conn->fd, (uint8_t *)&conn->hdr + conn->hdrhave,
+		    sizeof(conn->hdr) - conn->hdrhave);
+		if (x <= 0)
+			return -1;
+		conn->hdrhave += x;
+		if (conn->hdrhave < sizeof(conn->hdr))
+			return 0;
+		uint32_t len = ntohl(conn->hdr.len);
+		if (len > maxmsgsize + 1024)
+			return -1;
+		if (!(conn->data = malloc(len + 1)))
+			return -1;
+		conn->datahave = 0;
+	} else {
+		x = read(conn->fd, conn->data + conn->datahave,
+		    ntohl(conn->hdr.len) - conn->datahave);
+		if (x <= 0)
+			return -1;
+		conn->datahave += x;
+	}
+	return conn->datahave == ntohl(conn->hdr.len);
+}
+
+/*
+ * Ed25519ph from the sha512 prehash, as crypto_sign_final_create would make
+ * it from the hash state. the state is libsodium's own layout, which the
+ * agent and its clients may not share, so only the hash crosses the socket.
+ */
+static void
+signprehash(const uint8_t *sigkey, const uint8_t *ph, uint8_t *sig)
+{
+	/* dom2 with the prehash flag, the nul being an empty context */
+	static const char dom[] = "SigEd25519 no Ed25519 collisions\1";
+	crypto_hash_sha512_state hs;
+	uint8_t az[64], nonce[64], hram[64], wide[64];
+	uint8_t a[32], r[32], k[32], ka[32];
+
+	crypto_hash_sha512(az, sigkey, 32);
+	az[0] &= 248;
+	az[31] &= 127;
+	az[31] |= 64;
+
+	crypto_hash_sha512_init(&hs);
+	crypto_hash_sha512_update(&hs, (const uint8_t *)dom, sizeof(dom));
+	crypto_hash_sha512_update(&hs, az + 32, 32);
+	crypto_hash_sha512_update(&hs, ph, crypto_hash_sha512_BYTES);
+	crypto_hash_sha512_final(&hs, nonce);
+	crypto_core_ed25519_scalar_reduce(r, nonce);
+	crypto_scalarmult_ed25519_base_noclamp(sig, r);
+
+	crypto_hash_sha512_init(&hs);
+	crypto_hash_sha512_update(&hs, (const uint8_t *)dom, sizeof(dom));
+	crypto_hash_sha512_update(&hs, sig, 32);
+	crypto_hash_sha512_update(&hs, sigkey + 32, 32);
+	crypto_hash_sha512_update(&hs, ph, crypto_hash_sha512_BYTES);
+	crypto_hash_sha512_final(&hs, hram);
+	crypto_core_ed25519_scalar_reduce(k, hram);
+
+	memset(wide, 0, sizeof(wide));
+	memcpy(wide, az, 32);
+	crypto_core_ed25519_scalar_reduce(a, wide);
+	crypto_core_ed25519_scalar_mul(ka, k, a);
+	crypto_core_ed25519_scalar_add(sig + 32, ka, r);
+
+	sodium_memzero(&hs, sizeof(hs));
+	sodium_memzero(az, sizeof(az));
+	sodium_memzero(nonce, sizeof(nonce));
+	sodium_memzero(wide, sizeof(wide));
+	sodium_memzero(a, sizeof(a));
+	sodium_memzero(r, sizeof(r));
+	sodium_memzero(ka, sizeof(ka));
+}
+
+/*
+ * do what was asked and send the reply
+ */
+static int
+agentreply(struct agentconn *conn)
+{
+	const struct reop_seckey *seckey = agent.seckey;
+	uint8_t *data = conn->data;
+	size_t len = ntohl(conn->hdr.len);
+	uint8_t buf[2 + 2 + RANDOMIDLEN + IDENTLEN];
+	const uint8_t *ra = NULL, *rb = NULL;
+	size_t ralen = 0, rblen = 0;
+	struct agenthdr hdr;
+	int status = 0;
+
+	switch (conn->hdr.op) {
+	case AGENT_INFO:
+		memcpy(buf, seckey->sigalg, 2);
+		memcpy(buf + 2, seckey->encalg, 2);
+		memcpy(buf + 4, seckey->randomid, RANDOMIDLEN);
+		memcpy(buf + 4 + RANDOMIDLEN, seckey->ident, IDENTLEN);
+		ra = buf;
+		ralen = sizeof(buf);
+		break;
+	case AGENT_SIGN:
+		signraw(seckey->sigkey, data, len, buf);
+		ra = buf;
+		ralen = SIGBYTES;
+		break;
+	case AGENT_SIGNPH:
+		if (len != crypto_hash_sha512_BYTES) {
+			status = 1;
+			break;
+		}
+		signprehash(seckey->sigkey, data, buf);
+		ra = buf;
+		ralen = SIGBYTES;
+		break;
+	case AGENT_BOX:
+		if (len < ENCPUBLICBYTES) {
+			status = 1;
+			break;
+		}
+		pubencryptraw(data + ENCPUBLICBYTES, len - ENCPUBLICBYTES, buf,
+		    buf + ENCNONCEBYTES, data, seckey->enckey);
+		ra = buf;
+		ralen = ENCNONCEBYTES + ENCTAGBYTES;
+		rb = data + ENCPUBLICBYTES;
+		rblen = len - ENCPUBLICBYTES;
+		break;
+	case AGENT_BOXOPEN: {
+		size_t hdrlen = ENCPUBLICBYTES + ENCNONCEBYTES + ENCTAGBYTES;
+		if (len < hdrlen ||
+		    pubdecryptraw(data + hdrlen, len - hdrlen, data + ENCPUBLICBYTES,
+		    data + ENCPUBLICBYTES + ENCNONCEBYTES, data, seckey->enckey) != 0) {
+			status = 1;
+			break;
+		}
+		rb = data + hdrlen;
+		rblen = len - hdrlen;
+		break;
+	}
+	case AGENT_BEFORENM:
+		if (len != ENCPUBLICBYTES) {
+			status = 1;
+			break;
+		}
+		crypto_box_beforenm(buf, data, seckey->enckey);
+		ra = buf;
+		ralen = crypto_box_BEFORENMBYTES;
+		break;
+	default:
+		status = 1;
+		break;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.len = htonl(ralen + rblen);
+	hdr.op = status;
+	int rv = 0;
+	if (agentwrite(conn->fd, &hdr, sizeof(hdr)) == -1 ||
+	    agentwrite(conn->fd, ra, ralen) == -1 ||
+	    agentwrite(conn->fd, rb, rblen) == -1)
+		rv = -1;
+	sodium_memzero(buf, sizeof(buf));
+	return rv;
+}
+
+static void *
+agentworker(void *arg)
+{
+	while (1) {
+		pthread_mutex_lock(&agent.lock);
+		while (!agent.qhead)
+			pthread_cond_wait(&agent.cond, &agent.lock);
+		struct agentconn *conn = agent.qhead;
+		if (!(agent.qhead = conn->qnext))
+			agent.qtail = &agent.qhead;
+		pthread_mutex_unlock(&agent.lock);
+
+		int rv = agentreply(conn);
+		xfree(conn->data, ntohl(conn->hdr.len));
+		conn->data = NULL;
+		conn->hdrhave = 0;
+
+		pthread_mutex_lock(&agent.lock);
+		conn->busy = 0;
+		if (rv == -1)
+			conn->dead = 1;
+		pthread_mutex_unlock(&agent.lock);
+		agentwake();
+	}
+	return NULL;
+}
+
 static void
 agentserver(const char *sockname, const char *seckeyfile)
 {
-	const struct reop_seckey *seckey = reop_getseckey(seckeyfile, NULL);
-	if (!seckey)
-		errx(1, "unable to open seckey");
-	const char *keydata = reop_encodeseckey(seckey, "");
-	if (!keydata)
-		errx(1, "unable to encode seckey");
+	/* not our own client */
+	unsetenv("REOP_AGENT_SOCK");
+
+	const struct reop_seckey *seckey = getseckeyorfail(seckeyfile);
+	struct reop_seckey *lockedkey = sodium_malloc(sizeof(*lockedkey));
+	if (!lockedkey)
+		errx(1, "unable to allocate locked memory");
+	memcpy(lockedkey, seckey, sizeof(*lockedkey));
+	reop_freeseckey(seckey);
+	sodium_mprotect_readonly(lockedkey);
+	agent.seckey = lockedkey;
 
 	struct sockaddr_un sa;
 	memset(&sa, 0, sizeof(sa));
@@ -1638,36 +5807,127 @@ agentserver(const char *sockname, const char *seckeyfile)
 		err(1, "socket");
 	if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) == -1)
 		err(1, "bind");
-	if (listen(s, 5) == -1)
+	if (listen(s, 64) == -1)
 		err(1, "listen");
-	while (1) {
-		int fd = accept(s, NULL, NULL);
-		if (fd == -1)
-			err(1, "accept");
-		char cmd[1024];
-		int rv = read(fd, cmd, sizeof(cmd) - 1);
-		if (rv == -1)
-			err(1, "read");
-		if (rv == 0) {
-			close(fd);
-			continue;
+
+	if (pipe(agent.wakefds) == -1)
+		err(1, "pipe");
+	fcntl(agent.wakefds[0], F_SETFL, O_NONBLOCK);
+	fcntl(agent.wakefds[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&agent.lock, NULL);
+	pthread_cond_init(&agent.cond, NULL);
+	agent.qtail = &agent.qhead;
+
+	/* workers leave signals to the main thread */
+	sigset_t sigs, oldsigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+	long nworkers = cpucount(16);
+	for (long i = 0; i < nworkers; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, agentworker, NULL) != 0)
+			errx(1, "unable to start worker");
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, agentsignal);
+	signal(SIGTERM, agentsignal);
+	signal(SIGHUP, agentsignal);
+
+	struct pollfd *pfds = NULL;
+	struct agentconn **pconns = NULL;
+	size_t maxpfds = 0;
+	while (!agentdone) {
+		size_t npfds = 2;
+
+		pthread_mutex_lock(&agent.lock);
+		struct agentconn **connp = &agent.conns;
+		while (*connp) {
+			struct agentconn *conn = *connp;
+			if (conn->dead && !conn->busy) {
+				*connp = conn->next;
+				close(conn->fd);
+				free(conn->data);
+				free(conn);
+				continue;
+			}
+			connp = &conn->next;
+			if (conn->busy)
+				continue;
+			if (npfds == maxpfds || !pfds) {
+				maxpfds = maxpfds ? maxpfds * 2 : 64;
+				pfds = realloc(pfds, maxpfds * sizeof(*pfds));
+				pconns = realloc(pconns, maxpfds * sizeof(*pconns));
+				if (!pfds || !pconns)
+					err(1, "realloc");
+			}
+			pfds[npfds].fd = conn->fd;
+			pfds[npfds].events = POLLIN;
+			pconns[npfds] = conn;
+			npfds++;
 		}
-		cmd[rv] = '\0';
-		if (strncmp(cmd, "QUIT", 4) == 0) {
-			close(fd);
-			break;
+		pthread_mutex_unlock(&agent.lock);
+		if (!pfds) {
+			maxpfds = 64;
+			pfds = xmalloc(maxpfds * sizeof(*pfds));
+			pconns = xmalloc(maxpfds * sizeof(*pconns));
+		}
+		pfds[0].fd = s;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = agent.wakefds[0];
+		pfds[1].events = POLLIN;
+
+		if (poll(pfds, npfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
 		}
-		if (strncmp(cmd, "KEY", 3) == 0) {
-			write(fd, keydata, strlen(keydata));
+		if (pfds[1].revents) {
+			char drain[64];
+			while (read(agent.wakefds[0], drain, sizeof(drain)) > 0)
+				continue;
+		}
+		for (size_t i = 2; i < npfds; i++) {
+			if (!pfds[i].revents)
+				continue;
+			struct agentconn *conn = pconns[i];
+			int rv = agentinput(conn);
+			pthread_mutex_lock(&agent.lock);
+			if (rv == -1) {
+				conn->dead = 1;
+			} else if (rv == 1) {
+				conn->busy = 1;
+				conn->qnext = NULL;
+				*agent.qtail = conn;
+				agent.qtail = &conn->qnext;
+				pthread_cond_signal(&agent.cond);
+			}
+			pthread_mutex_unlock(&agent.lock);
+		}
+		if (pfds[0].revents) {
+			int fd = accept(s, NULL, NULL);
+			if (fd == -1)
+				continue;
+			struct agentconn *conn = calloc(1, sizeof(*conn));
+			if (!conn) {
+				close(fd);
+				continue;
+			}
+			conn->fd = fd;
+			pthread_mutex_lock(&agent.lock);
+			conn->next = agent.conns;
+			agent.conns = conn;
+			pthread_mutex_unlock(&agent.lock);
 		}
-		close(fd);
 	}
-	reop_freestr(keydata);
-	reop_freeseckey(seckey);
+	/* the workers may still be busy, so the key stays until exit */
 	close(s);
 	unlink(sockname);
 }
-#endif
 
 int
 main(int argc, char **argv)
@@ -1676,16 +5936,25 @@ main(int argc, char **argv)
 	    *xfile = NULL;
 	char xfilebuf[1024];
 	const char *ident = NULL;
+	const char *pubkeyfiles[REOP_MAXRECIPIENTS], *idents[REOP_MAXRECIPIENTS];
+	int npubkeyfiles = 0, nidents = 0;
 	int ch;
 	int embedded = 0;
+	int manifest = 0;
 	int quiet = 0;
 	int v1compat = 0;
+	int chunked = 0;
+	int treed = 0;
+	const char *rangestr = NULL;
+	struct byterange range;
 	const char *password = NULL;
 	const char *sockname = NULL;
+	const char *kdfprofile = NULL;
 	opt_binary binary = { 0 };
 	enum {
 		NONE,
 		AGENT,
+		CALIBRATE,
 		DECRYPT,
 		ENCRYPT,
 		GENERATE,
@@ -1693,7 +5962,7 @@ main(int argc, char **argv)
 		VERIFY,
 	} verb = NONE;
 
-	while ((ch = getopt(argc, argv, "1CDEGSVZbei:m:np:qs:x:z:")) != -1) {
+	while ((ch = getopt(argc, argv, "1CDEGKMSVZbcei:k:m:np:qr:s:tx:z:")) != -1) {
 		switch (ch) {
 		case '1':
 			v1compat = 1;
@@ -1713,6 +5982,11 @@ main(int argc, char **argv)
 				usage(NULL);
 			verb = GENERATE;
 			break;
+		case 'K':
+			if (verb)
+				usage(NULL);
+			verb = CALIBRATE;
+			break;
 		case 'S':
 			if (verb)
 				usage(NULL);
@@ -1731,11 +6005,22 @@ main(int argc, char **argv)
 		case 'b':
 			binary.v = 1;
 			break;
+		case 'c':
+			chunked = 1;
+			break;
+		case 'M':
+			manifest = 1;
+			break;
 		case 'e':
 			embedded = 1;
 			break;
 		case 'i':
-			ident = optarg;
+			if (nidents == REOP_MAXRECIPIENTS)
+				usage("too many recipients");
+			ident = idents[nidents++] = optarg;
+			break;
+		case 'k':
+			kdfprofile = optarg;
 			break;
 		case 'm':
 			msgfile = optarg;
@@ -1744,7 +6029,9 @@ main(int argc, char **argv)
 			password = "";
 			break;
 		case 'p':
-			pubkeyfile = optarg;
+			if (npubkeyfiles == REOP_MAXRECIPIENTS)
+				usage("too many recipients");
+			pubkeyfile = pubkeyfiles[npubkeyfiles++] = optarg;
 			break;
 		case 'q':
 			quiet = 1;
@@ -1752,6 +6039,12 @@ main(int argc, char **argv)
 		case 's':
 			seckeyfile = optarg;
 			break;
+		case 'r':
+			rangestr = optarg;
+			break;
+		case 't':
+			treed = 1;
+			break;
 		case 'x':
 			xfile = optarg;
 			break;
@@ -1766,10 +6059,39 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 0)
+	if (manifest) {
+		if ((verb != SIGN && verb != VERIFY) || msgfile || embedded || chunked ||
+		    treed)
+			usage(NULL);
+		if (!xfile)
+			usage("a manifest needs -x");
+		if (verb == SIGN && argc == 0)
+			usage("must specify files");
+	} else if (argc != 0 && (verb != VERIFY || msgfile || xfile || embedded) &&
+	    (verb != CALIBRATE || argc > 1))
+		usage(NULL);
+	if ((npubkeyfiles > 1 || nidents > 1) && verb != ENCRYPT)
+		usage("only encryption takes more than one recipient");
+	/* a pubkey file and an identity are two recipients */
+	int multi = verb == ENCRYPT && npubkeyfiles + nidents > 1;
+	if (rangestr && verb != DECRYPT && (verb != VERIFY || !msgfile || argc))
+		usage("only decryption and verification of a message take a range");
+	if (treed && verb != SIGN)
 		usage(NULL);
+	if (rangestr && parserange(rangestr, &range) == -1)
+		usage("range must be offset:length");
 
 	reop_init();
+	if (!(reopctx = reop_ctx_new()))
+		err(1, "reop_ctx_new");
+	reop_ctx_setpassword(reopctx, reop_ttypassword, NULL);
+	if (kdfprofile && verb != CALIBRATE) {
+		enum reop_kdfalg alg;
+		uint32_t ops, memkib;
+		if (parsekdfprofile(kdfprofile, &alg, &ops, &memkib) == -1 ||
+		    reop_ctx_setkdf(reopctx, alg, ops, memkib) == -1)
+			usage("unknown kdf");
+	}
 
 	switch (verb) {
 	case AGENT:
@@ -1805,18 +6127,41 @@ main(int argc, char **argv)
 	}
 
 	switch (verb) {
-#if 0
 	case AGENT:
 		agentserver(sockname, seckeyfile);
 		break;
-#endif
+	case CALIBRATE: {
+		uint32_t millis = 250;
+		if (argc == 1) {
+			char *end;
+			unsigned long n = strtoul(argv[0], &end, 10);
+			if (*argv[0] == '\0' || *end != '\0' || n < 1 || n > 60000)
+				usage("invalid milliseconds");
+			millis = n;
+		}
+		calibrate(kdfprofile, millis);
+		break;
+	}
 	case DECRYPT:
-		decrypt(pubkeyfile, seckeyfile, msgfile, xfile);
+		decrypt(pubkeyfile, seckeyfile, msgfile, xfile, rangestr ? &range : NULL);
 		break;
 	case ENCRYPT:
 		if (seckeyfile && (!pubkeyfile && !ident))
 			usage("specify a pubkey or ident");
-		if (pubkeyfile || ident) {
+		if (chunked && v1compat)
+			usage("chunked messages can't use version 1 format");
+		if (multi && v1compat)
+			usage("version 1 format has only one recipient");
+		if (multi) {
+			multiencryptstream(pubkeyfiles, npubkeyfiles, idents, nidents,
+			    seckeyfile, msgfile, xfile, binary);
+		} else if (chunked) {
+			if (pubkeyfile || ident)
+				pubencryptstream(pubkeyfile, ident, seckeyfile, msgfile, xfile,
+				    binary);
+			else
+				symencryptstream(msgfile, xfile, binary);
+		} else if (pubkeyfile || ident) {
 			if (v1compat)
 				v1pubencrypt(pubkeyfile, ident, seckeyfile, msgfile, xfile, binary);
 			else
@@ -1846,15 +6191,28 @@ main(int argc, char **argv)
 		generate(pubkeyfile, seckeyfile, ident, password);
 		break;
 	case SIGN:
+		if (manifest) {
+			signmanifest(seckeyfile, xfile, argv, argc);
+			break;
+		}
 		if (!msgfile)
 			usage("must specify message");
-		signfile(seckeyfile, msgfile, xfile, embedded);
+		if (embedded && chunked)
+			usage("embedded signatures can't be streamed");
+		if (treed && (embedded || chunked))
+			usage("hash tree signatures are detached and unstreamed");
+		signfile(seckeyfile, msgfile, xfile, embedded, chunked, treed);
 		break;
 	case VERIFY:
-		if (!msgfile && !xfile)
+		if (manifest)
+			verifymanifest(pubkeyfile, xfile, argv, argc, quiet);
+		else if (argc != 0)
+			verifymany(pubkeyfile, argv, argc, quiet);
+		else if (!msgfile && !xfile)
 			usage("must specify message or sigfile");
-		if (msgfile)
-			verifysimple(pubkeyfile, msgfile, xfile, quiet);
+		else if (msgfile)
+			verifysimple(pubkeyfile, msgfile, xfile,
+			    rangestr ? &range : NULL, quiet);
 		else
 			verifyembedded(pubkeyfile, xfile, quiet);
 		break;
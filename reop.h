@@ -17,6 +17,7 @@
 struct reop_seckey;
 struct reop_pubkey;
 struct reop_sig;
+struct reop_ctx;
 
 struct reop_keypair {
 	const struct reop_pubkey *pubkey;
@@ -45,35 +46,224 @@ typedef struct { enum reop_decrypt_code v; } reop_decrypt_result;
 void				reop_init(void);
 void				reop_freestr(const char *str);
 
+/*
+ * the *_into functions fill caller storage and never allocate.
+ * sig, pubkey and encmsg storage must be at least the size returned here.
+ * encode buffers must hold the encoded length, which counts the nul.
+ */
+size_t				reop_sigsize(void);
+size_t				reop_pubkeysize(void);
+size_t				reop_encmsgsize(void);
+
+/*
+ * a ctx carries kdf settings, the password callback and the last error.
+ * functions taking a ctx never exit or prompt on their own, and separate
+ * ctxs may be used from separate threads. the functions without one use
+ * a private default with a tty prompt.
+ */
+typedef int (*reop_password_cb)(void *arg, const char *prompt, char *buf,
+    size_t buflen);
+struct reop_ctx *		reop_ctx_new(void);
+void				reop_ctx_free(struct reop_ctx *ctx);
+void				reop_ctx_setpassword(struct reop_ctx *ctx,
+    reop_password_cb cb, void *arg);
+const char *			reop_ctx_error(const struct reop_ctx *ctx);
+int				reop_ttypassword(void *arg, const char *prompt, char *buf,
+    size_t buflen);
+
+/*
+ * kdf for new secret keys and symmetric messages. the ctx functions which
+ * take rounds use them as the cost of the kdf, or the default if 0.
+ */
+enum reop_kdfalg {
+	REOP_KDF_BCRYPT = 1,
+	REOP_KDF_ARGON2ID,
+};
+int				reop_setkdf(enum reop_kdfalg alg, uint32_t ops,
+    uint32_t memkib);
+int				reop_ctx_setkdf(struct reop_ctx *ctx, enum reop_kdfalg alg,
+    uint32_t ops, uint32_t memkib);
+uint32_t			reop_kdfcalibrate(enum reop_kdfalg alg, uint32_t memkib,
+    uint32_t millis);
+
 /* generate a keypair */
 struct reop_keypair		reop_generate(const char *ident);
 
 /* pubkey functions */
 const struct reop_pubkey *	reop_getpubkey(const char *pubkeyfile, const char *ident);
+const struct reop_pubkey *	reop_getsigpubkey(const char *pubkeyfile,
+    const struct reop_sig *sig);
 const struct reop_pubkey *	reop_parsepubkey(const char *pubkeydata);
+const struct reop_pubkey *	reop_ctx_parsepubkey(struct reop_ctx *ctx,
+    const char *pubkeydata);
+int				reop_parsepubkey_into(struct reop_ctx *ctx,
+    const char *pubkeydata, struct reop_pubkey *pubkey);
 const char *			reop_encodepubkey(const struct reop_pubkey *pubkey);
+size_t				reop_encodedpubkeylen(const struct reop_pubkey *pubkey);
+int				reop_encodepubkey_into(const struct reop_pubkey *pubkey,
+    char *buf, size_t buflen);
+size_t				reop_pubkeybinlen(const struct reop_pubkey *pubkey);
+int				reop_encodepubkey_bin(const struct reop_pubkey *pubkey,
+    uint8_t *buf, size_t buflen);
+int				reop_parsepubkey_bin(struct reop_ctx *ctx,
+    const uint8_t *data, uint64_t datalen, struct reop_pubkey *pubkey);
 void				reop_freepubkey(const struct reop_pubkey *reop_pubkey);
 
 /* seckey functions */
 const struct reop_seckey *	reop_getseckey(const char *seckeyfile, const char *password);
 const struct reop_seckey *	reop_parseseckey(const char *seckeydata, const char *password);
 const char *			reop_encodeseckey(const struct reop_seckey *seckey, const char *password);
+const struct reop_seckey *	reop_ctx_getseckey(struct reop_ctx *ctx,
+    const char *seckeyfile, const char *password);
+const struct reop_seckey *	reop_ctx_parseseckey(struct reop_ctx *ctx,
+    const char *seckeydata, const char *password);
+const char *			reop_ctx_encodeseckey(struct reop_ctx *ctx,
+    const struct reop_seckey *seckey, const char *password, uint32_t rounds);
+size_t				reop_seckeybinlen(const struct reop_seckey *seckey);
+int				reop_ctx_encodeseckey_bin(struct reop_ctx *ctx,
+    const struct reop_seckey *seckey, const char *password, uint32_t rounds,
+    uint8_t *buf, size_t buflen);
+const struct reop_seckey *	reop_ctx_parseseckey_bin(struct reop_ctx *ctx,
+    const uint8_t *data, uint64_t datalen, const char *password);
 void				reop_freeseckey(const struct reop_seckey *reop_seckey);
 
 /* sign and verify */
 const struct reop_sig *		reop_sign(const struct reop_seckey *seckey, const uint8_t *msg,
     uint64_t msglen);
+int				reop_sign_into(const struct reop_seckey *seckey,
+    const uint8_t *msg, uint64_t msglen, struct reop_sig *sig);
 reop_verify_result		reop_verify(const struct reop_pubkey *reop_pubkey, const uint8_t *msg,
     uint64_t msglen, const struct reop_sig *reop_sig);
+int				reop_verify_batch(const struct reop_pubkey *const *pubkeys,
+    uint64_t npubkeys, const uint8_t *const *msgs, const uint64_t *msglens,
+    const struct reop_sig *const *sigs, uint64_t count,
+    reop_verify_result *results);
+
+/* streaming sign and verify, for messages of any size */
+struct reop_sigstream;
+struct reop_sigstream *		reop_sigstream_init(void);
+void				reop_sigstream_update(struct reop_sigstream *ss,
+    const uint8_t *msg, uint64_t msglen);
+const struct reop_sig *		reop_sigstream_sign(struct reop_sigstream *ss,
+    const struct reop_seckey *seckey);
+int				reop_sigstream_sign_into(struct reop_sigstream *ss,
+    const struct reop_seckey *seckey, struct reop_sig *sig);
+reop_verify_result		reop_sigstream_verify(struct reop_sigstream *ss,
+    const struct reop_pubkey *pubkey, const struct reop_sig *sig);
+void				reop_freesigstream(struct reop_sigstream *ss);
+
+/*
+ * hash tree signatures, so the leaves may be hashed in parallel and one
+ * block checked with its path. a tree is reop_tree_nodes() hashes,
+ * the leaves first and the root last.
+ */
+enum {
+	REOP_TREEBLOCK = 65536,
+	REOP_TREEHASHBYTES = 32,
+};
+uint64_t			reop_tree_nodes(uint64_t msglen);
+void				reop_tree_leaf(const uint8_t *block, uint64_t blocklen,
+    uint8_t *hash);
+void				reop_tree_build(uint8_t *tree, uint64_t msglen);
+void				reop_tree_hash(const uint8_t *msg, uint64_t msglen,
+    uint8_t *tree);
+uint64_t			reop_tree_path(const uint8_t *tree, uint64_t msglen,
+    uint64_t block, uint8_t *path);
+int				reop_tree_pathroot(const uint8_t *leaf, uint64_t block,
+    uint64_t msglen, const uint8_t *path, uint64_t pathlen, uint8_t *root);
+const struct reop_sig *		reop_tree_sign(const struct reop_seckey *seckey,
+    const uint8_t *root, uint64_t msglen);
+int				reop_tree_sign_into(const struct reop_seckey *seckey,
+    const uint8_t *root, uint64_t msglen, struct reop_sig *sig);
+reop_verify_result		reop_tree_verify(const struct reop_pubkey *pubkey,
+    const uint8_t *root, uint64_t msglen, const struct reop_sig *sig);
 
 /* sig functions */
 const struct reop_sig *		reop_parsesig(const char *sigdata);
+const struct reop_sig *		reop_ctx_parsesig(struct reop_ctx *ctx, const char *sigdata);
+int				reop_parsesig_into(struct reop_ctx *ctx, const char *sigdata,
+    struct reop_sig *sig);
 const char *			reop_encodesig(const struct reop_sig *sig);
+size_t				reop_encodedsiglen(const struct reop_sig *sig);
+int				reop_encodesig_into(const struct reop_sig *sig, char *buf,
+    size_t buflen);
+size_t				reop_sigbinlen(const struct reop_sig *sig);
+int				reop_encodesig_bin(const struct reop_sig *sig, uint8_t *buf,
+    size_t buflen);
+int				reop_parsesig_bin(struct reop_ctx *ctx, const uint8_t *data,
+    uint64_t datalen, struct reop_sig *sig);
 void				reop_freesig(const struct reop_sig *sig);
 
 const struct reop_symmsg *	reop_symencrypt(uint8_t *msg, uint64_t msglen, const char *password);
+const struct reop_symmsg *	reop_ctx_symencrypt(struct reop_ctx *ctx, uint8_t *msg,
+    uint64_t msglen, const char *password, uint32_t rounds);
 const struct reop_encmsg *	reop_pubencrypt(const struct reop_pubkey *pubkey,
     const struct reop_seckey *seckey, uint8_t *msg, uint64_t msglen);
+int				reop_pubencrypt_into(const struct reop_pubkey *pubkey,
+    const struct reop_seckey *seckey, uint8_t *msg, uint64_t msglen,
+    struct reop_encmsg *encmsg);
+
+reop_decrypt_result		reop_symdecrypt(const struct reop_symmsg *symmsg,
+    const char *password, uint8_t *msg, uint64_t msglen);
+reop_decrypt_result		reop_ctx_symdecrypt(struct reop_ctx *ctx,
+    const struct reop_symmsg *symmsg, const char *password, uint8_t *msg,
+    uint64_t msglen);
+/*
+ * decrypt count messages at once, with a result for each. a NULL password
+ * comes from the ctx callback, asked once for all of them. returns -1 if
+ * any message failed.
+ */
+int				reop_symdecrypt_batch(const struct reop_symmsg *const *symmsgs,
+    const char *const *passwords, uint8_t *const *msgs, const uint64_t *msglens,
+    uint64_t count, reop_decrypt_result *results);
+int				reop_ctx_symdecrypt_batch(struct reop_ctx *ctx,
+    const struct reop_symmsg *const *symmsgs, const char *const *passwords,
+    uint8_t *const *msgs, const uint64_t *msglens, uint64_t count,
+    reop_decrypt_result *results);
+reop_decrypt_result		reop_pubdecrypt(const struct reop_encmsg *encmsg,
+    const struct reop_pubkey *pubkey, const struct reop_seckey *seckey,
+    uint8_t *msg, uint64_t msglen);
 
 void				reop_freesymmsg(const struct reop_symmsg *);
 void				reop_freeencmsg(const struct reop_encmsg *);
+
+/* chunked messages */
+struct reop_stream;
+enum {
+	REOP_CHUNKSIZE = 65536,
+	REOP_CHUNKTAGBYTES = 16,
+	REOP_MAXRECIPIENTS = 256,
+};
+
+struct reop_stream *		reop_symencrypt_init(const char *password);
+struct reop_stream *		reop_ctx_symencrypt_init(struct reop_ctx *ctx,
+    const char *password, uint32_t rounds);
+struct reop_stream *		reop_pubencrypt_init(const struct reop_pubkey *pubkey,
+    const struct reop_seckey *seckey);
+struct reop_stream *		reop_pubencrypt_multi_init(const struct reop_pubkey *const *pubkeys,
+    uint64_t npubkeys, const struct reop_seckey *seckey);
+reop_decrypt_result		reop_symdecrypt_init(struct reop_stream **streamp,
+    const uint8_t *hdr, uint64_t hdrlen, const char *password);
+reop_decrypt_result		reop_ctx_symdecrypt_init(struct reop_ctx *ctx,
+    struct reop_stream **streamp, const uint8_t *hdr, uint64_t hdrlen,
+    const char *password);
+reop_decrypt_result		reop_pubdecrypt_init(struct reop_stream **streamp,
+    const uint8_t *hdr, uint64_t hdrlen, const struct reop_pubkey *pubkey,
+    const struct reop_seckey *seckey);
+const uint8_t *			reop_stream_header(const struct reop_stream *stream,
+    uint64_t *hdrlen);
+int				reop_stream_encrypt(struct reop_stream *stream, uint8_t *buf,
+    uint64_t buflen, int final, uint8_t *tag);
+reop_decrypt_result		reop_stream_decrypt(struct reop_stream *stream, uint8_t *buf,
+    uint64_t buflen, int final, const uint8_t *tag);
+/* many chunks in parallel, each a tag then data, as they are in a message */
+int				reop_stream_encrypt_chunks(struct reop_stream *stream,
+    uint8_t *buf, uint64_t buflen, int final);
+reop_decrypt_result		reop_stream_decrypt_chunks(struct reop_stream *stream,
+    uint8_t *buf, uint64_t buflen, int final);
+/* random access, given every chunk of a message */
+int				reop_stream_msglen(uint64_t chunkslen, uint64_t *msglen);
+reop_decrypt_result		reop_stream_decrypt_range(const struct reop_stream *stream,
+    const uint8_t *chunks, uint64_t chunkslen, uint64_t off, uint64_t len,
+    uint8_t *out);
+void				reop_freestream(struct reop_stream *stream);
@@ -0,0 +1,431 @@
+/*
+ * tests of the library interface that the command line doesn't reach.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../reop.h"
+
+static int
+fail(const char *what)
+{
+	printf("%s\n", what);
+	return 1;
+}
+
+static int
+applespassword(void *arg, const char *prompt, char *buf, size_t buflen)
+{
+	int *calls = arg;
+
+	(*calls)++;
+	strncpy(buf, "apples", buflen);
+	return 0;
+}
+
+enum { NBATCH = 30 };
+
+/*
+ * a batch mixing bcrypt and argon2id messages, each with the right
+ * password, a wrong one, or NULL for the ctx to supply.
+ */
+static int
+testsymbatch(void)
+{
+	struct reop_ctx *ctx = reop_ctx_new();
+	const struct reop_symmsg *symmsgs[NBATCH];
+	const char *passwords[NBATCH];
+	uint8_t bufs[NBATCH][100], *msgs[NBATCH];
+	uint64_t msglens[NBATCH];
+	reop_decrypt_result results[NBATCH];
+	int i, calls = 0, failed = 0;
+
+	for (i = 0; i < NBATCH; i++) {
+		if (i % 2)
+			reop_ctx_setkdf(ctx, REOP_KDF_ARGON2ID, 1, 8);
+		else
+			reop_ctx_setkdf(ctx, REOP_KDF_BCRYPT, 2, 0);
+		memset(bufs[i], i, sizeof(bufs[i]));
+		msgs[i] = bufs[i];
+		msglens[i] = sizeof(bufs[i]);
+		symmsgs[i] = reop_ctx_symencrypt(ctx, msgs[i], msglens[i],
+		    "apples", 0);
+		if (!symmsgs[i])
+			return fail("symencrypt failed");
+		passwords[i] = i % 3 == 0 ? "apples" : i % 3 == 1 ? "pears" : NULL;
+	}
+
+	reop_ctx_setpassword(ctx, applespassword, &calls);
+	if (reop_ctx_symdecrypt_batch(ctx, symmsgs, passwords, msgs, msglens,
+	    NBATCH, results) != -1)
+		failed |= fail("symdecrypt batch ignored a wrong password");
+	if (calls != 1)
+		failed |= fail("symdecrypt batch asked for the password more than once");
+	for (i = 0; i < NBATCH; i++) {
+		int want = i % 3 == 1 ? REOP_D_FAIL : REOP_D_OK;
+		uint8_t orig[sizeof(bufs[i])];
+
+		memset(orig, i, sizeof(orig));
+		if (results[i].v != want || (want == REOP_D_OK &&
+		    memcmp(bufs[i], orig, sizeof(orig)) != 0)) {
+			printf("symdecrypt batch mismatch: %d\n", i);
+			failed = 1;
+		}
+	}
+
+	/* now the right password for all, with no callback */
+	for (i = 0; i < NBATCH; i++) {
+		reop_freesymmsg(symmsgs[i]);
+		symmsgs[i] = reop_ctx_symencrypt(ctx, msgs[i], msglens[i],
+		    "apples", 0);
+		if (!symmsgs[i])
+			return fail("symencrypt failed");
+		passwords[i] = "apples";
+	}
+	passwords[NBATCH - 1] = NULL;
+	reop_ctx_setpassword(ctx, NULL, NULL);
+	if (reop_ctx_symdecrypt_batch(ctx, symmsgs, passwords, msgs, msglens,
+	    NBATCH - 1, results) != 0)
+		failed |= fail("symdecrypt batch failed");
+	if (reop_ctx_symdecrypt_batch(ctx, symmsgs + NBATCH - 1,
+	    passwords + NBATCH - 1, msgs + NBATCH - 1, msglens + NBATCH - 1,
+	    1, results) != -1 || results[0].v != REOP_D_FAIL ||
+	    strcmp(reop_ctx_error(ctx), "no password") != 0)
+		failed |= fail("symdecrypt batch without a password");
+
+	for (i = 0; i < NBATCH; i++)
+		reop_freesymmsg(symmsgs[i]);
+	reop_ctx_free(ctx);
+	return failed;
+}
+
+/*
+ * the encode and parse functions which fill caller storage, against the
+ * allocating ones. the encoded length must be exact, and a buffer one
+ * byte short refused.
+ */
+static int
+testintoone(const char *ident)
+{
+	struct reop_ctx *ctx = reop_ctx_new();
+	struct reop_keypair kp = reop_generate(ident);
+	struct reop_sig *sig = malloc(reop_sigsize());
+	struct reop_sig *sig2 = malloc(reop_sigsize());
+	struct reop_pubkey *pubkey = malloc(reop_pubkeysize());
+	struct reop_encmsg *encmsg = malloc(reop_encmsgsize());
+	const struct reop_sig *allocsig;
+	const char *enc, *allocenc;
+	char buf[1024];
+	uint8_t msg[300], orig[300];
+	size_t len;
+	int failed = 0;
+
+	if (!kp.pubkey || !sig || !sig2 || !pubkey || !encmsg)
+		return fail("out of memory");
+	memset(orig, 'a', sizeof(orig));
+	memcpy(msg, orig, sizeof(msg));
+
+	if (reop_sign_into(kp.seckey, msg, sizeof(msg), sig) != 0)
+		return fail("sign into failed");
+	if (!(allocsig = reop_sign(kp.seckey, msg, sizeof(msg))))
+		return fail("sign failed");
+	enc = reop_encodesig(sig);
+	len = reop_encodedsiglen(sig);
+	if (strlen(enc) + 1 != len)
+		failed |= fail("encoded sig length is wrong");
+	allocenc = reop_encodesig(allocsig);
+	if (strcmp(enc, allocenc) != 0)
+		failed |= fail("sign into differs from sign");
+	if (reop_encodesig_into(sig, buf, len - 1) != -1)
+		failed |= fail("encode sig into took a short buffer");
+	if (reop_encodesig_into(sig, buf, len) != 0 || strcmp(buf, enc) != 0)
+		failed |= fail("encode sig into differs");
+	if (reop_parsesig_into(ctx, buf, sig2) != 0 ||
+	    reop_encodesig_into(sig2, buf, sizeof(buf)) != 0 ||
+	    strcmp(buf, enc) != 0)
+		failed |= fail("parse sig into didn't round trip");
+	if (reop_verify(kp.pubkey, msg, sizeof(msg), sig2).v != REOP_V_OK)
+		failed |= fail("parsed sig didn't verify");
+	reop_freestr(enc);
+	reop_freestr(allocenc);
+	reop_freesig(allocsig);
+
+	enc = reop_encodepubkey(kp.pubkey);
+	len = reop_encodedpubkeylen(kp.pubkey);
+	if (strlen(enc) + 1 != len)
+		failed |= fail("encoded pubkey length is wrong");
+	if (reop_encodepubkey_into(kp.pubkey, buf, len - 1) != -1)
+		failed |= fail("encode pubkey into took a short buffer");
+	if (reop_encodepubkey_into(kp.pubkey, buf, len) != 0 ||
+	    strcmp(buf, enc) != 0)
+		failed |= fail("encode pubkey into differs");
+	if (reop_parsepubkey_into(ctx, buf, pubkey) != 0 ||
+	    reop_encodepubkey_into(pubkey, buf, sizeof(buf)) != 0 ||
+	    strcmp(buf, enc) != 0)
+		failed |= fail("parse pubkey into didn't round trip");
+	if (reop_verify(pubkey, msg, sizeof(msg), sig).v != REOP_V_OK)
+		failed |= fail("sig didn't verify with the parsed pubkey");
+	reop_freestr(enc);
+
+	if (reop_pubencrypt_into(pubkey, kp.seckey, msg, sizeof(msg),
+	    encmsg) != 0 || memcmp(msg, orig, sizeof(msg)) == 0)
+		failed |= fail("pubencrypt into failed");
+	if (reop_pubdecrypt(encmsg, pubkey, kp.seckey, msg, sizeof(msg)).v !=
+	    REOP_D_OK || memcmp(msg, orig, sizeof(msg)) != 0)
+		failed |= fail("pubencrypt into didn't decrypt");
+
+	free(sig);
+	free(sig2);
+	free(pubkey);
+	free(encmsg);
+	reop_freepubkey(kp.pubkey);
+	reop_freeseckey(kp.seckey);
+	reop_ctx_free(ctx);
+	return failed;
+}
+
+static int
+testinto(void)
+{
+	char ident[64];
+
+	memset(ident, 'x', sizeof(ident) - 1);
+	ident[sizeof(ident) - 1] = 0;
+	return testintoone("a") | testintoone("apitest") | testintoone(ident);
+}
+
+/*
+ * binary keys and sigs must round trip, and parsing must refuse data one
+ * byte short or one byte long, or with a bad ident length.
+ */
+static int
+testbin(void)
+{
+	struct reop_ctx *ctx = reop_ctx_new();
+	struct reop_keypair kp = reop_generate("apitest");
+	struct reop_sig *sig = malloc(reop_sigsize());
+	struct reop_sig *sig2 = malloc(reop_sigsize());
+	struct reop_pubkey *pubkey = malloc(reop_pubkeysize());
+	const struct reop_seckey *seckey;
+	const char *enc, *enc2;
+	uint8_t buf[1024], msg[100];
+	size_t len;
+	int failed = 0;
+
+	if (!kp.pubkey || !sig || !sig2 || !pubkey)
+		return fail("out of memory");
+	memset(msg, 'b', sizeof(msg));
+	if (reop_sign_into(kp.seckey, msg, sizeof(msg), sig) != 0)
+		return fail("sign into failed");
+
+	len = reop_sigbinlen(sig);
+	if (reop_encodesig_bin(sig, buf, len - 1) != -1)
+		failed |= fail("encode sig bin took a short buffer");
+	if (reop_encodesig_bin(sig, buf, len) != 0)
+		failed |= fail("encode sig bin failed");
+	if (reop_parsesig_bin(ctx, buf, len, sig2) != 0)
+		failed |= fail("parse sig bin failed");
+	enc = reop_encodesig(sig);
+	enc2 = reop_encodesig(sig2);
+	if (strcmp(enc, enc2) != 0)
+		failed |= fail("sig bin didn't round trip");
+	reop_freestr(enc);
+	reop_freestr(enc2);
+	if (reop_parsesig_bin(ctx, buf, len - 1, sig2) != -1)
+		failed |= fail("parse sig bin took truncated data");
+	buf[len] = 'x';
+	if (reop_parsesig_bin(ctx, buf, len + 1, sig2) != -1)
+		failed |= fail("parse sig bin took trailing data");
+	buf[len - strlen("apitest") - 4] = 1;
+	if (reop_parsesig_bin(ctx, buf, len, sig2) != -1)
+		failed |= fail("parse sig bin took a bad ident length");
+
+	len = reop_pubkeybinlen(kp.pubkey);
+	if (reop_encodepubkey_bin(kp.pubkey, buf, len - 1) != -1)
+		failed |= fail("encode pubkey bin took a short buffer");
+	if (reop_encodepubkey_bin(kp.pubkey, buf, len) != 0)
+		failed |= fail("encode pubkey bin failed");
+	if (reop_parsepubkey_bin(ctx, buf, len, pubkey) != 0)
+		failed |= fail("parse pubkey bin failed");
+	enc = reop_encodepubkey(kp.pubkey);
+	enc2 = reop_encodepubkey(pubkey);
+	if (strcmp(enc, enc2) != 0)
+		failed |= fail("pubkey bin didn't round trip");
+	reop_freestr(enc);
+	reop_freestr(enc2);
+	if (reop_parsepubkey_bin(ctx, buf, len - 1, pubkey) != -1)
+		failed |= fail("parse pubkey bin took truncated data");
+	buf[len] = 'x';
+	if (reop_parsepubkey_bin(ctx, buf, len + 1, pubkey) != -1)
+		failed |= fail("parse pubkey bin took trailing data");
+
+	len = reop_seckeybinlen(kp.seckey);
+	if (reop_ctx_encodeseckey_bin(ctx, kp.seckey, "apples", 2, buf,
+	    len - 1) != -1)
+		failed |= fail("encode seckey bin took a short buffer");
+	if (reop_ctx_encodeseckey_bin(ctx, kp.seckey, "apples", 2, buf,
+	    len) != 0)
+		failed |= fail("encode seckey bin failed");
+	if (!(seckey = reop_ctx_parseseckey_bin(ctx, buf, len, "apples")))
+		return fail("parse seckey bin failed");
+	if (reop_sign_into(seckey, msg, sizeof(msg), sig2) != 0 ||
+	    reop_verify(kp.pubkey, msg, sizeof(msg), sig2).v != REOP_V_OK)
+		failed |= fail("seckey bin didn't round trip");
+	reop_freeseckey(seckey);
+	if (reop_ctx_parseseckey_bin(ctx, buf, len, "pears"))
+		failed |= fail("parse seckey bin took a wrong password");
+	if (reop_ctx_parseseckey_bin(ctx, buf, len - 1, "apples"))
+		failed |= fail("parse seckey bin took truncated data");
+	buf[len] = 'x';
+	if (reop_ctx_parseseckey_bin(ctx, buf, len + 1, "apples"))
+		failed |= fail("parse seckey bin took trailing data");
+
+	free(sig);
+	free(sig2);
+	free(pubkey);
+	reop_freepubkey(kp.pubkey);
+	reop_freeseckey(kp.seckey);
+	reop_ctx_free(ctx);
+	return failed;
+}
+
+static void
+relabel(const struct reop_sig *sig, const char *alg, struct reop_sig *out)
+{
+	struct reop_ctx *ctx = reop_ctx_new();
+	uint8_t buf[200];
+	size_t len = reop_sigbinlen(sig);
+
+	reop_encodesig_bin(sig, buf, len);
+	memcpy(buf, alg, 2);
+	reop_parsesig_bin(ctx, buf, len, out);
+	reop_ctx_free(ctx);
+}
+
+/*
+ * a sig relabeled with another alg must not verify, even over the message
+ * the other alg would have signed. a tree sig signs 48 bytes: the prefix,
+ * the message length and the root.
+ */
+static int
+testrelabel(void)
+{
+	struct reop_keypair kp = reop_generate("apitest");
+	struct reop_sig *sig = malloc(reop_sigsize());
+	const struct reop_sig *edsig, *treesig, *streamsig;
+	struct reop_sigstream *ss;
+	uint8_t msg[1000], tree[32], treemsg[48];
+	int i, failed = 0;
+
+	if (!kp.pubkey || !sig)
+		return fail("out of memory");
+	if (reop_tree_nodes(sizeof(msg)) != 1)
+		return fail("one block should be one node");
+	memset(msg, 'c', sizeof(msg));
+	reop_tree_hash(msg, sizeof(msg), tree);
+	memcpy(treemsg, "REOPTREE", 8);
+	for (i = 0; i < 8; i++)
+		treemsg[8 + i] = (uint64_t)sizeof(msg) >> (56 - 8 * i);
+	memcpy(treemsg + 16, tree, 32);
+
+	edsig = reop_sign(kp.seckey, treemsg, sizeof(treemsg));
+	treesig = reop_tree_sign(kp.seckey, tree, sizeof(msg));
+	ss = reop_sigstream_init();
+	reop_sigstream_update(ss, treemsg, sizeof(treemsg));
+	streamsig = reop_sigstream_sign(ss, kp.seckey);
+	reop_freesigstream(ss);
+	if (!edsig || !treesig || !streamsig)
+		return fail("sign failed");
+
+	if (reop_verify(kp.pubkey, treemsg, sizeof(treemsg), edsig).v != REOP_V_OK ||
+	    reop_tree_verify(kp.pubkey, tree, sizeof(msg), treesig).v != REOP_V_OK ||
+	    reop_verify(kp.pubkey, msg, sizeof(msg), treesig).v != REOP_V_OK ||
+	    reop_verify(kp.pubkey, treemsg, sizeof(treemsg), streamsig).v != REOP_V_OK)
+		failed |= fail("sig didn't verify");
+
+	relabel(edsig, "ET", sig);
+	if (reop_tree_verify(kp.pubkey, tree, sizeof(msg), sig).v != REOP_V_FAIL)
+		failed |= fail("Ed sig verified as ET");
+	relabel(streamsig, "ET", sig);
+	if (reop_tree_verify(kp.pubkey, tree, sizeof(msg), sig).v != REOP_V_FAIL)
+		failed |= fail("EP sig verified as ET");
+	relabel(treesig, "Ed", sig);
+	if (reop_verify(kp.pubkey, treemsg, sizeof(treemsg), sig).v != REOP_V_FAIL)
+		failed |= fail("ET sig verified as Ed");
+	relabel(treesig, "EP", sig);
+	if (reop_verify(kp.pubkey, treemsg, sizeof(treemsg), sig).v != REOP_V_FAIL)
+		failed |= fail("ET sig verified as EP");
+	relabel(edsig, "Ex", sig);
+	if (reop_verify(kp.pubkey, treemsg, sizeof(treemsg), sig).v != REOP_V_FAIL)
+		failed |= fail("sig with an unknown alg verified");
+
+	free(sig);
+	reop_freesig(edsig);
+	reop_freesig(treesig);
+	reop_freesig(streamsig);
+	reop_freepubkey(kp.pubkey);
+	reop_freeseckey(kp.seckey);
+	return failed;
+}
+
+enum { NTREES = 20, TREEMSGLEN = 40 * 65536 + 100 };
+
+/*
+ * a batch of tree sigs over messages of several groups of blocks. each
+ * worker of the batch hashes its trees alone, and every sig must still
+ * check out.
+ */
+static int
+testtreebatch(void)
+{
+	struct reop_keypair kp = reop_generate("apitest");
+	const struct reop_pubkey *pubkeys[1] = { kp.pubkey };
+	const struct reop_sig *sigs[NTREES];
+	const uint8_t *msgs[NTREES];
+	uint64_t msglens[NTREES];
+	reop_verify_result results[NTREES];
+	uint64_t nodes = reop_tree_nodes(TREEMSGLEN);
+	uint8_t *msg = malloc(NTREES * (uint64_t)TREEMSGLEN);
+	uint8_t *tree = malloc(nodes * REOP_TREEHASHBYTES);
+	int i, failed = 0;
+
+	if (!kp.pubkey || !msg || !tree)
+		return fail("out of memory");
+	for (i = 0; i < NTREES; i++) {
+		msgs[i] = msg + i * (uint64_t)TREEMSGLEN;
+		msglens[i] = TREEMSGLEN;
+		memset(msg + i * (uint64_t)TREEMSGLEN, i, TREEMSGLEN);
+		reop_tree_hash(msgs[i], msglens[i], tree);
+		if (!(sigs[i] = reop_tree_sign(kp.seckey,
+		    tree + (nodes - 1) * REOP_TREEHASHBYTES, msglens[i])))
+			return fail("tree sign failed");
+	}
+	msg[5 * (uint64_t)TREEMSGLEN + 35 * 65536 + 7] ^= 1;
+
+	if (reop_verify_batch(pubkeys, 1, msgs, msglens, sigs, NTREES,
+	    results) != 0)
+		failed |= fail("verify batch failed");
+	for (i = 0; i < NTREES; i++) {
+		if (results[i].v != (i == 5 ? REOP_V_FAIL : REOP_V_OK)) {
+			printf("tree verify batch mismatch: %d\n", i);
+			failed = 1;
+		}
+		reop_freesig(sigs[i]);
+	}
+
+	free(msg);
+	free(tree);
+	reop_freepubkey(kp.pubkey);
+	reop_freeseckey(kp.seckey);
+	return failed;
+}
+
+int
+main(void)
+{
+	reop_init();
+	return testsymbatch() | testinto() | testbin() | testrelabel() |
+	    testtreebatch();
+}
@@ -0,0 +1,393 @@
+/*
+ * differential test of the base64 encoders and decoders against the
+ * original character at a time implementation, for every one this cpu has.
+ */
+#include <ctype.h>
+#include <stdint.h>
+
+#include "../other/base64.c"
+
+static int
+old_ntop(src, srclength, target, targsize)
+	u_char const *src;
+	size_t srclength;
+	char *target;
+	size_t targsize;
+{
+	size_t datalength = 0;
+	u_char input[3];
+	u_char output[4];
+	int i;
+
+	while (2 < srclength) {
+		input[0] = *src++;
+		input[1] = *src++;
+		input[2] = *src++;
+		srclength -= 3;
+
+		output[0] = input[0] >> 2;
+		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
+		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
+		output[3] = input[2] & 0x3f;
+
+		if (datalength + 4 > targsize)
+			return (-1);
+		target[datalength++] = Base64[output[0]];
+		target[datalength++] = Base64[output[1]];
+		target[datalength++] = Base64[output[2]];
+		target[datalength++] = Base64[output[3]];
+	}
+    
+	/* Now we worry about padding. */
+	if (0 != srclength) {
+		/* Get what's left. */
+		input[0] = input[1] = input[2] = '\0';
+		for (i = 0; i < srclength; i++)
+			input[i] = *src++;
+	
+		output[0] = input[0] >> 2;
+		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
+		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
+
+		if (datalength + 4 > targsize)
+			return (-1);
+		target[datalength++] = Base64[output[0]];
+		target[datalength++] = Base64[output[1]];
+		if (srclength == 1)
+			target[datalength++] = Pad64;
+		else
+			target[datalength++] = Base64[output[2]];
+		target[datalength++] = Pad64;
+	}
+	if (datalength >= targsize)
+		return (-1);
+	target[datalength] = '\0';	/* Returned value doesn't count \0. */
+	return (datalength);
+}
+
+static int
+old_pton(src, target, targsize)
+	char const *src;
+	u_char *target;
+	size_t targsize;
+{
+	int tarindex, state, ch;
+	u_char nextbyte;
+	char *pos;
+
+	state = 0;
+	tarindex = 0;
+
+	while ((ch = (unsigned char)*src++) != '\0') {
+		if (isspace(ch))	/* Skip whitespace anywhere. */
+			continue;
+
+		if (ch == Pad64)
+			break;
+
+		pos = strchr(Base64, ch);
+		if (pos == 0) 		/* A non-base64 character. */
+			return (-1);
+
+		switch (state) {
+		case 0:
+			if (target) {
+				if (tarindex >= targsize)
+					return (-1);
+				target[tarindex] = (pos - Base64) << 2;
+			}
+			state = 1;
+			break;
+		case 1:
+			if (target) {
+				if (tarindex >= targsize)
+					return (-1);
+				target[tarindex]   |=  (pos - Base64) >> 4;
+				nextbyte = ((pos - Base64) & 0x0f) << 4;
+				if (tarindex + 1 < targsize)
+					target[tarindex+1] = nextbyte;
+				else if (nextbyte)
+					return (-1);
+			}
+			tarindex++;
+			state = 2;
+			break;
+		case 2:
+			if (target) {
+				if (tarindex >= targsize)
+					return (-1);
+				target[tarindex]   |=  (pos - Base64) >> 2;
+				nextbyte = ((pos - Base64) & 0x03) << 6;
+				if (tarindex + 1 < targsize)
+					target[tarindex+1] = nextbyte;
+				else if (nextbyte)
+					return (-1);
+			}
+			tarindex++;
+			state = 3;
+			break;
+		case 3:
+			if (target) {
+				if (tarindex >= targsize)
+					return (-1);
+				target[tarindex] |= (pos - Base64);
+			}
+			tarindex++;
+			state = 0;
+			break;
+		}
+	}
+
+	/*
+	 * We are done decoding Base-64 chars.  Let's see if we ended
+	 * on a byte boundary, and/or with erroneous trailing characters.
+	 */
+
+	if (ch == Pad64) {			/* We got a pad char. */
+		ch = (unsigned char)*src++;	/* Skip it, get next. */
+		switch (state) {
+		case 0:		/* Invalid = in first position */
+		case 1:		/* Invalid = in second position */
+			return (-1);
+
+		case 2:		/* Valid, means one byte of info */
+			/* Skip any number of spaces. */
+			for (; ch != '\0'; ch = (unsigned char)*src++)
+				if (!isspace(ch))
+					break;
+			/* Make sure there is another trailing = sign. */
+			if (ch != Pad64)
+				return (-1);
+			ch = (unsigned char)*src++;		/* Skip the = */
+			/* Fall through to "single trailing =" case. */
+			/* FALLTHROUGH */
+
+		case 3:		/* Valid, means two bytes of info */
+			/*
+			 * We know this char is an =.  Is there anything but
+			 * whitespace after it?
+			 */
+			for (; ch != '\0'; ch = (unsigned char)*src++)
+				if (!isspace(ch))
+					return (-1);
+
+			/*
+			 * Now make sure for cases 2 and 3 that the "extra"
+			 * bits that slopped past the last full byte were
+			 * zeros.  If we don't check them, they become a
+			 * subliminal channel.
+			 */
+			if (target && tarindex < targsize &&
+			    target[tarindex] != 0)
+				return (-1);
+		}
+	} else {
+		/*
+		 * We ended by seeing the end of the string.  Make sure we
+		 * have no partial bytes lying around.
+		 */
+		if (state != 0)
+			return (-1);
+	}
+
+	return (tarindex);
+}
+
+static uint64_t rngstate = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rng(void)
+{
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 7;
+	rngstate ^= rngstate << 17;
+	return rngstate;
+}
+
+/* some valid base64, maybe wrapped, then maybe damaged */
+static size_t
+mkinput(char *str, size_t strsize)
+{
+	u_char data[400];
+	char enc[600];
+	const char junk[] = "= \n\t\r-!*~\x80\xff";
+	size_t datalen, enclen, width, i, len = 0;
+
+	datalen = rng() % sizeof(data);
+	for (i = 0; i < datalen; i++)
+		data[i] = rng();
+	enclen = reopb64_ntop(data, datalen, enc, sizeof(enc));
+	width = rng() % 4 == 0 ? 0 : 1 + rng() % 100;
+	for (i = 0; i < enclen && len < strsize - 2; i++) {
+		str[len++] = enc[i];
+		if (width && (i + 1) % width == 0)
+			str[len++] = '\n';
+	}
+	switch (rng() % 4) {
+	case 0:
+		if (len)
+			str[rng() % len] = junk[rng() % (sizeof(junk) - 1)];
+		break;
+	case 1:
+		if (len)
+			str[rng() % len] = rng() % 255 + 1;
+		break;
+	case 2:
+		if (len)
+			len = rng() % len;
+		break;
+	}
+	str[len] = '\0';
+	return len;
+}
+
+static int
+testenc(void)
+{
+	size_t (*encoders[])(u_char const *, size_t, char *) = {
+		b64_encrun_scalar,
+#ifdef B64_X86
+		b64_encrun_ssse3,
+		b64_encrun_avx2,
+#endif
+	};
+	const char *names[] = { "scalar", "ssse3", "avx2" };
+	size_t nencoders = sizeof(encoders) / sizeof(encoders[0]);
+	u_char data[1000];
+	char want[1500], wrapped[1600], got[1600];
+	int i, e, wantlen, gotlen, failed = 0;
+
+#ifdef B64_X86
+	if (!__builtin_cpu_supports("avx2"))
+		nencoders--;
+	if (!__builtin_cpu_supports("ssse3"))
+		nencoders--;
+#endif
+	for (i = 0; i < 20000; i++) {
+		size_t datalen = rng() % sizeof(data);
+		size_t j, wrappedlen = 0;
+
+		for (j = 0; j < datalen; j++)
+			data[j] = rng();
+		wantlen = old_ntop(data, datalen, want, sizeof(want));
+		for (j = 0; j < wantlen; j++) {
+			wrapped[wrappedlen++] = want[j];
+			if ((j + 1) % 76 == 0 || j + 1 == wantlen)
+				wrapped[wrappedlen++] = '\n';
+		}
+		for (e = 0; e < nencoders; e++) {
+			b64_encrun = encoders[e];
+
+			gotlen = reopb64_ntop(data, datalen, got, sizeof(got));
+			if (gotlen != wantlen || strcmp(got, want) != 0) {
+				printf("%s ntop mismatch: %zu bytes\n", names[e],
+				    datalen);
+				failed = 1;
+			}
+
+			/* incremental, in random pieces */
+			struct reopb64_enc enc;
+			size_t pos = 0;
+			int rv;
+			reopb64_enc_init(&enc);
+			gotlen = 0;
+			while (pos < datalen) {
+				size_t amt = 1 + rng() % (datalen - pos);
+				rv = reopb64_enc_update(&enc, data + pos, amt,
+				    got + gotlen, sizeof(got) - gotlen);
+				if (rv == -1)
+					break;
+				gotlen += rv;
+				pos += amt;
+			}
+			rv = reopb64_enc_final(&enc, got + gotlen, sizeof(got) - gotlen);
+			if (rv == -1 || gotlen + rv != wrappedlen ||
+			    memcmp(got, wrapped, wrappedlen) != 0) {
+				printf("%s enc mismatch: %zu bytes\n", names[e],
+				    datalen);
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
+
+static int
+testdec(void)
+{
+	size_t (*decoders[])(char const *, size_t, u_char *, size_t, size_t *) = {
+		b64_decblocks_scalar,
+#ifdef B64_X86
+		b64_decblocks_sse41,
+		b64_decblocks_avx2,
+#endif
+	};
+	const char *names[] = { "scalar", "sse4.1", "avx2" };
+	size_t ndecoders = sizeof(decoders) / sizeof(decoders[0]);
+	char str[1000];
+	u_char want[800], got[800];
+	int i, d, wantlen, gotlen, failed = 0;
+
+#ifdef B64_X86
+	if (!__builtin_cpu_supports("avx2"))
+		ndecoders--;
+	if (!__builtin_cpu_supports("sse4.1"))
+		ndecoders--;
+#endif
+	for (i = 0; i < 200000; i++) {
+		size_t len = mkinput(str, sizeof(str));
+		size_t targsize = rng() % 2 ? sizeof(want) : rng() % (len + 1);
+
+		memset(want, 0, sizeof(want));
+		wantlen = old_pton(str, want, targsize);
+		for (d = 0; d < ndecoders; d++) {
+			b64_decblocks = decoders[d];
+
+			memset(got, 0, sizeof(got));
+			gotlen = reopb64_pton(str, got, targsize);
+			if (gotlen != wantlen ||
+			    (wantlen > 0 && memcmp(got, want, wantlen) != 0)) {
+				printf("%s pton mismatch: %d %d \"%s\" %zu\n",
+				    names[d], wantlen, gotlen, str, targsize);
+				failed = 1;
+			}
+			if (targsize != sizeof(want) || strchr(str, '-'))
+				continue;
+
+			/* incremental, in random pieces */
+			struct reopb64_dec dec;
+			size_t pos = 0, used;
+			reopb64_dec_init(&dec);
+			gotlen = 0;
+			while (pos < len) {
+				size_t amt = 1 + rng() % (len - pos);
+				int rv = reopb64_dec_update(&dec, str + pos, amt,
+				    got + gotlen, sizeof(got) - gotlen, &used);
+				if (rv == -1) {
+					gotlen = -1;
+					break;
+				}
+				gotlen += rv;
+				pos += used;
+			}
+			if (gotlen != -1 && reopb64_dec_final(&dec) == -1)
+				gotlen = -1;
+			if (gotlen != wantlen ||
+			    (wantlen > 0 && memcmp(got, want, wantlen) != 0)) {
+				printf("%s dec mismatch: %d %d \"%s\"\n",
+				    names[d], wantlen, gotlen, str);
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
+
+int
+main(void)
+{
+#ifdef B64_X86
+	__builtin_cpu_init();
+#endif
+	return testenc() | testdec();
+}
@@ -0,0 +1,179 @@
+/*
+ * differential test of the bcrypt_pbkdf hash, alone and in batches, against
+ * the original version built on the generic blowfish key schedule.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../other/blowfish.c"
+#include "../other/bcrypt_pbkdf.c"
+
+static void
+old_bcrypt_hash(u_int8_t *sha2pass, u_int8_t *sha2salt, u_int8_t *out)
+{
+	blf_ctx state;
+	u_int8_t ciphertext[BCRYPT_HASHSIZE] =
+	    "OxychromaticBlowfishSwatDynamite";
+	uint32_t cdata[BCRYPT_BLOCKS];
+	int i;
+	uint16_t j;
+	size_t shalen = SHA512_DIGEST_LENGTH;
+
+	Blowfish_initstate(&state);
+	Blowfish_expandstate(&state, sha2salt, shalen, sha2pass, shalen);
+	for (i = 0; i < 64; i++) {
+		Blowfish_expand0state(&state, sha2salt, shalen);
+		Blowfish_expand0state(&state, sha2pass, shalen);
+	}
+
+	j = 0;
+	for (i = 0; i < BCRYPT_BLOCKS; i++)
+		cdata[i] = Blowfish_stream2word(ciphertext, sizeof(ciphertext),
+		    &j);
+	for (i = 0; i < 64; i++)
+		blf_enc(&state, cdata, sizeof(cdata) / sizeof(uint64_t));
+
+	for (i = 0; i < BCRYPT_BLOCKS; i++) {
+		out[4 * i + 3] = (cdata[i] >> 24) & 0xff;
+		out[4 * i + 2] = (cdata[i] >> 16) & 0xff;
+		out[4 * i + 1] = (cdata[i] >> 8) & 0xff;
+		out[4 * i + 0] = cdata[i] & 0xff;
+	}
+}
+
+static int
+old_bcrypt_pbkdf(const char *pass, size_t passlen, const u_int8_t *salt,
+    size_t saltlen, u_int8_t *key, size_t keylen, unsigned int rounds)
+{
+	u_int8_t sha2pass[SHA512_DIGEST_LENGTH];
+	u_int8_t sha2salt[SHA512_DIGEST_LENGTH];
+	u_int8_t out[BCRYPT_HASHSIZE];
+	u_int8_t tmpout[BCRYPT_HASHSIZE];
+	u_int8_t countsalt[256 + 4];
+	size_t i, j, amt, stride;
+	uint32_t count;
+	size_t origkeylen = keylen;
+
+	stride = (keylen + sizeof(out) - 1) / sizeof(out);
+	amt = (keylen + stride - 1) / stride;
+	memcpy(countsalt, salt, saltlen);
+	crypto_hash_sha512(sha2pass, (const u_int8_t *)pass, passlen);
+	for (count = 1; keylen > 0; count++) {
+		countsalt[saltlen + 0] = (count >> 24) & 0xff;
+		countsalt[saltlen + 1] = (count >> 16) & 0xff;
+		countsalt[saltlen + 2] = (count >> 8) & 0xff;
+		countsalt[saltlen + 3] = count & 0xff;
+		crypto_hash_sha512(sha2salt, countsalt, saltlen + 4);
+		old_bcrypt_hash(sha2pass, sha2salt, tmpout);
+		memcpy(out, tmpout, sizeof(out));
+		for (i = 1; i < rounds; i++) {
+			crypto_hash_sha512(sha2salt, tmpout, sizeof(tmpout));
+			old_bcrypt_hash(sha2pass, sha2salt, tmpout);
+			for (j = 0; j < sizeof(out); j++)
+				out[j] ^= tmpout[j];
+		}
+		amt = MIN(amt, keylen);
+		for (i = 0; i < amt; i++) {
+			size_t dest = i * stride + (count - 1);
+			if (dest >= origkeylen)
+				break;
+			key[dest] = out[i];
+		}
+		keylen -= i;
+	}
+	return 0;
+}
+
+static uint64_t rngstate = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rng(void)
+{
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 7;
+	rngstate ^= rngstate << 17;
+	return rngstate;
+}
+
+static int
+testone(void)
+{
+	char pass[100];
+	u_int8_t salt[256], want[100], got[100];
+	size_t passlen, saltlen, keylen, j;
+	unsigned int rounds;
+	int i, failed = 0;
+
+	for (i = 0; i < 64; i++) {
+		passlen = 1 + rng() % sizeof(pass);
+		saltlen = 1 + rng() % sizeof(salt);
+		keylen = 1 + rng() % sizeof(want);
+		rounds = 1 + rng() % 4;
+		for (j = 0; j < passlen; j++)
+			pass[j] = rng();
+		for (j = 0; j < saltlen; j++)
+			salt[j] = rng();
+
+		old_bcrypt_pbkdf(pass, passlen, salt, saltlen, want, keylen,
+		    rounds);
+		if (bcrypt_pbkdf(pass, passlen, salt, saltlen, got, keylen,
+		    rounds) != 0 || memcmp(got, want, keylen) != 0) {
+			printf("bcrypt_pbkdf mismatch: %zu %zu %zu %u\n",
+			    passlen, saltlen, keylen, rounds);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+/* batches of mixed sizes and rounds, with some invalid jobs */
+static int
+testbatch(void)
+{
+	struct bcrypt_job jobs[20];
+	char pass[20][40];
+	u_int8_t salt[20][40], want[20][80], got[20][80];
+	size_t njobs, n, j;
+	int i, failed = 0;
+
+	for (i = 0; i < 10; i++) {
+		njobs = 1 + rng() % 20;
+		for (n = 0; n < njobs; n++) {
+			struct bcrypt_job *job = &jobs[n];
+
+			job->pass = pass[n];
+			job->pass_len = 1 + rng() % sizeof(pass[n]);
+			job->salt = salt[n];
+			job->salt_len = 1 + rng() % sizeof(salt[n]);
+			job->key = got[n];
+			job->key_len = 1 + rng() % sizeof(got[n]);
+			job->rounds = rng() % 5;
+			for (j = 0; j < job->pass_len; j++)
+				pass[n][j] = rng();
+			for (j = 0; j < job->salt_len; j++)
+				salt[n][j] = rng();
+			if (job->rounds)
+				old_bcrypt_pbkdf(job->pass, job->pass_len,
+				    job->salt, job->salt_len, want[n],
+				    job->key_len, job->rounds);
+		}
+		bcrypt_pbkdf_batch(jobs, njobs);
+		for (n = 0; n < njobs; n++) {
+			struct bcrypt_job *job = &jobs[n];
+
+			if (job->rv != (job->rounds ? 0 : -1) || (job->rounds &&
+			    memcmp(got[n], want[n], job->key_len) != 0)) {
+				printf("bcrypt_pbkdf_batch mismatch: %zu of %zu\n",
+				    n, njobs);
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
+
+int
+main(void)
+{
+	return testone() | testbatch();
+}
@@ -4,10 +4,13 @@ set -e
 
 clean() {
 	rm -fr fakehome
-	rm -f mypub mysec yourpub yoursec
-	rm -f double.sig trip.txt warn.txt.enc warn.txt.sig danger.txt
+	rm -f mypub mysec yourpub yoursec theirpub theirsec
+	rm -f double.sig trip.txt warn.txt.enc warn.txt.sig danger.txt orig.txt.sig
 	rm -f error.log
 	rm -f thebigfile
+	rm -f b64test kdftest apitest
+	rm -f agent.sock agent.sig multi.enc multi.txt multi.sig argonpub argonsec
+	rm -f manifest.sig tree.sig link.txt relabel.sig same.txt
 }
 
 clean
@@ -25,12 +28,69 @@ cat orig.txt | env HOME=fakehome ../reop -Eb -s mysec -i gorilla -m - -x - |
 	../reop -D -s yoursec -p mypub -m - -x - > trip.txt
 diff -u orig.txt trip.txt
 
+cat orig.txt | env HOME=fakehome ../reop -Ec -s mysec -i gorilla -m - -x - |
+	../reop -D -s yoursec -p mypub -m - -x - > trip.txt
+diff -u orig.txt trip.txt
+
+cat orig.txt | env HOME=fakehome ../reop -Ebc -s mysec -i gorilla -m - -x - |
+	../reop -D -s yoursec -p mypub -m - -x - > trip.txt
+diff -u orig.txt trip.txt
+
 ../reop -S -s yoursec -m orig.txt -x - | env HOME=fakehome ../reop -Vq -x - -m orig.txt
 
+# the ring index is rebuilt when the ring changes
+test -f fakehome/.reop/pubkeyring.idx
+../reop -G -i monkey -p theirpub -s theirsec -n
+cat mypub theirpub >> fakehome/.reop/pubkeyring
+../reop -S -s theirsec -m orig.txt -x - | env HOME=fakehome ../reop -Vq -x - -m orig.txt
+
+# batch verify, keys from the ring
+../reop -S -s yoursec -m orig.txt
+../reop -S -s theirsec -m warn.txt
+env HOME=fakehome ../reop -Vq orig.txt warn.txt
+../reop -S -s yoursec -m warn.txt
+../reop -Vq -p theirpub orig.txt warn.txt 2> error.log || true
+printf "reop: orig.txt: verification failed: checked against wrong key\nreop: warn.txt: verification failed: checked against wrong key\n" | diff -u - error.log
+rm -f warn.txt.sig
+env HOME=fakehome ../reop -V danger.txt warn.txt orig.txt > trip.txt 2> error.log || true
+echo orig.txt: OK | diff -u - trip.txt
+printf "reop: danger.txt: could not read\nreop: warn.txt: could not read warn.txt.sig\n" | diff -u - error.log
+rm -f orig.txt.sig
+cat orig.txt | env HOME=fakehome ../reop -E -s mysec -i monkey -m - -x - |
+	../reop -D -s theirsec -p mypub -m - -x - > trip.txt
+diff -u orig.txt trip.txt
+
+# many recipients
+env HOME=fakehome ../reop -E -s mysec -p yourpub -i monkey -p mypub -m warn.txt -x - > multi.enc
+../reop -D -s yoursec -p mypub -m trip.txt -x multi.enc
+diff -u warn.txt trip.txt
+env HOME=fakehome ../reop -D -s theirsec -m trip.txt -x multi.enc
+diff -u warn.txt trip.txt
+env HOME=fakehome ../reop -E -s mysec -p yourpub -i monkey -m warn.txt -x multi.enc
+env HOME=fakehome ../reop -D -s theirsec -m trip.txt -x multi.enc
+diff -u warn.txt trip.txt
+../reop -D -s yoursec -p mypub -m trip.txt -x multi.enc
+diff -u warn.txt trip.txt
+head -c 200000 /dev/urandom > multi.txt
+../reop -Eb -s mysec -p yourpub -p theirpub -m multi.txt -x multi.enc
+../reop -D -s theirsec -p mypub -m trip.txt -x multi.enc
+cmp multi.txt trip.txt
+../reop -D -s mysec -p mypub -m trip.txt -x multi.enc 2> error.log || true
+echo reop: key mismatch | diff -u - error.log
+
 env REOP_PASSPHRASE=apples ../reop -Eb -m warn.txt
 env REOP_PASSPHRASE=apples ../reop -D -x warn.txt.enc -m danger.txt
 diff -u warn.txt danger.txt
 
+env REOP_PASSPHRASE=cherries ../reop -G -k interactive -p argonpub -s argonsec
+env REOP_PASSPHRASE=cherries ../reop -S -s argonsec -m warn.txt -x - |
+	../reop -Vq -p argonpub -m warn.txt -x -
+env REOP_PASSPHRASE=apples ../reop -Ec -k argon2id:1:8 -m warn.txt -x - |
+	env REOP_PASSPHRASE=apples ../reop -D -x - -m - | diff -u warn.txt -
+../reop -K -k bcrypt 10 | grep -q '^bcrypt:[0-9]*$'
+env REOP_PASSPHRASE=apples ../reop -E -k `../reop -K -k argon2id:1:8 10` -m warn.txt -x - |
+	env REOP_PASSPHRASE=apples ../reop -D -x - -m - | diff -u warn.txt -
+
 env REOP_PASSPHRASE=bananas ../reop -E -m warn.txt
 ../reop -Se -s mysec -m warn.txt
 env REOP_PASSPHRASE=bananas ../reop -D -x warn.txt.enc -m danger.txt
@@ -39,13 +99,134 @@ diff -u warn.txt danger.txt
 ../reop -Vq -p yourpub -x warn.txt.sig 2> error.log || true
 echo reop: verification failed: checked against wrong key | diff -u - error.log
 
+# the output may overwrite the input, except for chunked messages
+cp orig.txt same.txt
+../reop -Se -s mysec -m same.txt -x same.txt
+../reop -Vq -p mypub -x same.txt
+cp orig.txt same.txt
+../reop -E -s mysec -p yourpub -m same.txt -x same.txt
+../reop -D -s yoursec -p mypub -x same.txt -m same.txt
+diff -u orig.txt same.txt
+../reop -Eb -s mysec -p yourpub -m same.txt -x same.txt
+../reop -D -s yoursec -p mypub -x same.txt -m same.txt
+diff -u orig.txt same.txt
+../reop -Ec -s mysec -p yourpub -m same.txt -x same.txt 2> error.log || true
+echo reop: same.txt is both input and output | diff -u - error.log
+diff -u orig.txt same.txt
+
 ../reop -Se -s yoursec -m warn.txt.sig -x double.sig
+
+# streamed signatures
+cat multi.txt | ../reop -Sc -s yoursec -m - -x multi.sig
+../reop -Vq -p yourpub -m multi.txt -x multi.sig
+cat multi.txt | ../reop -Vq -p yourpub -m - -x multi.sig
+../reop -Vq -p yourpub -m warn.txt -x multi.sig 2> error.log || true
+echo reop: signature verification failed | diff -u - error.log
+cp multi.sig multi.txt.sig
+env HOME=fakehome ../reop -Vq multi.txt
+rm -f multi.txt.sig
 ../reop -Vq -p yourpub -x double.sig
 
+# hash tree signatures
+../reop -St -s yoursec -m multi.txt -x tree.sig
+../reop -Vq -p yourpub -m multi.txt -x tree.sig
+../reop -Vq -r 65530:134470 -p yourpub -m multi.txt -x tree.sig
+(head -c 150000 multi.txt; tail -c +150001 multi.txt | head -c 1 |
+	LC_ALL=C tr '\000-\377' '\001-\377\000'; tail -c +150002 multi.txt) > trip.txt
+../reop -Vq -p yourpub -m trip.txt -x tree.sig 2> error.log || true
+echo reop: signature verification failed | diff -u - error.log
+../reop -Vq -r 65530:65540 -p yourpub -m trip.txt -x tree.sig
+../reop -Vq -r 140000:100 -p yourpub -m trip.txt -x tree.sig 2> error.log || true
+echo reop: signature verification failed | diff -u - error.log
+sed '3s/^RV/RW/' tree.sig > relabel.sig
+../reop -Vq -p yourpub -m multi.txt -x relabel.sig 2> error.log || true
+echo reop: signature verification failed | diff -u - error.log
+../reop -Vq -r 0:1 -p yourpub -m orig.txt -x multi.sig 2> error.log || true
+echo reop: only hash tree signatures can check a range | diff -u - error.log
+
+# manifests
+../reop -SM -s yoursec -x manifest.sig orig.txt warn.txt multi.txt
+../reop -VM -p yourpub -x manifest.sig > trip.txt
+printf 'orig.txt: OK\nwarn.txt: OK\nmulti.txt: OK\n' | diff -u - trip.txt
+../reop -VMq -p yourpub -x manifest.sig warn.txt
+../reop -VM -p yourpub -x manifest.sig warn.txt orig.txt warn.txt > trip.txt
+printf 'warn.txt: OK\norig.txt: OK\n' | diff -u - trip.txt
+cp warn.txt danger.txt
+echo tampered >> warn.txt
+../reop -VMq -p yourpub -x manifest.sig 2> error.log || true
+cp danger.txt warn.txt
+echo reop: warn.txt: hash mismatch | diff -u - error.log
+../reop -VMq -p yourpub -x manifest.sig danger.txt 2> error.log || true
+echo reop: danger.txt: not in manifest | diff -u - error.log
+ln -s orig.txt link.txt
+../reop -SM -s yoursec -x manifest.sig orig.txt link.txt 2> error.log || true
+echo reop: link.txt: unable to read | diff -u - error.log
+
+# agent
+../reop -Z -z agent.sock -s yoursec &
+agentpid=$!
+tries=0
+while [ ! -S agent.sock ] ; do
+	tries=$((tries + 1))
+	if [ $tries -gt 10 ] || ! kill -0 $agentpid 2> /dev/null ; then
+		echo agent did not start
+		exit 1
+	fi
+	sleep 1
+done
+env REOP_AGENT_SOCK=agent.sock ../reop -S -m orig.txt -x agent.sig
+../reop -Vq -p yourpub -m orig.txt -x agent.sig
+env REOP_AGENT_SOCK=agent.sock ../reop -Sc -m orig.txt -x agent.sig
+../reop -Vq -p yourpub -m orig.txt -x agent.sig
+env REOP_AGENT_SOCK=agent.sock ../reop -St -m multi.txt -x agent.sig
+../reop -Vq -p yourpub -m multi.txt -x agent.sig
+cat orig.txt | env HOME=fakehome ../reop -E -s mysec -i gorilla -m - -x - |
+	env REOP_AGENT_SOCK=agent.sock ../reop -D -p mypub -m - -x - > trip.txt
+diff -u orig.txt trip.txt
+cat orig.txt | env HOME=fakehome ../reop -Ec -s mysec -i gorilla -m - -x - |
+	env REOP_AGENT_SOCK=agent.sock ../reop -D -p mypub -m - -x - > trip.txt
+diff -u orig.txt trip.txt
+kill $agentpid
+wait $agentpid || true
+
+# chunk boundaries, across several groups of chunks
+head -c 589824 /dev/urandom > multi.txt
+env REOP_PASSPHRASE=apples ../reop -Ec -m multi.txt -x - |
+	env REOP_PASSPHRASE=apples ../reop -D -x - -m - | cmp - multi.txt
+env REOP_PASSPHRASE=apples ../reop -Ebc -m multi.txt -x multi.enc
+env REOP_PASSPHRASE=apples ../reop -D -x multi.enc -m - | cmp - multi.txt
+head -c $(($(wc -c < multi.enc) - 16)) multi.enc > trip.txt
+env REOP_PASSPHRASE=apples ../reop -D -x trip.txt -m /dev/null 2> error.log || true
+echo reop: invalid encrypted message: trip.txt | diff -u - error.log
+env REOP_PASSPHRASE=apples ../reop -Ec -m multi.txt -x trip.txt
+echo trailing >> trip.txt
+env REOP_PASSPHRASE=apples ../reop -D -x trip.txt -m /dev/null 2> error.log || true
+echo reop: invalid encrypted message: trip.txt | diff -u - error.log
+env REOP_PASSPHRASE=apples ../reop -D -r 65530:200000 -x multi.enc -m trip.txt
+tail -c +65531 multi.txt | head -c 200000 | cmp - trip.txt
+env REOP_PASSPHRASE=apples ../reop -D -r 589800:24 -x multi.enc -m trip.txt
+tail -c 24 multi.txt | cmp - trip.txt
+env REOP_PASSPHRASE=apples ../reop -D -r 589800:25 -x multi.enc -m trip.txt 2> error.log || true
+echo reop: range is past the end of the message | diff -u - error.log
+
 # large files
 dd if=/dev/zero bs=1M count=1 seek=1400 of=thebigfile > /dev/null 2>&1
 env REOP_PASSPHRASE=apples ../reop -Eb -m thebigfile -x /dev/null 2> error.log || true
 echo reop: thebigfile is too large | diff -u - error.log
+env REOP_PASSPHRASE=apples ../reop -Ec -m thebigfile -x - |
+	env REOP_PASSPHRASE=apples ../reop -D -x - -m - | cmp - thebigfile
+
+# base64 encoders and decoders, against the original
+${CC:-cc} -O2 -I../other -o b64test b64test.c
+./b64test
+
+# bcrypt kdf, against the generic blowfish key schedule
+make -C .. tests/kdftest > /dev/null
+./kdftest
+
+# library calls the command line doesn't make
+make -C .. tests/apitest > /dev/null
+./apitest
 
 echo C passed.
 